@@ -0,0 +1,402 @@
+/*
+ * base64.c - base64 codec with SSSE3/AVX2 fast paths
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "base64.h"
+#include "stoken-internal.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define B64_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * The vector loops only handle whole blocks of clean input: 16 or 32
+ * alphabet characters at a time, with room for a full vector store in the
+ * output buffer.  Anything else (padding, whitespace, short tails, a
+ * nearly-full output buffer) drops to the scalar code, which resumes on a
+ * 4-character boundary and therefore sees exactly the same state it would
+ * have seen had it processed the whole string itself.
+ */
+
+static const char b64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define B64_SKIP		0x80
+#define B64_PAD			0x81
+
+static const uint8_t b64_values[256] = {
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, 0x3e, B64_SKIP, B64_SKIP, B64_SKIP, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+	0x3c, 0x3d, B64_SKIP, B64_SKIP, B64_SKIP, B64_PAD, B64_SKIP, B64_SKIP,
+	B64_SKIP, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+	0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+	0x17, 0x18, 0x19, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+	0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+	0x31, 0x32, 0x33, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+	B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP, B64_SKIP,
+};
+
+/********************************************************************
+ * Scalar
+ ********************************************************************/
+
+static void enc_scalar(const uint8_t *in, unsigned long len, char *out)
+{
+	unsigned long i;
+
+	for (i = 0; i + 3 <= len; i += 3) {
+		uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+		*(out++) = b64_chars[(v >> 18) & 0x3f];
+		*(out++) = b64_chars[(v >> 12) & 0x3f];
+		*(out++) = b64_chars[(v >> 6) & 0x3f];
+		*(out++) = b64_chars[v & 0x3f];
+	}
+	if (i < len) {
+		uint32_t v = in[i] << 16;
+
+		if (i + 1 < len)
+			v |= in[i + 1] << 8;
+		*(out++) = b64_chars[(v >> 18) & 0x3f];
+		*(out++) = b64_chars[(v >> 12) & 0x3f];
+		*(out++) = i + 1 < len ? b64_chars[(v >> 6) & 0x3f] : '=';
+		*(out++) = '=';
+	}
+	*out = 0;
+}
+
+static int dec_scalar(const uint8_t *in, unsigned long len, uint8_t *out,
+		      unsigned long avail, unsigned long *written)
+{
+	unsigned long i, pos = 0;
+	uint32_t v = 0;
+	int n = 0, pad = 0;
+
+	for (i = 0; i < len; i++) {
+		uint8_t val = b64_values[in[i]];
+
+		if (val == B64_PAD) {
+			pad++;
+			val = 0;
+		} else if (val == B64_SKIP) {
+			continue;
+		} else if (pad) {
+			/* no data is allowed after the padding */
+			return ERR_GENERAL;
+		}
+
+		v = (v << 6) | val;
+		if (++n == 4) {
+			if (pad > 2 || pos + 3 - pad > avail)
+				return ERR_GENERAL;
+			out[pos++] = v >> 16;
+			if (pad < 2)
+				out[pos++] = v >> 8;
+			if (pad < 1)
+				out[pos++] = v;
+			n = 0;
+			v = 0;
+		}
+	}
+
+	if (n)
+		return ERR_GENERAL;
+	*written = pos;
+	return ERR_NONE;
+}
+
+/********************************************************************
+ * SSSE3 / AVX2
+ *
+ * Wojciech Mula's and Daniel Lemire's vector base64 algorithms, as
+ * popularized by aklomp/base64.
+ ********************************************************************/
+
+#ifdef B64_X86
+
+/* 12 input bytes -> 16 characters per iteration; reads 16 bytes */
+__attribute__((target("ssse3")))
+static unsigned long enc_ssse3(const uint8_t *in, unsigned long len,
+			       char *out)
+{
+	const __m128i shuf = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					   7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+					  -4, -4, -4, -4, -19, -16, 0, 0);
+	unsigned long i = 0;
+
+	for (; len - i >= 16; i += 12, out += 16) {
+		__m128i v, t0, t1, idx, sub;
+
+		v = _mm_shuffle_epi8(_mm_loadu_si128((const void *)&in[i]),
+				     shuf);
+		t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+				     _mm_set1_epi32(0x04000040));
+		t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+				     _mm_set1_epi32(0x01000010));
+		idx = _mm_or_si128(t0, t1);
+
+		sub = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		sub = _mm_sub_epi8(sub, _mm_cmpgt_epi8(idx, _mm_set1_epi8(25)));
+		v = _mm_add_epi8(idx, _mm_shuffle_epi8(lut, sub));
+		_mm_storeu_si128((void *)out, v);
+	}
+	return i;
+}
+
+/* 16 characters -> 12 bytes per iteration; writes 16 bytes */
+__attribute__((target("ssse3")))
+static void dec_ssse3(const uint8_t *in, unsigned long len, uint8_t *out,
+		      unsigned long avail, unsigned long *in_pos,
+		      unsigned long *out_pos)
+{
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11,
+					     0x11, 0x11, 0x11, 0x11,
+					     0x11, 0x11, 0x13, 0x1a,
+					     0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02,
+					     0x04, 0x08, 0x04, 0x08,
+					     0x10, 0x10, 0x10, 0x10,
+					     0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					       0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+					   8, 14, 13, 12, -1, -1, -1, -1);
+	unsigned long i = *in_pos, pos = *out_pos;
+
+	for (; len - i >= 16 && avail - pos >= 16; i += 16, pos += 12) {
+		__m128i str, hi_nib, lo, hi, roll;
+
+		str = _mm_loadu_si128((const void *)&in[i]);
+		hi_nib = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(str, mask_2f));
+		hi = _mm_shuffle_epi8(lut_hi, hi_nib);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+						     _mm_setzero_si128())) !=
+		    0xffff)
+			break;
+
+		roll = _mm_shuffle_epi8(lut_roll,
+			_mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f), hi_nib));
+		str = _mm_add_epi8(str, roll);
+
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((void *)&out[pos], _mm_shuffle_epi8(str, pack));
+	}
+	*in_pos = i;
+	*out_pos = pos;
+}
+
+/* 24 input bytes -> 32 characters per iteration; reads 28 bytes */
+__attribute__((target("avx2")))
+static unsigned long enc_avx2(const uint8_t *in, unsigned long len,
+			      char *out)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					      7, 6, 8, 7, 10, 9, 11, 10,
+					      1, 0, 2, 1, 4, 3, 5, 4,
+					      7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+					     -4, -4, -4, -4, -19, -16, 0, 0,
+					     65, 71, -4, -4, -4, -4, -4, -4,
+					     -4, -4, -4, -4, -19, -16, 0, 0);
+	unsigned long i = 0;
+
+	for (; len - i >= 28; i += 24, out += 32) {
+		__m256i v, t0, t1, idx, sub;
+
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((const void *)&in[i])),
+			_mm_loadu_si128((const void *)&in[i + 12]), 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		t0 = _mm256_mulhi_epu16(
+			_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+			_mm256_set1_epi32(0x04000040));
+		t1 = _mm256_mullo_epi16(
+			_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+			_mm256_set1_epi32(0x01000010));
+		idx = _mm256_or_si256(t0, t1);
+
+		sub = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		sub = _mm256_sub_epi8(sub,
+			_mm256_cmpgt_epi8(idx, _mm256_set1_epi8(25)));
+		v = _mm256_add_epi8(idx, _mm256_shuffle_epi8(lut, sub));
+		_mm256_storeu_si256((void *)out, v);
+	}
+	return i;
+}
+
+/* 32 characters -> 24 bytes per iteration; writes 32 bytes */
+__attribute__((target("avx2")))
+static void dec_avx2(const uint8_t *in, unsigned long len, uint8_t *out,
+		     unsigned long avail, unsigned long *in_pos,
+		     unsigned long *out_pos)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	unsigned long i = *in_pos, pos = *out_pos;
+
+	for (; len - i >= 32 && avail - pos >= 32; i += 32, pos += 24) {
+		__m256i str, hi_nib, lo, hi, roll;
+
+		str = _mm256_loadu_si256((const void *)&in[i]);
+		hi_nib = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+		lo = _mm256_shuffle_epi8(lut_lo,
+					 _mm256_and_si256(str, mask_2f));
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nib);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+
+		roll = _mm256_shuffle_epi8(lut_roll,
+			_mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2f), hi_nib));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		str = _mm256_permutevar8x32_epi32(str, perm);
+		_mm256_storeu_si256((void *)&out[pos], str);
+	}
+	*in_pos = i;
+	*out_pos = pos;
+}
+
+#endif /* B64_X86 */
+
+/********************************************************************
+ * Dispatch
+ ********************************************************************/
+
+static int b64_best = B64_SCALAR;
+static pthread_once_t b64_once = PTHREAD_ONCE_INIT;
+
+static void b64_detect(void)
+{
+#ifdef B64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		b64_best = B64_AVX2;
+	else if (__builtin_cpu_supports("ssse3"))
+		b64_best = B64_SSSE3;
+#endif
+}
+
+int b64_best_impl(void)
+{
+	pthread_once(&b64_once, &b64_detect);
+	return b64_best;
+}
+
+const char *b64_impl_name(int impl)
+{
+	static const char * const names[] = { "scalar", "ssse3", "avx2" };
+
+	return impl >= 0 && impl < B64_N_IMPL ? names[impl] : "unknown";
+}
+
+int b64_encode_impl(int impl, const uint8_t *in, unsigned long len,
+		    char *out, unsigned long *out_len)
+{
+	unsigned long need = 4 * ((len + 2) / 3), done = 0;
+
+	if (*out_len < need + 1)
+		return ERR_BAD_LEN;
+
+	if (impl > b64_best_impl())
+		impl = b64_best_impl();
+#ifdef B64_X86
+	if (impl >= B64_AVX2)
+		done = enc_avx2(in, len, out);
+	if (impl >= B64_SSSE3)
+		done += enc_ssse3(in + done, len - done, out + done / 3 * 4);
+#endif
+	enc_scalar(in + done, len - done, out + done / 3 * 4);
+
+	*out_len = need;
+	return ERR_NONE;
+}
+
+int b64_decode_impl(int impl, const char *in, unsigned long len,
+		    uint8_t *out, unsigned long *out_len)
+{
+	const uint8_t *str = (const uint8_t *)in;
+	unsigned long i = 0, pos = 0, tail;
+	int ret;
+
+	if (impl > b64_best_impl())
+		impl = b64_best_impl();
+#ifdef B64_X86
+	if (impl >= B64_AVX2)
+		dec_avx2(str, len, out, *out_len, &i, &pos);
+	if (impl >= B64_SSSE3)
+		dec_ssse3(str, len, out, *out_len, &i, &pos);
+#endif
+	ret = dec_scalar(str + i, len - i, out + pos, *out_len - pos, &tail);
+	if (ret == ERR_NONE)
+		*out_len = pos + tail;
+	return ret;
+}
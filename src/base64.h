@@ -0,0 +1,64 @@
+/*
+ * base64.h - internal base64 codec
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __STOKEN_BASE64_H__
+#define __STOKEN_BASE64_H__
+
+#include <stdint.h>
+
+enum {
+	B64_SCALAR = 0,
+	B64_SSSE3,
+	B64_AVX2,
+	B64_N_IMPL,
+};
+
+/* fastest implementation supported by this CPU */
+int b64_best_impl(void);
+const char *b64_impl_name(int impl);
+
+/*
+ * Same conventions as tomcrypt: OUT_LEN is the buffer size on entry and
+ * the number of bytes written (excluding the encoder's NUL) on exit.  The
+ * decoder skips characters outside the base64 alphabet, and rejects
+ * truncated input or data following the '=' padding.  Returns ERR_NONE,
+ * ERR_BAD_LEN (encode: output buffer too small) or ERR_GENERAL.
+ *
+ * IMPL values above b64_best_impl() are clamped; this is only useful for
+ * differential testing.
+ */
+int b64_encode_impl(int impl, const uint8_t *in, unsigned long len,
+		    char *out, unsigned long *out_len);
+int b64_decode_impl(int impl, const char *in, unsigned long len,
+		    uint8_t *out, unsigned long *out_len);
+
+static inline int b64_encode(const uint8_t *in, unsigned long len,
+			     char *out, unsigned long *out_len)
+{
+	return b64_encode_impl(b64_best_impl(), in, len, out, out_len);
+}
+
+static inline int b64_decode(const char *in, unsigned long len,
+			     uint8_t *out, unsigned long *out_len)
+{
+	return b64_decode_impl(b64_best_impl(), in, len, out, out_len);
+}
+
+#endif /* !__STOKEN_BASE64_H__ */
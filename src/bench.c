@@ -0,0 +1,403 @@
+/*
+ * bench.c - crypto backend self test and microbenchmarks
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_TOMCRYPT
+#include <tomcrypt.h>
+#endif
+
+#include "base64.h"
+#include "crypto.h"
+#include "securid.h"
+#include "stoken-internal.h"
+
+static const struct crypto_ops *backends[] = {
+#ifdef HAVE_TOMCRYPT
+	&crypto_tomcrypt_ops,
+#endif
+#ifdef HAVE_OPENSSL
+	&crypto_openssl_ops,
+#endif
+#ifdef HAVE_NETTLE
+	&crypto_nettle_ops,
+#endif
+	NULL,
+};
+
+/* iteration counts are multiplied by argv[1], if given */
+static int scale = 1;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const char *test, double start, long n)
+{
+	printf("%-10s %-24s %10.1f ns/op\n", name, test,
+	       (now() - start) * 1e9 / n);
+}
+
+static void bench_one(const struct crypto_ops *ops)
+{
+	uint8_t key[AES256_KEY_SIZE], buf[64 * AES_BLOCK_SIZE];
+	uint8_t hash[SHA256_HASH_SIZE];
+	double start;
+	long i, n;
+
+	memset(key, 0x5a, sizeof(key));
+	memset(buf, 0xa5, sizeof(buf));
+
+	/* securid_mac() pattern: new key for every block */
+	n = 200000L * scale;
+	start = now();
+	for (i = 0; i < n; i++)
+		ops->aes128_ecb_encrypt(buf, key, buf, 1);
+	report(ops->name, "aes128 rekey+1 block", start, n);
+
+	n = 20000L * scale;
+	start = now();
+	for (i = 0; i < n; i++)
+		ops->aes128_ecb_encrypt(key, buf, buf, 64);
+	report(ops->name, "aes128 64 blocks", start, n);
+
+	n = 20000L * scale;
+	start = now();
+	for (i = 0; i < n; i++)
+		ops->aes256_cbc_encrypt(key, buf, 18 * AES_BLOCK_SIZE, key,
+					buf);
+	report(ops->name, "aes256-cbc 288 bytes", start, n);
+
+	n = 200000L * scale;
+	start = now();
+	for (i = 0; i < n; i++)
+		ops->sha256(buf, 64, hash);
+	report(ops->name, "sha256 64 bytes", start, n);
+
+	n = 100000L * scale;
+	start = now();
+	for (i = 0; i < n; i++)
+		ops->hmac_sha256(key, SHA256_HASH_SIZE, buf, 256, hash);
+	report(ops->name, "hmac-sha256 256 bytes", start, n);
+
+	n = 100L * scale;
+	start = now();
+	for (i = 0; i < n; i++)
+		ops->pbkdf2_sha256(key, 24, buf, V3_NONCE_BYTES, 1000, hash);
+	report(ops->name, "pbkdf2 1000 rounds", start, n);
+}
+
+/********************************************************************
+ * base64
+ ********************************************************************/
+
+#define B64_MAX_BYTES		400
+#define B64_MAX_CHARS		(2 * BASE64_INPUT_LEN(B64_MAX_BYTES))
+
+static uint32_t rng_state = 0x2545f491;
+
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static int b64_check_one(int impl, const char *str, unsigned long len,
+			 unsigned long avail)
+{
+	uint8_t ref[B64_MAX_CHARS], out[B64_MAX_CHARS];
+	unsigned long ref_len = avail, out_len = avail;
+	int ref_rc, rc;
+
+	ref_rc = b64_decode_impl(B64_SCALAR, str, len, ref, &ref_len);
+	rc = b64_decode_impl(impl, str, len, out, &out_len);
+	if (rc != ref_rc ||
+	    (rc == ERR_NONE && (out_len != ref_len || memcmp(out, ref, out_len))))
+		return -1;
+
+#ifdef HAVE_TOMCRYPT
+	/* the codec that libstoken used before */
+	out_len = avail;
+	rc = base64_decode((const unsigned char *)str, len, out, &out_len);
+	if ((rc == CRYPT_OK) != (ref_rc == ERR_NONE) ||
+	    (rc == CRYPT_OK && (out_len != ref_len || memcmp(out, ref, out_len))))
+		return -1;
+#endif
+	return 0;
+}
+
+/*
+ * Differential test: every vector implementation must agree with the
+ * scalar code (and with tomcrypt, if present) on random data, and on
+ * encodings corrupted with whitespace, junk, stray padding, truncation, and
+ * undersized output buffers.
+ */
+static int b64_differential(int impl)
+{
+	static const char junk[] = " \n\r\t=-_.%\x80\xff" "A";
+	uint8_t data[B64_MAX_BYTES];
+	char ref[B64_MAX_CHARS], enc[B64_MAX_CHARS], bad[B64_MAX_CHARS];
+	long iter;
+
+	for (iter = 0; iter < 20000L * scale; iter++) {
+		unsigned long len = rng() % B64_MAX_BYTES, i, ref_len, enc_len;
+		unsigned long bad_len, avail;
+		int j;
+
+		for (i = 0; i < len; i++)
+			data[i] = rng();
+
+		ref_len = enc_len = sizeof(enc);
+		if (b64_encode_impl(B64_SCALAR, data, len, ref, &ref_len) ||
+		    b64_encode_impl(impl, data, len, enc, &enc_len) ||
+		    enc_len != ref_len || strcmp(enc, ref))
+			return -1;
+
+		if (b64_check_one(impl, enc, enc_len, len) ||
+		    b64_check_one(impl, enc, enc_len, len ? len - 1 : 0))
+			return -1;
+
+		/* splice in a few junk characters */
+		memcpy(bad, enc, enc_len);
+		bad_len = enc_len;
+		for (j = rng() % 4; j > 0; j--) {
+			unsigned long at = rng() % (bad_len + 1);
+
+			memmove(&bad[at + 1], &bad[at], bad_len - at);
+			bad[at] = junk[rng() % (sizeof(junk) - 1)];
+			bad_len++;
+		}
+		if (rng() % 4 == 0 && bad_len)
+			bad_len -= rng() % bad_len;
+
+		avail = rng() % 2 ? sizeof(data) : len;
+		if (b64_check_one(impl, bad, bad_len, avail))
+			return -1;
+	}
+	return 0;
+}
+
+static void bench_b64(int impl)
+{
+	const char *name = b64_impl_name(impl);
+	uint8_t data[V3_BASE64_BYTES];
+	char enc[V3_BASE64_SIZE];
+	unsigned long len;
+	double start;
+	long i, n;
+
+	memset(data, 0xa5, sizeof(data));
+
+	n = 200000L * scale;
+	start = now();
+	for (i = 0; i < n; i++) {
+		len = sizeof(enc);
+		b64_encode_impl(impl, data, sizeof(data), enc, &len);
+	}
+	report(name, "base64 encode v3", start, n);
+
+	start = now();
+	for (i = 0; i < n; i++) {
+		len = sizeof(data);
+		b64_decode_impl(impl, enc, strlen(enc), data, &len);
+	}
+	report(name, "base64 decode v3", start, n);
+}
+
+/********************************************************************
+ * Multi-key AES
+ ********************************************************************/
+
+#define MK_MAX_BLOCKS		64
+
+/* the AES-NI path must match the backend, for every tail length */
+static int multikey_differential(void)
+{
+	uint8_t keys[MK_MAX_BLOCKS * AES_BLOCK_SIZE];
+	uint8_t in[MK_MAX_BLOCKS * AES_BLOCK_SIZE];
+	uint8_t ref[MK_MAX_BLOCKS * AES_BLOCK_SIZE];
+	uint8_t out[MK_MAX_BLOCKS * AES_BLOCK_SIZE];
+	long iter;
+	int i;
+
+	for (iter = 0; iter < 2000L * scale; iter++) {
+		int n = rng() % (MK_MAX_BLOCKS + 1);
+
+		for (i = 0; i < n * AES_BLOCK_SIZE; i++) {
+			keys[i] = rng();
+			in[i] = rng();
+		}
+		aes128_ecb_encrypt_multikey_impl(0, keys, in, ref, n);
+		aes128_ecb_encrypt_multikey_impl(1, keys, in, out, n);
+		if (memcmp(ref, out, n * AES_BLOCK_SIZE))
+			return -1;
+
+		/* in place */
+		aes128_ecb_encrypt_multikey_impl(1, keys, in, in, n);
+		if (memcmp(ref, in, n * AES_BLOCK_SIZE))
+			return -1;
+	}
+	return 0;
+}
+
+static void bench_multikey(void)
+{
+	uint8_t keys[16 * AES_BLOCK_SIZE], buf[16 * AES_BLOCK_SIZE];
+	double start;
+	long i, n;
+
+	memset(keys, 0x5a, sizeof(keys));
+	memset(buf, 0xa5, sizeof(buf));
+
+	n = 200000L * scale;
+	start = now();
+	for (i = 0; i < n; i += 16)
+		aes128_ecb_encrypt_multikey(keys, buf, buf, 16);
+	report("multikey", "aes128 rekey+1 block", start, n);
+}
+
+/********************************************************************
+ * Multi-lane PBKDF2
+ ********************************************************************/
+
+#define PB_MAX_N		19
+#define PB_MAX_PASS		80
+
+/* the vector lanes must match the backend, for every tail length */
+static int pbkdf2_differential(void)
+{
+	uint8_t pass[PB_MAX_N][PB_MAX_PASS], salt[PB_MAX_N * V3_NONCE_BYTES];
+	uint8_t ref[PB_MAX_N * SHA256_HASH_SIZE];
+	uint8_t out[PB_MAX_N * SHA256_HASH_SIZE];
+	const uint8_t *p[PB_MAX_N];
+	int len[PB_MAX_N], iter, i, j;
+
+	for (iter = 0; iter < 20 * scale; iter++) {
+		int n = rng() % (PB_MAX_N + 1), rounds = 1 + rng() % 50;
+
+		for (i = 0; i < n; i++) {
+			/* includes passwords longer than a SHA256 block */
+			len[i] = rng() % (PB_MAX_PASS + 1);
+			for (j = 0; j < len[i]; j++)
+				pass[i][j] = rng();
+			p[i] = pass[i];
+		}
+		for (i = 0; i < n * V3_NONCE_BYTES; i++)
+			salt[i] = rng();
+
+		pbkdf2_sha256_multi_impl(0, p, len, salt, V3_NONCE_BYTES,
+					 rounds, ref, n);
+		pbkdf2_sha256_multi_impl(1, p, len, salt, V3_NONCE_BYTES,
+					 rounds, out, n);
+		if (memcmp(ref, out, n * SHA256_HASH_SIZE))
+			return -1;
+	}
+	return 0;
+}
+
+static void bench_pbkdf2_multi(void)
+{
+	uint8_t pass[24], salt[8 * V3_NONCE_BYTES];
+	uint8_t out[8 * SHA256_HASH_SIZE];
+	const uint8_t *p[8];
+	int len[8];
+	double start;
+	long i, n;
+
+	memset(pass, 0x5a, sizeof(pass));
+	memset(salt, 0xa5, sizeof(salt));
+	for (i = 0; i < 8; i++) {
+		p[i] = pass;
+		len[i] = sizeof(pass);
+	}
+
+	n = 96L * scale;
+	start = now();
+	for (i = 0; i < n; i += 8)
+		pbkdf2_sha256_multi(p, len, salt, V3_NONCE_BYTES, 1000, out,
+				    8);
+	report("multilane", "pbkdf2 1000 rounds", start, n);
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret = 0;
+
+	if (argc > 1)
+		scale = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+
+	for (i = 0; backends[i]; i++) {
+		int rc = crypto_selftest(backends[i]);
+
+		printf("%-10s %-24s %10s%s\n", backends[i]->name, "self test",
+		       rc == ERR_NONE ? "ok" : "FAILED",
+		       backends[i] == crypto ? " (selected)" : "");
+		if (rc != ERR_NONE)
+			ret = 1;
+	}
+
+	for (i = B64_SCALAR + 1; i <= b64_best_impl(); i++) {
+		int rc = b64_differential(i);
+
+		printf("%-10s %-24s %10s\n", b64_impl_name(i),
+		       "base64 differential", rc == 0 ? "ok" : "FAILED");
+		if (rc)
+			ret = 1;
+	}
+
+	{
+		int rc = multikey_differential();
+
+		printf("%-10s %-24s %10s\n", "multikey", "aes128 differential",
+		       rc == 0 ? "ok" : "FAILED");
+		if (rc)
+			ret = 1;
+	}
+
+	{
+		int rc = pbkdf2_differential();
+
+		printf("%-10s %-24s %10s\n", "multilane",
+		       "pbkdf2 differential", rc == 0 ? "ok" : "FAILED");
+		if (rc)
+			ret = 1;
+	}
+
+	for (i = 0; backends[i]; i++)
+		bench_one(backends[i]);
+	bench_multikey();
+	bench_pbkdf2_multi();
+	for (i = B64_SCALAR; i <= b64_best_impl(); i++)
+		bench_b64(i);
+
+	return ret;
+}
@@ -20,7 +20,10 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -30,9 +33,9 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 
 #include "common.h"
+#include "qr.h"
 #include "stoken.h"
 #include "securid.h"
 #include "sdtid.h"
@@ -125,7 +128,7 @@ static int read_user_input(char *out, int max_len, int hide_chars)
 	stdin_echo(1);
 
 	if (hide_chars)
-		puts("");
+		prompt("\n");
 	return rc;
 }
 
@@ -152,6 +155,96 @@ static time_t adjusted_time(struct securid_token *t)
 	return 0;
 }
 
+/*
+ * v2 tokens only store a 15-bit devid hash, so with a long candidate list
+ * a match should be confirmed by decrypting the seed if --password is
+ * available.
+ */
+static int devid_confirmed(struct securid_token *t, const char *devid)
+{
+	struct securid_token tmp;
+	int rc;
+
+	if (t->v3 || !securid_pass_required(t) || !opt_password)
+		return 1;
+
+	tmp = *t;
+	rc = securid_decrypt_seed(&tmp, opt_password, devid);
+	memset(&tmp, 0, sizeof(tmp));
+	return rc == ERR_NONE;
+}
+
+/*
+ * Look for the token's device ID among the class GUIDs and the entries
+ * in --devid-file (one per line).
+ */
+static int find_devid(struct securid_token *t, char *devid)
+{
+	const struct stoken_guid *glist = stoken_get_guid_list();
+	char **list = NULL, line[BUFLEN];
+	int i, n = 0, n_guids, size = 0, base, ret = 0;
+	FILE *f = NULL;
+
+	for (n_guids = 0; glist[n_guids].tag != NULL; n_guids++)
+		;
+
+	if (opt_devid_file) {
+		f = fopen(opt_devid_file, "r");
+		if (!f)
+			die("error: can't open '%s'\n", opt_devid_file);
+	}
+
+	do {
+		char *p;
+
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			list = realloc(list, size * sizeof(*list));
+			if (!list)
+				die("out of memory\n");
+		}
+		if (n < n_guids) {
+			list[n] = xstrdup(glist[n].guid);
+			n++;
+			continue;
+		}
+		if (!f || fgets(line, sizeof(line), f) == NULL)
+			break;
+
+		p = line + strcspn(line, "\r\n");
+		*p = 0;
+		if (*line && *line != '#')
+			list[n++] = xstrdup(line);
+	} while (1);
+
+	if (f)
+		fclose(f);
+
+	for (base = 0; base < n; base = i + 1) {
+		i = securid_find_devid(t, (const char * const *)&list[base],
+				       n - base);
+		if (i < 0)
+			break;
+		i += base;
+		if (!devid_confirmed(t, list[i]))
+			continue;
+
+		if (i < n_guids)
+			prompt("Using class GUID for %s; use --devid to override\n",
+			       glist[i].long_name);
+		else
+			dbg("found device ID in '%s'\n", opt_devid_file);
+		xstrncpy(devid, list[i], BUFLEN);
+		ret = 1;
+		break;
+	}
+
+	for (i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
+	return ret;
+}
+
 static void request_devid(struct securid_token *t, char *devid)
 {
 	int i;
@@ -162,17 +255,8 @@ static void request_devid(struct securid_token *t, char *devid)
 			return;
 		}
 		warn("warning: --devid parameter is incorrect\n");
-	} else {
-		const struct stoken_guid *glist = stoken_get_guid_list();
-		for (i = 0; glist[i].tag != NULL; i++) {
-			if (securid_check_devid(t, glist[i].guid) == ERR_NONE) {
-				prompt("Using class GUID for %s; use --devid to override\n",
-				       glist[i].long_name);
-				strncpy(devid, glist[i].guid, BUFLEN);
-				return;
-			}
-		}
-	}
+	} else if (find_devid(t, devid))
+		return;
 
 	prompt("This token is bound to a specific device.\n");
 	for (i = 0; ; i++) {
@@ -317,61 +401,29 @@ static void print_formatted(const char *buf)
 	free(formatted);
 }
 
-static int fork_and_wait(void)
+static void write_qr(const char *filename, const char *str)
 {
-	pid_t child = fork();
+	struct qr_code qr;
+	FILE *f;
+	int rc;
 
-	if (child < 0)
-		die("can't fork\n");
-	else if (child == 0)
-		return 0;
-	else if (child > 0) {
-		int rv;
-		wait(&rv);
-		if (!WIFEXITED(rv) || WEXITSTATUS(rv))
-			exit(1);
-	}
-	return 1;
-}
+	rc = qr_encode(str, &qr);
+	if (rc != ERR_NONE)
+		die("error: can't encode QR: %s\n", stoken_errstr[rc]);
 
-static void display_qr(const char *filename)
-{
-	const char *programs[] = {
-		/*
-		 * I'd like to include xdg-open here, but it insists on
-		 * opening the file in the background, which races with the
-		 * temporary file cleanup.
-		 */
-		"display",	/* ImageMagick */
-		"eog",		/* Eye of GNOME */
-		"gwenview",	/* KDE viewer */
-		"ristretto",	/* Xfce */
-		NULL,
-	};
-	const char **p, *user;
-
-	if (fork_and_wait() != 0)
+	if (!filename) {
+		qr_write_ansi(&qr, stdout);
+		qr_free(&qr);
 		return;
-
-	user = getenv("QR_VIEWER");
-	if (user) {
-		execlp(user, user, filename, NULL);
-		die("unable to execute '%s'\n", user);
 	}
 
-	for (p = programs; *p; p++)
-		execlp(*p, *p, filename, NULL);
-
-	die("can't find a suitable image viewer; try setting $QR_VIEWER\n");
-}
-
-static void __export_qr(const char *filename, const char *token)
-{
-	if (fork_and_wait() != 0)
-		return;
-	execlp("qrencode", "qrencode", "-l", "H", "-o", filename,
-	       token, NULL);
-	die("can't exec qrencode (is it in your PATH?)\n");
+	f = fopen(filename, "wb");
+	if (!f)
+		die("error: can't open '%s' for writing\n", filename);
+	rc = qr_write_png(&qr, f, QR_PNG_SCALE);
+	if (fclose(f) != 0 || rc != ERR_NONE)
+		die("error: can't write '%s'\n", filename);
+	qr_free(&qr);
 }
 
 static void export_qr(const char *filename, const char *token)
@@ -388,23 +440,793 @@ static void export_qr(const char *filename, const char *token)
 		opt_android = 1;
 
 	formatted = format_token(token);
+	write_qr(filename, formatted);
+	free(formatted);
+}
+
+/* replace the first "%s" in TMPL with the serial number */
+static char *serial_filename(const char *tmpl, const char *serial)
+{
+	const char *p = strstr(tmpl, "%s");
+	char *ret = xmalloc(strlen(tmpl) + strlen(serial) + 1);
 
-	if (filename)
-		__export_qr(filename, formatted);
+	memcpy(ret, tmpl, p - tmpl);
+	strcpy(&ret[p - tmpl], serial);
+	strcat(ret, p + 2);
+	return ret;
+}
+
+/*
+ * Bulk mode: every line of FILENAME that holds a token gets its own QR
+ * file, named by substituting the serial number into TMPL.
+ */
+static void export_qr_batch(const char *tmpl, const char *filename)
+{
+	char line[BUFLEN], buf[BUFLEN], *pass;
+	struct securid_key_cache *key_cache = securid_key_cache_new();
+	struct securid_token t;
+	int rc, count = 0, lineno = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		die("error: can't open '%s'\n", filename);
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *outname;
+
+		lineno++;
+		rc = __stoken_parse_and_decode_token(line, &t, 1);
+		if (rc == ERR_GENERAL)
+			continue;
+		if (rc != ERR_NONE)
+			die("error: bad token on line %d: %s\n", lineno,
+			    stoken_errstr[rc]);
+
+		t.key_cache = key_cache;
+		pass = NULL;
+		unlock_token(&t, 0, &pass);
+
+		t.is_smartphone = 1;
+		rc = securid_encode_token(&t, opt_new_password ? :
+					  (opt_keep_password ? pass : NULL),
+					  opt_new_devid, opt_v3 ? 3 : 2, buf);
+		free(pass);
+		if (rc != ERR_NONE)
+			die("error: can't encode token %s: %s\n", t.serial,
+			    stoken_errstr[rc]);
+
+		outname = serial_filename(tmpl, t.serial);
+		export_qr(outname, buf);
+		puts(outname);
+		free(outname);
+
+		free(t.v3);
+		sdtid_free(t.sdtid);
+		memset(&t, 0, sizeof(t));
+		count++;
+	}
+	fclose(f);
+	securid_key_cache_free(key_cache);
+
+	if (!count)
+		die("error: no valid tokens in '%s'\n", filename);
+}
+
+/*
+ * Bulk provisioning: each line of the list is
+ *
+ *   <token> [ <new_password> [ <new_devid> ] ]
+ *
+ * where <token> is a ctf string/URL or the name of an sdtid file (every
+ * token in the file is provisioned) and "-" means "none".  Work is handed
+ * to a pool of threads PROVISION_CHUNK tokens at a time, so memory stays
+ * bounded, and the results are printed in input order.
+ */
+
+#define PROVISION_CHUNK		256
+/* smallest v3 range: 16 PBKDF2 derivations, two full sets of lanes */
+#define PROVISION_V3_GRAIN	8
+
+/* a ctf string, or an sdtid file parsed once for all of its tokens */
+struct provision_src {
+	char			*data;
+	struct sdtid_doc	*doc;
+	int			refs;
+};
+
+struct provision_job {
+	int			line;
+	struct provision_src	*src;
+	int			which;		/* sdtid index, or -1 */
+	char			*new_pass;
+	char			*new_devid;
+
+	int			rc;
+	char			*out;
+};
+
+struct provision_batch {
+	struct provision_job	*jobs;
+	int			n_jobs;
+	struct securid_key_cache *key_cache;
+	/* compiled once for all --sdtid output */
+	struct sdtid_template	*tpl;
+};
+
+struct provision_reader {
+	FILE			*f;
+	int			line;
+	int			errors;
+
+	/* sdtid file being expanded, one job per token */
+	struct provision_src	*src;
+	int			which;
+	int			count;
+	char			*new_pass;
+	char			*new_devid;
+};
+
+static struct provision_src *provision_src_new(char *data,
+					       struct sdtid_doc *doc)
+{
+	struct provision_src *src = xzalloc(sizeof(*src));
+
+	src->data = data;
+	src->doc = doc;
+	src->refs = 1;
+	return src;
+}
+
+static void provision_src_put(struct provision_src *src)
+{
+	if (src && --src->refs == 0) {
+		free(src->data);
+		sdtid_doc_put(src->doc);
+		free(src);
+	}
+}
+
+static char *read_file(const char *filename)
+{
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+
+	do {
+		if (size - len < 2) {
+			size = size ? size * 2 : 65536;
+			buf = realloc(buf, size);
+			if (!buf)
+				die("out of memory\n");
+		}
+		len += fread(&buf[len], 1, size - len - 1, f);
+	} while (!feof(f) && !ferror(f));
+
+	if (ferror(f) || !len) {
+		free(buf);
+		buf = NULL;
+	} else
+		buf[len] = 0;
+	fclose(f);
+	return buf;
+}
+
+static char *provision_arg(const char *arg, const char *dflt)
+{
+	if (!arg)
+		return dflt ? xstrdup(dflt) : NULL;
+	return strcmp(arg, "-") ? xstrdup(arg) : NULL;
+}
+
+static void provision_add(struct provision_reader *r,
+			  struct provision_job *job, struct provision_src *src,
+			  int which, const char *new_pass,
+			  const char *new_devid)
+{
+	memset(job, 0, sizeof(*job));
+	job->line = r->line;
+	job->src = src;
+	job->which = which;
+	job->new_pass = new_pass ? xstrdup(new_pass) : NULL;
+	job->new_devid = new_devid ? xstrdup(new_devid) : NULL;
+	src->refs++;
+}
+
+static void provision_end_file(struct provision_reader *r)
+{
+	provision_src_put(r->src);
+	free(r->new_pass);
+	free(r->new_devid);
+	r->src = NULL;
+	r->new_pass = r->new_devid = NULL;
+}
+
+/* read up to MAX jobs from the list; returns the number queued */
+static int provision_fill(struct provision_reader *r,
+			  struct provision_job *jobs, int max)
+{
+	const char *dflt_pass = opt_new_password ? :
+				(opt_keep_password ? opt_password : NULL);
+	char line[BUFLEN], *tok, *pass, *devid, *save;
+	int n = 0;
+
+	while (n < max) {
+		struct provision_src *src;
+		struct sdtid_doc *doc = NULL;
+		char *data;
+
+		if (r->src) {
+			if (r->which < r->count) {
+				provision_add(r, &jobs[n++], r->src,
+					      r->which++, r->new_pass,
+					      r->new_devid);
+				continue;
+			}
+			provision_end_file(r);
+		}
+
+		if (fgets(line, sizeof(line), r->f) == NULL)
+			break;
+		r->line++;
+
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (!tok || *tok == '#')
+			continue;
+		pass = provision_arg(strtok_r(NULL, " \t\r\n", &save),
+				     dflt_pass);
+		devid = provision_arg(strtok_r(NULL, " \t\r\n", &save),
+				      opt_new_devid);
+
+		if (isdigit(*tok) || strcasestr(tok, "ctfData=")) {
+			src = provision_src_new(xstrdup(tok), NULL);
+			provision_add(r, &jobs[n++], src, -1, pass, devid);
+			provision_src_put(src);
+			free(pass);
+			free(devid);
+			continue;
+		}
+
+		data = read_file(tok);
+		if (!data || sdtid_doc_new(data, &doc) != ERR_NONE ||
+		    !(r->count = sdtid_doc_count(doc))) {
+			warn("error: line %d: can't read tokens from '%s'\n",
+			     r->line, tok);
+			r->errors++;
+			sdtid_doc_put(doc);
+			free(data);
+			free(pass);
+			free(devid);
+			continue;
+		}
+		free(data);
+		r->src = provision_src_new(NULL, doc);
+		r->which = 0;
+		r->new_pass = pass;
+		r->new_devid = devid;
+	}
+	return n;
+}
+
+static int write_sdtid(const char *filename,
+		       const struct sdtid_template *tpl,
+		       struct securid_token *t, const char *pass,
+		       const char *devid)
+{
+	FILE *f;
+	int rc;
+
+	f = fopen(filename, "w");
+	if (!f)
+		die("error: can't open '%s' for writing\n", filename);
+	rc = sdtid_export_tpl(tpl, t, pass, devid, f);
+	if (fclose(f) != 0)
+		die("error: can't write '%s'\n", filename);
+	return rc;
+}
+
+static int provision_decode(struct provision_job *job,
+			    struct provision_batch *b, struct securid_token *t)
+{
+	int rc;
+
+	if (job->which < 0)
+		rc = __stoken_parse_and_decode_token(job->src->data, t, 0);
 	else {
-		char fname[64];
-		int fd;
-
-		snprintf(fname, sizeof(fname), "%s/XXXXXX.png",
-			 getenv("TMPDIR") ? : "/tmp");
-		fd = mkstemps(fname, 4);
-		if (fd < 0)
-			die("can't create temp file '%s'\n", fname);
-		__export_qr(fname, formatted);
-		display_qr(fname);
-		unlink(fname);
+		memset(t, 0, sizeof(*t));
+		rc = sdtid_decode_doc(job->src->doc, t, job->which);
 	}
-	free(formatted);
+	if (rc != ERR_NONE)
+		return rc;
+
+	t->key_cache = b->key_cache;
+	return securid_decrypt_seed(t, opt_password, opt_devid);
+}
+
+/* BUF is the encoded token */
+static void provision_emit(struct provision_job *job,
+			   struct securid_token *t, const char *buf)
+{
+	char *formatted = format_token(buf);
+
+	if (opt_qr) {
+		job->out = serial_filename(opt_qr, t->serial);
+		write_qr(job->out, formatted);
+		free(formatted);
+	} else
+		job->out = formatted;
+}
+
+static void provision_release(struct securid_token *t)
+{
+	free(t->v3);
+	sdtid_free(t->sdtid);
+	memset(t, 0, sizeof(*t));
+}
+
+static void provision_one(struct provision_job *job,
+			  struct provision_batch *b)
+{
+	struct securid_token t;
+	char buf[BUFLEN];
+	int rc;
+
+	rc = provision_decode(job, b, &t);
+	if (rc == ERR_NONE && b->tpl) {
+		job->out = serial_filename(opt_sdtid_out, t.serial);
+		rc = write_sdtid(job->out, b->tpl, &t, job->new_pass,
+				 job->new_devid);
+	} else if (rc == ERR_NONE) {
+		t.is_smartphone = opt_iphone || opt_android || opt_v3;
+		rc = securid_encode_token(&t, job->new_pass, job->new_devid,
+					  opt_v3 ? 3 : 2, buf);
+		if (rc == ERR_NONE)
+			provision_emit(job, &t, buf);
+	}
+	job->rc = rc;
+
+	provision_release(&t);
+	memset(buf, 0, sizeof(buf));
+}
+
+/*
+ * v3 output costs two PBKDF2 derivations per token, so a range decrypts
+ * all of its tokens first and then encodes them in one batch, letting
+ * securid_encode_tokens() run the derivations side by side.
+ */
+static void provision_v3(struct provision_batch *b, int start, int end)
+{
+	int i, n = end - start, m = 0;
+	struct securid_token *t = xzalloc(n * sizeof(*t));
+	const struct securid_token **tp = xzalloc(n * sizeof(*tp));
+	const char **pass = xzalloc(n * sizeof(*pass));
+	const char **devid = xzalloc(n * sizeof(*devid));
+	char (*buf)[BUFLEN] = xzalloc(n * sizeof(*buf));
+	char **out = xzalloc(n * sizeof(*out));
+	int *idx = xzalloc(n * sizeof(*idx)), *rc = xzalloc(n * sizeof(*rc));
+
+	for (i = 0; i < n; i++) {
+		struct provision_job *job = &b->jobs[start + i];
+
+		job->rc = provision_decode(job, b, &t[i]);
+		if (job->rc != ERR_NONE)
+			continue;
+		t[i].is_smartphone = 1;
+		tp[m] = &t[i];
+		pass[m] = job->new_pass;
+		devid[m] = job->new_devid;
+		out[m] = buf[m];
+		idx[m++] = i;
+	}
+
+	securid_encode_tokens(tp, pass, devid, 3, out, rc, m);
+
+	for (i = 0; i < m; i++) {
+		struct provision_job *job = &b->jobs[start + idx[i]];
+
+		job->rc = rc[i];
+		if (rc[i] == ERR_NONE)
+			provision_emit(job, &t[idx[i]], buf[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		provision_release(&t[i]);
+	memset(buf, 0, n * sizeof(*buf));
+	free(t);
+	free(tp);
+	free(pass);
+	free(devid);
+	free(buf);
+	free(out);
+	free(idx);
+	free(rc);
+}
+
+static void provision_range(void *arg, int start, int end)
+{
+	struct provision_batch *b = arg;
+	int i;
+
+	if (opt_v3 && !b->tpl) {
+		provision_v3(b, start, end);
+		return;
+	}
+	for (i = start; i < end; i++)
+		provision_one(&b->jobs[i], b);
+}
+
+/* this thread works on the batch too, so it counts as one of the N */
+static void provision_threads(void)
+{
+	int n;
+
+	if (!opt_threads)
+		return;
+	n = atoi(opt_threads);
+	if (n < 1)
+		die("error: invalid --threads value\n");
+	if (stoken_set_threads(n - 1, NULL, 0, 0) != 0)
+		die("error: can't create worker threads\n");
+}
+
+static int provision(void)
+{
+	struct provision_reader r;
+	struct provision_batch b;
+	int i;
+
+	if (opt_show_qr || (opt_sdtid && opt_qr))
+		die("error: provision only emits ctf strings, --qr files, or --sdtid files\n");
+	if (opt_sdtid && (!opt_sdtid_out || !strstr(opt_sdtid_out, "%s")))
+		die("error: provision needs --sdtid=<file_%%s.sdtid>\n");
+	if (opt_qr) {
+		if (!strstr(opt_qr, "%s"))
+			die("error: --qr template must contain %%s\n");
+		if (opt_blocks) {
+			warn("warning: --blocks is invalid in QR mode; using --android\n");
+			opt_blocks = 0;
+		}
+		if (!(opt_android || opt_iphone || opt_v3))
+			opt_android = 1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.f = opt_file ? fopen(opt_file, "r") : stdin;
+	if (!r.f)
+		die("error: can't open '%s'\n", opt_file);
+
+	provision_threads();
+
+	memset(&b, 0, sizeof(b));
+	if (opt_sdtid) {
+		int rc = sdtid_template_new(opt_template, &b.tpl);
+
+		if (rc != ERR_NONE)
+			die("error: can't read template: %s\n",
+			    stoken_errstr[rc]);
+	}
+	b.jobs = xmalloc(PROVISION_CHUNK * sizeof(*b.jobs));
+	b.key_cache = securid_key_cache_new();
+
+	while ((b.n_jobs = provision_fill(&r, b.jobs, PROVISION_CHUNK))) {
+		__stoken_parallel_for(b.n_jobs,
+				      opt_v3 && !b.tpl ? PROVISION_V3_GRAIN : 1,
+				      &provision_range, &b);
+
+		for (i = 0; i < b.n_jobs; i++) {
+			struct provision_job *job = &b.jobs[i];
+
+			if (job->rc == ERR_NONE)
+				puts(job->out);
+			else {
+				warn("error: line %d: %s\n", job->line,
+				     stoken_errstr[job->rc]);
+				r.errors++;
+			}
+			free(job->out);
+			free(job->new_pass);
+			free(job->new_devid);
+			provision_src_put(job->src);
+		}
+	}
+	provision_end_file(&r);
+
+	securid_key_cache_free(b.key_cache);
+	sdtid_template_free(b.tpl);
+	free(b.jobs);
+	if (opt_file)
+		fclose(r.f);
+
+	return r.errors ? 1 : 0;
+}
+
+/*
+ * Bulk import: load every token in a directory into a keyring, and print
+ * the serial number of each one (in file name order) so that the spool can
+ * be checked before it is handed to a verification server.
+ */
+struct import_dir_state {
+	int			errors;
+};
+
+static void import_dir_result(void *arg, const char *filename,
+			      const char *serial, int rc)
+{
+	struct import_dir_state *st = arg;
+
+	if (!rc) {
+		printf("%s: %s\n", filename, serial);
+		return;
+	}
+	if (serial)
+		warn("error: %s: token %s: %s\n", filename, serial,
+		     rc == -EINVAL ? "missing or invalid PIN" :
+		     rc == -EACCES ? "wrong password or device ID" :
+		     rc == -EEXIST ? "duplicate serial number" :
+		     strerror(-rc));
+	else
+		warn("error: %s: %s\n", filename,
+		     rc == -EINVAL ? "no valid token" : strerror(-rc));
+	st->errors++;
+}
+
+static int import_dir(void)
+{
+	struct import_dir_state st = { 0 };
+	struct stoken_keyring *kr;
+	int rc;
+
+	if (!opt_file)
+		die("error: import-dir requires --file=<directory>\n");
+
+	provision_threads();
+
+	kr = stoken_keyring_new_sharded(0, 0);
+	if (!kr)
+		die("out of memory\n");
+	rc = stoken_keyring_import_dir(kr, opt_file, opt_password, opt_devid,
+				       opt_pin, &import_dir_result, &st);
+	stoken_keyring_destroy(kr);
+	if (rc < 0)
+		die("error: can't read '%s': %s\n", opt_file, strerror(-rc));
+
+	dbg("imported %d token%s\n", rc, rc == 1 ? "" : "s");
+	return st.errors ? 1 : 0;
+}
+
+static void print_tokencode(const char *code, const char *next,
+			    time_t remaining)
+{
+	if (opt_json) {
+		printf("{\"code\":\"%s\"", code);
+		if (next)
+			printf(",\"next\":\"%s\",\"remaining\":%ld", next,
+			       (long)remaining);
+		puts("}");
+	} else if (next) {
+		printf("%s %s %ld\n", code, next, (long)remaining);
+	} else {
+		puts(code);
+	}
+	fflush(stdout);
+}
+
+/* print CODE, which is good until BOUNDARY, plus the next code if asked */
+static void follow_print(struct securid_token *t, const char *code,
+			 time_t boundary)
+{
+	char next[BUFLEN];
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (securid_check_exp(t, now.tv_sec) < 0 && !opt_force)
+		die("error: token has expired; use --force to override\n");
+
+	if (!opt_next) {
+		print_tokencode(code, NULL, 0);
+		return;
+	}
+	securid_compute_tokencode(t, boundary, next);
+	print_tokencode(code, next, boundary - now.tv_sec);
+}
+
+/*
+ * Without timerfd support (or if the subscription can't be set up), sleep
+ * until each boundary instead.
+ */
+static int follow_sleep(struct securid_token *t)
+{
+	int interval = securid_token_interval(t);
+	time_t boundary, last = 0;
+	char code[BUFLEN];
+
+	while (1) {
+		struct timespec now, ts;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		boundary = (now.tv_sec / interval + 1) * interval;
+		if (boundary != last) {
+			securid_compute_tokencode(t, now.tv_sec, code);
+			follow_print(t, code, boundary);
+		}
+		last = boundary;
+
+		ts.tv_sec = boundary - now.tv_sec;
+		ts.tv_nsec = 0;
+		if (now.tv_nsec) {
+			ts.tv_sec--;
+			ts.tv_nsec = 1000000000 - now.tv_nsec;
+		}
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+	return 0;
+}
+
+/*
+ * tokencode --follow: the token is unlocked once, and then the process
+ * sleeps in poll() on a subscription timer until each interval boundary
+ * (or a clock change), so nothing runs between codes.
+ */
+static int follow(struct securid_token *t)
+{
+	struct stoken_subscription *sub;
+	struct sigaction sa;
+	struct pollfd pfd;
+	time_t boundary, last = 0;
+	char code[BUFLEN];
+
+	if (opt_use_time)
+		die("error: --use-time and --follow are mutually exclusive\n");
+
+	/* done prompting, so an interrupt has no terminal state to restore */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	sub = __stoken_subscribe(t, NULL);
+	if (!sub)
+		return follow_sleep(t);
+
+	pfd.fd = stoken_subscription_fd(sub);
+	pfd.events = POLLIN;
+	while (1) {
+		if (stoken_subscription_read(sub, code, &boundary) < 0)
+			die("error: can't read interval timer\n");
+		/* a clock change wakes us up without a new code */
+		if (boundary != last)
+			follow_print(t, code, boundary);
+		last = boundary;
+
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+			;
+	}
+	stoken_unsubscribe(sub);
+	return 0;
+}
+
+/* YYYY-MM-DD or YYYY/MM/DD, in days since the epoch (UTC) */
+static int64_t parse_day(const char *opt, const char *str)
+{
+	struct tm tm;
+	int y, m, d;
+	char c1, c2;
+	time_t t;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(str, "%d%c%d%c%d", &y, &c1, &m, &c2, &d) != 5 ||
+	    c1 != c2 || (c1 != '-' && c1 != '/') || y < 1970)
+		die("error: invalid --%s date '%s'\n", opt, str);
+
+	tm.tm_year = y - 1900;
+	tm.tm_mon = m - 1;
+	tm.tm_mday = d;
+	t = timegm(&tm);
+	/* timegm() normalizes out-of-range fields; reject them instead */
+	if (t < 0 || tm.tm_mon != m - 1 || tm.tm_mday != d)
+		die("error: invalid --%s date '%s'\n", opt, str);
+	return t / 86400;
+}
+
+/*
+ * export-codes: every tokencode from the start of --from to the end of
+ * --to (UTC), as a table that stoken_code_table_read() can look codes up
+ * in.  The token is unlocked (with its PIN) first, so the codes are
+ * exactly what "stoken tokencode" would print.
+ */
+static int export_codes(struct securid_token *t)
+{
+	int64_t first, last;
+	uint8_t *table;
+	size_t len;
+	int rc;
+
+	first = opt_from ? parse_day("from", opt_from) : time(NULL) / 86400;
+	last = opt_to ? parse_day("to", opt_to) : first;
+	if (last < first)
+		die("error: --to is before --from\n");
+	if (last - first >= STOKEN_CODE_TABLE_MAX_DAYS)
+		die("error: at most %d days may be exported\n",
+		    STOKEN_CODE_TABLE_MAX_DAYS);
+	if (isatty(fileno(stdout)))
+		die("error: refusing to write a binary table to a terminal\n");
+
+	/* keep PIN and password prompts out of the table */
+	prompt_fp = stderr;
+	unlock_token(t, 1, NULL);
+	provision_threads();
+
+	rc = __stoken_code_table_build(t, first, last - first + 1, &table,
+				       &len);
+	if (rc < 0)
+		die("error: can't build code table: %s\n", strerror(-rc));
+	if (fwrite(table, len, 1, stdout) != 1 || fflush(stdout))
+		die("error: can't write code table: %s\n", strerror(errno));
+	free(table);
+
+	dbg("exported %ld days, %zu bytes\n", (long)(last - first + 1), len);
+	return 0;
+}
+
+static volatile sig_atomic_t publish_stop;
+
+static void publish_signal(int sig)
+{
+	publish_stop = 1;
+}
+
+static int publish(struct securid_token *t)
+{
+	struct stoken_shm *shm;
+	struct sigaction sa;
+	int rc;
+
+	shm = stoken_shm_create(opt_shm, 1);
+	if (!shm && errno == EEXIST) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "/stoken-%u",
+			 (unsigned int)getuid());
+		die("error: shared memory object '%s' already exists and can't be replaced; is it owned by another user?\n",
+		    opt_shm ? : name);
+	}
+	if (!shm)
+		die("error: can't create shared memory table: %s\n",
+		    strerror(errno));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &publish_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	while (!publish_stop) {
+		int interval = securid_token_interval(t);
+		time_t now = adjusted_time(t);
+		struct timespec ts;
+
+		rc = __stoken_shm_publish(shm, t, now);
+		if (rc < 0)
+			die("error: can't publish tokencode: %s\n",
+			    strerror(-rc));
+
+		/*
+		 * The next interval's code is already in the table, so readers
+		 * are covered even if we wake up a little late.
+		 */
+		ts.tv_sec = interval - now % interval;
+		ts.tv_nsec = 0;
+		nanosleep(&ts, NULL);
+	}
+
+	stoken_shm_destroy(shm);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -426,6 +1248,11 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (!strcmp(cmd, "provision"))
+		return provision();
+	if (!strcmp(cmd, "import-dir"))
+		return import_dir();
+
 	t = current_token;
 	if (!t)
 		die("error: no token present.  Use 'stoken import' to add one.\n");
@@ -436,17 +1263,27 @@ int main(int argc, char **argv)
 		int days_left;
 
 		unlock_token(t, 1, NULL);
+		if (opt_follow)
+			return follow(t);
 
 		days_left = securid_check_exp(t, adjusted_time(t));
 		if (days_left < 0 && !opt_force)
 			die("error: token has expired; use --force to override\n");
 
 		securid_compute_tokencode(t, adjusted_time(t), buf);
-		puts(buf);
+		print_tokencode(buf, NULL, 0);
 
 		if (days_left < 14 && !opt_force)
 			warn("warning: token expires in %d day%s\n", days_left,
 				days_left == 1 ? "" : "s");
+	} else if (!strcmp(cmd, "export-codes")) {
+		return export_codes(t);
+	} else if (!strcmp(cmd, "publish")) {
+		unlock_token(t, 1, NULL);
+
+		if (securid_check_exp(t, adjusted_time(t)) < 0 && !opt_force)
+			die("error: token has expired; use --force to override\n");
+		return publish(t);
 	} else if (!strcmp(cmd, "import")) {
 		char *pass;
 
@@ -465,6 +1302,11 @@ int main(int argc, char **argv)
 	} else if (!strcmp(cmd, "export")) {
 		char *pass;
 
+		if (opt_qr && strstr(opt_qr, "%s") && opt_file) {
+			export_qr_batch(opt_qr, opt_file);
+			return 0;
+		}
+
 		unlock_token(t, 0, &pass);
 		if (opt_new_password)
 			pass = opt_new_password;
@@ -0,0 +1,234 @@
+/*
+ * codetable.c - precomputed tokencode tables for offline verifiers
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "securid.h"
+#include "stoken.h"
+#include "stoken-internal.h"
+
+/*
+ * See stoken.h for the layout.  Each day is a byte-aligned block of
+ * codes_per_day fixed-width fields, packed LSB first, so a lookup is one
+ * offset table read and one unaligned field extract.  Days are generated
+ * independently on the executor, each one through the batched range
+ * kernel.
+ */
+
+#define CT_MAGIC		"STKCODES"
+#define CT_VERSION		1
+#define CT_HEADER_LEN		44
+#define CT_SERIAL_LEN		16
+
+#define SECS_PER_DAY		86400
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+/* bits needed for any DIGITS-digit code */
+static int code_bits(int digits)
+{
+	uint32_t max = 1;
+	int bits = 0;
+
+	while (digits--)
+		max *= 10;
+	while ((1u << bits) < max)
+		bits++;
+	return bits;
+}
+
+struct build_pass {
+	struct securid_token	*t;
+	int64_t			first_day;
+	int			interval;
+	int			per_day;
+	int			bits;
+	uint8_t			*buf;
+	uint32_t		data_off;
+	size_t			day_bytes;
+};
+
+static void build_days(void *arg, int start, int end)
+{
+	struct build_pass *p = arg;
+	time_t *when = malloc(p->per_day * sizeof(*when));
+	char (*codes)[STOKEN_MAX_TOKENCODE + 1] =
+		malloc(p->per_day * sizeof(*codes));
+	int d, i;
+
+	/* the caller checks for a missing day, and fails the whole table */
+	for (d = start; when && codes && d < end; d++) {
+		time_t base = (p->first_day + d) * SECS_PER_DAY;
+		uint8_t *out = &p->buf[p->data_off + d * p->day_bytes];
+		uint64_t acc = 0;
+		int acc_bits = 0;
+
+		/* a whole day at once, so the AES chain is shared throughout */
+		for (i = 0; i < p->per_day; i++)
+			when[i] = base + (time_t)i * p->interval;
+		securid_compute_tokencodes(p->t, when, p->per_day, codes);
+
+		for (i = 0; i < p->per_day; i++) {
+			acc |= (uint64_t)strtoul(codes[i], NULL, 10) << acc_bits;
+			for (acc_bits += p->bits; acc_bits >= 8; acc_bits -= 8) {
+				*out++ = acc;
+				acc >>= 8;
+			}
+		}
+		if (acc_bits)
+			*out = acc;
+		put_le32(&p->buf[CT_HEADER_LEN + 4 * d],
+			 p->data_off + d * p->day_bytes);
+	}
+	if (codes)
+		memset(codes, 0, p->per_day * sizeof(*codes));
+	free(when);
+	free(codes);
+}
+
+int __stoken_code_table_build(struct securid_token *t, int64_t first_day,
+			      int n_days, uint8_t **out, size_t *len)
+{
+	struct build_pass p;
+	size_t size;
+	int d;
+
+	if (!t->has_dec_seed || n_days < 1 ||
+	    n_days > STOKEN_CODE_TABLE_MAX_DAYS || first_day < 0)
+		return -EINVAL;
+
+	memset(&p, 0, sizeof(p));
+	p.t = t;
+	p.first_day = first_day;
+	p.interval = securid_token_interval(t);
+	p.per_day = SECS_PER_DAY / p.interval;
+	p.bits = code_bits(securid_token_digits(t));
+	p.day_bytes = ((size_t)p.per_day * p.bits + 7) / 8;
+	p.data_off = CT_HEADER_LEN + 4 * n_days;
+
+	size = p.data_off + n_days * p.day_bytes;
+	p.buf = calloc(1, size);
+	if (!p.buf)
+		return -EIO;
+
+	memcpy(p.buf, CT_MAGIC, 8);
+	put_le16(&p.buf[8], CT_VERSION);
+	put_le16(&p.buf[10], CT_HEADER_LEN);
+	strncpy((char *)&p.buf[12], t->serial, CT_SERIAL_LEN - 1);
+	put_le32(&p.buf[28], first_day);
+	put_le32(&p.buf[32], n_days);
+	put_le16(&p.buf[36], p.interval);
+	p.buf[38] = securid_token_digits(t);
+	p.buf[39] = p.bits;
+	put_le32(&p.buf[40], p.per_day);
+
+	securid_prepare_token(t);
+	__stoken_parallel_for(n_days, 1, &build_days, &p);
+
+	/* an offset of 0 means a worker ran out of memory */
+	for (d = 0; d < n_days; d++)
+		if (!get_le32(&p.buf[CT_HEADER_LEN + 4 * d])) {
+			free(p.buf);
+			return -EIO;
+		}
+
+	*out = p.buf;
+	*len = size;
+	return 0;
+}
+
+int stoken_code_table_read(const void *table, size_t len, time_t when,
+	char *out)
+{
+	const uint8_t *p = table;
+	uint32_t first_day, n_days, per_day, off;
+	int interval, digits, bits, i;
+	int64_t day, idx, bit;
+	uint64_t v = 0;
+
+	if (len < CT_HEADER_LEN || memcmp(p, CT_MAGIC, 8) ||
+	    get_le16(&p[8]) != CT_VERSION ||
+	    get_le16(&p[10]) != CT_HEADER_LEN)
+		return -EINVAL;
+
+	first_day = get_le32(&p[28]);
+	n_days = get_le32(&p[32]);
+	interval = get_le16(&p[36]);
+	digits = p[38];
+	bits = p[39];
+	per_day = get_le32(&p[40]);
+	if ((interval != 30 && interval != 60) ||
+	    digits < 1 || digits > STOKEN_MAX_TOKENCODE ||
+	    bits != code_bits(digits) ||
+	    per_day != SECS_PER_DAY / interval ||
+	    n_days > STOKEN_CODE_TABLE_MAX_DAYS ||
+	    len < CT_HEADER_LEN + 4 * (size_t)n_days)
+		return -EINVAL;
+
+	if (when < 0)
+		return -ERANGE;
+	day = when / SECS_PER_DAY - first_day;
+	if (day < 0 || day >= n_days)
+		return -ERANGE;
+	idx = (when % SECS_PER_DAY) / interval;
+
+	off = get_le32(&p[CT_HEADER_LEN + 4 * day]);
+	bit = idx * bits;
+	if (off + ((size_t)per_day * bits + 7) / 8 > len)
+		return -EINVAL;
+
+	p += off + bit / 8;
+	for (i = 0; i * 8 < bit % 8 + bits; i++)
+		v |= (uint64_t)p[i] << (i * 8);
+	v = (v >> (bit % 8)) & ((1u << bits) - 1);
+
+	for (i = digits - 1; i >= 0; i--) {
+		out[i] = '0' + v % 10;
+		v /= 10;
+	}
+	out[digits] = 0;
+	return v ? -EINVAL : 0;
+}
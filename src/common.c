@@ -38,13 +38,18 @@
 /* globals - shared with cli.c or gui.c */
 
 int opt_random, opt_keep_password, opt_blocks, opt_iphone, opt_android,
-	opt_v3, opt_show_qr, opt_seed, opt_sdtid, opt_small, opt_next;
+	opt_v3, opt_show_qr, opt_seed, opt_sdtid, opt_small, opt_next,
+	opt_follow, opt_json;
 int opt_debug, opt_version, opt_help, opt_batch, opt_force, opt_stdin;
 char *opt_rcfile, *opt_file, *opt_token, *opt_devid, *opt_password,
      *opt_pin, *opt_use_time, *opt_new_password, *opt_new_devid,
-     *opt_new_pin, *opt_template, *opt_qr;
+     *opt_new_pin, *opt_template, *opt_qr, *opt_threads, *opt_devid_file,
+     *opt_shm, *opt_sdtid_out, *opt_from, *opt_to;
 struct securid_token *current_token;
 
+/* where prompt() goes; commands that write data to stdout use stderr */
+FILE *prompt_fp;
+
 static int debug_level;
 static struct stoken_cfg *cfg;
 
@@ -52,8 +57,10 @@ void prompt(const char *fmt, ...)
 {
 	va_list ap;
 	va_start(ap, fmt);
-	if (!opt_stdin)
-		vfprintf(stdout, fmt, ap);
+	if (!opt_stdin) {
+		vfprintf(prompt_fp ? prompt_fp : stdout, fmt, ap);
+		fflush(prompt_fp ? prompt_fp : stdout);
+	}
 	va_end(ap);
 }
 
@@ -134,6 +141,12 @@ enum {
 	OPT_NEW_PIN,
 	OPT_TEMPLATE,
 	OPT_QR,
+	OPT_THREADS,
+	OPT_DEVID_FILE,
+	OPT_SHM,
+	OPT_SDTID,
+	OPT_FROM,
+	OPT_TO,
 };
 
 static const struct option long_opts[] = {
@@ -145,6 +158,7 @@ static const struct option long_opts[] = {
 
 	/* global: secrets used to decrypt/use a seed */
 	{ "devid",          1, NULL,                    OPT_DEVID         },
+	{ "devid-file",     1, NULL,                    OPT_DEVID_FILE    },
 	{ "password",       1, NULL,                    'p'               },
 	{ "pin",            1, NULL,                    'n'               },
 
@@ -165,6 +179,8 @@ static const struct option long_opts[] = {
 	/* used for tokencode generation */
 	{ "use-time",       1, NULL,                    OPT_USE_TIME      },
 	{ "next",           0, &opt_next,               1                 },
+	{ "follow",         0, &opt_follow,             1                 },
+	{ "json",           0, &opt_json,               1                 },
 
 	/* these are mostly for exporting/issuing tokens */
 	{ "new-password",   1, NULL,                    OPT_NEW_PASSWORD  },
@@ -176,12 +192,22 @@ static const struct option long_opts[] = {
 	{ "iphone",         0, &opt_iphone,             1                 },
 	{ "android",        0, &opt_android,            1                 },
 	{ "v3",             0, &opt_v3,                 1                 },
-	{ "sdtid",          0, &opt_sdtid,              1                 },
-	{ "xml",            0, &opt_sdtid,              1                 },
+	{ "sdtid",          2, NULL,                    OPT_SDTID         },
+	{ "xml",            2, NULL,                    OPT_SDTID         },
 	{ "qr",             1, NULL,                    OPT_QR            },
 	{ "show-qr",        0, &opt_show_qr,            1                 },
 	{ "seed",           0, &opt_seed,               1                 },
 	{ "stdin",          0, NULL,                    's'               },
+
+	/* bulk provisioning */
+	{ "threads",        1, NULL,                    OPT_THREADS       },
+
+	/* shared-memory code table */
+	{ "shm",            1, NULL,                    OPT_SHM           },
+
+	/* precomputed code tables */
+	{ "from",           1, NULL,                    OPT_FROM          },
+	{ "to",             1, NULL,                    OPT_TO            },
 	{ NULL,             0, NULL,                    0                 },
 };
 
@@ -211,7 +237,7 @@ static void usage_cli(void)
 	puts("");
 	puts("Common operations:");
 	puts("");
-	puts("  stoken [ tokencode ] [ --stdin ]");
+	puts("  stoken [ tokencode ] [ --stdin ] [ --follow ] [ --next ] [ --json ]");
 	puts("  stoken import { --token=<token_string> | --file=<token_file> } [ --force ]");
 	puts("  stoken setpass");
 	puts("  stoken setpin");
@@ -222,6 +248,13 @@ static void usage_cli(void)
 	puts("  stoken export [ { --blocks | --iphone | --android | --v3 | --sdtid |");
 	puts("                    --qr=<file> | --show-qr } ]");
 	puts("  stoken issue [ --template=<sdtid_skeleton> ]");
+	puts("  stoken provision [ --file=<list> ] [ { --iphone | --android | --v3 |");
+	puts("                     --qr=<file_%s.png> | --sdtid=<file_%s.sdtid> } ]");
+	puts("                   [ --template=<sdtid_skeleton> ] [ --threads=<n> ]");
+	puts("  stoken import-dir --file=<directory> [ --threads=<n> ]");
+	puts("  stoken publish [ --shm=<name> ]");
+	puts("  stoken export-codes [ --from=<yyyy-mm-dd> ] [ --to=<yyyy-mm-dd> ]");
+	puts("                      [ --threads=<n> ] > <table>");
 	puts("");
 	usage_common();
 	exit(1);
@@ -269,12 +302,18 @@ char *parse_cmdline(int argc, char **argv, int is_gui)
 		case 'f': opt_force = 1; break;
 		case 's': opt_stdin = 1; break;
 		case OPT_DEVID: opt_devid = optarg; break;
+		case OPT_DEVID_FILE: opt_devid_file = optarg; break;
 		case OPT_USE_TIME: opt_use_time = optarg; break;
 		case OPT_NEW_PASSWORD: opt_new_password = optarg; break;
 		case OPT_NEW_DEVID: opt_new_devid = optarg; break;
 		case OPT_NEW_PIN: opt_new_pin = optarg; break;
 		case OPT_TEMPLATE: opt_template = optarg; break;
 		case OPT_QR: opt_qr = optarg; break;
+		case OPT_THREADS: opt_threads = optarg; break;
+		case OPT_SHM: opt_shm = optarg; break;
+		case OPT_SDTID: opt_sdtid = 1; opt_sdtid_out = optarg; break;
+		case OPT_FROM: opt_from = optarg; break;
+		case OPT_TO: opt_to = optarg; break;
 		case 0: break;
 		default: opt_help = 1;
 		}
@@ -385,6 +424,13 @@ int common_init(char *cmd)
 		__stoken_zap_rcfile_data(cfg);
 	}
 
+	/*
+	 * provision reads its own list of tokens from --file or stdin, and
+	 * import-dir reads a whole directory
+	 */
+	if (!strcmp(cmd, "provision") || !strcmp(cmd, "import-dir"))
+		return ERR_NONE;
+
 	/* accept a token from the command line, or fall back to the rcfile */
 	do {
 		t = xzalloc(sizeof(struct securid_token));
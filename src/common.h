@@ -24,6 +24,7 @@
 #include "config.h"
 
 #include <stdarg.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 #include "stoken-internal.h"
@@ -64,7 +65,8 @@ char *format_token(const char *raw_token_str);
 
 /* binary flags, long options */
 extern int opt_random, opt_keep_password, opt_blocks, opt_iphone, opt_android,
-	opt_v3, opt_show_qr, opt_seed, opt_sdtid, opt_small, opt_next;
+	opt_v3, opt_show_qr, opt_seed, opt_sdtid, opt_small, opt_next,
+	opt_follow, opt_json;
 
 /* binary flags, short/long options */
 extern int opt_debug, opt_version, opt_help, opt_batch, opt_force, opt_stdin;
@@ -72,10 +74,14 @@ extern int opt_debug, opt_version, opt_help, opt_batch, opt_force, opt_stdin;
 /* string arguments */
 extern char *opt_rcfile, *opt_file, *opt_token, *opt_devid, *opt_password,
 	    *opt_pin, *opt_use_time, *opt_new_password, *opt_new_devid,
-	    *opt_new_pin, *opt_template, *opt_qr;
+	    *opt_new_pin, *opt_template, *opt_qr, *opt_threads, *opt_devid_file,
+	    *opt_shm, *opt_sdtid_out, *opt_from, *opt_to;
 
 /* token read from .stokenrc, if available */
 struct securid_token;
 extern struct securid_token *current_token;
 
+/* stream for prompt(); NULL means stdout */
+extern FILE *prompt_fp;
+
 #endif /* !__STOKEN_COMMON_H__ */
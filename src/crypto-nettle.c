@@ -0,0 +1,114 @@
+/*
+ * crypto-nettle.c - nettle backend
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <nettle/aes.h>
+#include <nettle/cbc.h>
+#include <nettle/hmac.h>
+#include <nettle/pbkdf2.h>
+#include <nettle/sha2.h>
+
+/* nettle's AES_KEY_SIZE is the AES-256 key size; securid.h means AES-128 */
+#undef AES_KEY_SIZE
+
+#include "crypto.h"
+#include "securid.h"
+
+static void nt_aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in,
+	uint8_t *out, int nblk)
+{
+	struct aes128_ctx ctx;
+
+	aes128_set_encrypt_key(&ctx, key);
+	aes128_encrypt(&ctx, nblk * AES_BLOCK_SIZE, out, in);
+}
+
+static void nt_aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in,
+	uint8_t *out, int nblk)
+{
+	struct aes128_ctx ctx;
+
+	aes128_set_decrypt_key(&ctx, key);
+	aes128_decrypt(&ctx, nblk * AES_BLOCK_SIZE, out, in);
+}
+
+static void nt_aes256_cbc_encrypt(const uint8_t *key, const uint8_t *in,
+	int len, const uint8_t *iv, uint8_t *out)
+{
+	struct aes256_ctx ctx;
+	uint8_t local_iv[AES_BLOCK_SIZE];
+
+	aes256_set_encrypt_key(&ctx, key);
+	memcpy(local_iv, iv, AES_BLOCK_SIZE);
+	cbc_encrypt(&ctx, (nettle_cipher_func *)aes256_encrypt,
+		    AES_BLOCK_SIZE, local_iv, len, out, in);
+}
+
+static void nt_aes256_cbc_decrypt(const uint8_t *key, const uint8_t *in,
+	int len, const uint8_t *iv, uint8_t *out)
+{
+	struct aes256_ctx ctx;
+	uint8_t local_iv[AES_BLOCK_SIZE];
+
+	aes256_set_decrypt_key(&ctx, key);
+	memcpy(local_iv, iv, AES_BLOCK_SIZE);
+	cbc_decrypt(&ctx, (nettle_cipher_func *)aes256_decrypt,
+		    AES_BLOCK_SIZE, local_iv, len, out, in);
+}
+
+static void nt_sha256(const uint8_t *in, int len, uint8_t *out)
+{
+	struct sha256_ctx ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, len, in);
+	sha256_digest(&ctx, SHA256_HASH_SIZE, out);
+}
+
+static void nt_hmac_sha256(const uint8_t *key, int key_len,
+	const uint8_t *msg, int msg_len, uint8_t *out)
+{
+	struct hmac_sha256_ctx ctx;
+
+	hmac_sha256_set_key(&ctx, key_len, key);
+	hmac_sha256_update(&ctx, msg_len, msg);
+	hmac_sha256_digest(&ctx, SHA256_HASH_SIZE, out);
+}
+
+static void nt_pbkdf2_sha256(const uint8_t *pass, int pass_len,
+	const uint8_t *salt, int salt_len, int n_rounds, uint8_t *out)
+{
+	pbkdf2_hmac_sha256(pass_len, pass, n_rounds, salt_len, salt,
+			   SHA256_HASH_SIZE, out);
+}
+
+const struct crypto_ops crypto_nettle_ops = {
+	.name			= "nettle",
+	.aes128_ecb_encrypt	= nt_aes128_ecb_encrypt,
+	.aes128_ecb_decrypt	= nt_aes128_ecb_decrypt,
+	.aes256_cbc_encrypt	= nt_aes256_cbc_encrypt,
+	.aes256_cbc_decrypt	= nt_aes256_cbc_decrypt,
+	.sha256			= nt_sha256,
+	.hmac_sha256		= nt_hmac_sha256,
+	.pbkdf2_sha256		= nt_pbkdf2_sha256,
+};
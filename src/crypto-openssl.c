@@ -0,0 +1,160 @@
+/*
+ * crypto-openssl.c - OpenSSL (libcrypto EVP) backend
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "crypto.h"
+#include "securid.h"
+
+/*
+ * Setting up an EVP context is much more expensive than the single block
+ * operations securid_mac() does, so each thread keeps one context per
+ * cipher/direction and only rekeys it.
+ */
+enum {
+	CTX_AES128_ENC = 0,
+	CTX_AES128_DEC,
+	CTX_AES256_CBC_ENC,
+	CTX_AES256_CBC_DEC,
+	CTX_MAX,
+};
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+
+static void free_ctxs(void *arg)
+{
+	EVP_CIPHER_CTX **ctxs = arg;
+	int i;
+
+	for (i = 0; i < CTX_MAX; i++)
+		EVP_CIPHER_CTX_free(ctxs[i]);
+	free(ctxs);
+}
+
+static void init_ctx_key(void)
+{
+	if (pthread_key_create(&ctx_key, &free_ctxs) != 0)
+		abort();
+}
+
+static EVP_CIPHER_CTX *get_ctx(int which, const uint8_t *key,
+	const uint8_t *iv)
+{
+	EVP_CIPHER_CTX **ctxs;
+	const EVP_CIPHER *cipher = NULL;
+	int enc = which == CTX_AES128_ENC || which == CTX_AES256_CBC_ENC;
+
+	pthread_once(&ctx_once, &init_ctx_key);
+	ctxs = pthread_getspecific(ctx_key);
+	if (!ctxs) {
+		ctxs = calloc(CTX_MAX, sizeof(*ctxs));
+		if (!ctxs || pthread_setspecific(ctx_key, ctxs) != 0)
+			abort();
+	}
+
+	if (!ctxs[which]) {
+		ctxs[which] = EVP_CIPHER_CTX_new();
+		if (!ctxs[which])
+			abort();
+		cipher = which <= CTX_AES128_DEC ? EVP_aes_128_ecb() :
+						   EVP_aes_256_cbc();
+	}
+
+	if (EVP_CipherInit_ex(ctxs[which], cipher, NULL, key, iv, enc) != 1)
+		abort();
+	EVP_CIPHER_CTX_set_padding(ctxs[which], 0);
+	return ctxs[which];
+}
+
+static void run_cipher(EVP_CIPHER_CTX *ctx, const uint8_t *in, int len,
+	uint8_t *out)
+{
+	int outl;
+
+	if (EVP_CipherUpdate(ctx, out, &outl, in, len) != 1 || outl != len)
+		abort();
+}
+
+static void ossl_aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in,
+	uint8_t *out, int nblk)
+{
+	run_cipher(get_ctx(CTX_AES128_ENC, key, NULL), in,
+		   nblk * AES_BLOCK_SIZE, out);
+}
+
+static void ossl_aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in,
+	uint8_t *out, int nblk)
+{
+	run_cipher(get_ctx(CTX_AES128_DEC, key, NULL), in,
+		   nblk * AES_BLOCK_SIZE, out);
+}
+
+static void ossl_aes256_cbc_encrypt(const uint8_t *key, const uint8_t *in,
+	int len, const uint8_t *iv, uint8_t *out)
+{
+	run_cipher(get_ctx(CTX_AES256_CBC_ENC, key, iv), in, len, out);
+}
+
+static void ossl_aes256_cbc_decrypt(const uint8_t *key, const uint8_t *in,
+	int len, const uint8_t *iv, uint8_t *out)
+{
+	run_cipher(get_ctx(CTX_AES256_CBC_DEC, key, iv), in, len, out);
+}
+
+static void ossl_sha256(const uint8_t *in, int len, uint8_t *out)
+{
+	if (EVP_Digest(in, len, out, NULL, EVP_sha256(), NULL) != 1)
+		abort();
+}
+
+static void ossl_hmac_sha256(const uint8_t *key, int key_len,
+	const uint8_t *msg, int msg_len, uint8_t *out)
+{
+	if (!HMAC(EVP_sha256(), key, key_len, msg, msg_len, out, NULL))
+		abort();
+}
+
+static void ossl_pbkdf2_sha256(const uint8_t *pass, int pass_len,
+	const uint8_t *salt, int salt_len, int n_rounds, uint8_t *out)
+{
+	if (PKCS5_PBKDF2_HMAC((const char *)pass, pass_len, salt, salt_len,
+			      n_rounds, EVP_sha256(), SHA256_HASH_SIZE,
+			      out) != 1)
+		abort();
+}
+
+const struct crypto_ops crypto_openssl_ops = {
+	.name			= "openssl",
+	.aes128_ecb_encrypt	= ossl_aes128_ecb_encrypt,
+	.aes128_ecb_decrypt	= ossl_aes128_ecb_decrypt,
+	.aes256_cbc_encrypt	= ossl_aes256_cbc_encrypt,
+	.aes256_cbc_decrypt	= ossl_aes256_cbc_decrypt,
+	.sha256			= ossl_sha256,
+	.hmac_sha256		= ossl_hmac_sha256,
+	.pbkdf2_sha256		= ossl_pbkdf2_sha256,
+};
@@ -0,0 +1,147 @@
+/*
+ * crypto-tomcrypt.c - libtomcrypt backend
+ *
+ * Copyright 2014 Kevin Cernekee <cernekee@gmail.com>
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tomcrypt.h>
+
+#include "crypto.h"
+#include "securid.h"
+
+static void tc_aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in,
+	uint8_t *out, int nblk)
+{
+	symmetric_key skey;
+	uint8_t tmp[AES_BLOCK_SIZE];
+	int i;
+
+	/* these shouldn't allocate memory or fail */
+	if (rijndael_setup(key, AES_KEY_SIZE, 0, &skey) != CRYPT_OK)
+		abort();
+	for (i = 0; i < nblk; i++) {
+		if (rijndael_ecb_encrypt(in, tmp, &skey) != CRYPT_OK)
+			abort();
+		/* in case "in" and "out" point to the same buffer */
+		memcpy(out, tmp, AES_BLOCK_SIZE);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+	rijndael_done(&skey);
+}
+
+static void tc_aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in,
+	uint8_t *out, int nblk)
+{
+	symmetric_key skey;
+	uint8_t tmp[AES_BLOCK_SIZE];
+	int i;
+
+	if (rijndael_setup(key, AES_KEY_SIZE, 0, &skey) != CRYPT_OK)
+		abort();
+	for (i = 0; i < nblk; i++) {
+		if (rijndael_ecb_decrypt(in, tmp, &skey) != CRYPT_OK)
+			abort();
+		memcpy(out, tmp, AES_BLOCK_SIZE);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+	rijndael_done(&skey);
+}
+
+static void tc_aes256_cbc_decrypt(const uint8_t *key, const uint8_t *in,
+	int in_len, const uint8_t *iv, uint8_t *out)
+{
+	symmetric_key skey;
+	int i, j;
+	uint8_t local_iv[AES_BLOCK_SIZE], next_iv[AES_BLOCK_SIZE];
+
+	rijndael_setup(key, AES256_KEY_SIZE, 0, &skey);
+
+	memcpy(local_iv, iv, AES_BLOCK_SIZE);
+	for (i = 0; i < in_len; i += AES_BLOCK_SIZE) {
+		memcpy(next_iv, in, AES_BLOCK_SIZE);
+		rijndael_ecb_decrypt(in, out, &skey);
+		for (j = 0; j < AES_BLOCK_SIZE; j++)
+			out[j] ^= local_iv[j];
+		memcpy(local_iv, next_iv, AES_BLOCK_SIZE);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+	rijndael_done(&skey);
+}
+
+static void tc_aes256_cbc_encrypt(const uint8_t *key, const uint8_t *in,
+	int in_len, const uint8_t *iv, uint8_t *out)
+{
+	symmetric_key skey;
+	int i, j;
+	uint8_t xored_in[AES_BLOCK_SIZE];
+
+	rijndael_setup(key, AES256_KEY_SIZE, 0, &skey);
+
+	for (i = 0; i < in_len; i += AES_BLOCK_SIZE) {
+		for (j = 0; j < AES_BLOCK_SIZE; j++) {
+			xored_in[j] = in[j] ^
+				      (i ? out[j - AES_BLOCK_SIZE] : iv[j]);
+		}
+		rijndael_ecb_encrypt(xored_in, out, &skey);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+	}
+	rijndael_done(&skey);
+}
+
+static void tc_sha256(const uint8_t *in, int len, uint8_t *out)
+{
+	hash_state md;
+
+	sha256_init(&md);
+	sha256_process(&md, in, len);
+	sha256_done(&md, out);
+}
+
+static void tc_hmac_sha256(const uint8_t *key, int key_len,
+	const uint8_t *msg, int msg_len, uint8_t *out)
+{
+	crypto_generic_hmac_sha256(&tc_sha256, key, key_len, msg, msg_len,
+				   out);
+}
+
+static void tc_pbkdf2_sha256(const uint8_t *pass, int pass_len,
+	const uint8_t *salt, int salt_len, int n_rounds, uint8_t *out)
+{
+	crypto_generic_pbkdf2_sha256(&tc_sha256, pass, pass_len, salt,
+				     salt_len, n_rounds, out);
+}
+
+const struct crypto_ops crypto_tomcrypt_ops = {
+	.name			= "tomcrypt",
+	.aes128_ecb_encrypt	= tc_aes128_ecb_encrypt,
+	.aes128_ecb_decrypt	= tc_aes128_ecb_decrypt,
+	.aes256_cbc_encrypt	= tc_aes256_cbc_encrypt,
+	.aes256_cbc_decrypt	= tc_aes256_cbc_decrypt,
+	.sha256			= tc_sha256,
+	.hmac_sha256		= tc_hmac_sha256,
+	.pbkdf2_sha256		= tc_pbkdf2_sha256,
+};
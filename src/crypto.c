@@ -0,0 +1,587 @@
+/*
+ * crypto.c - backend selection, generic helpers, and self test
+ *
+ * Copyright 2014 Kevin Cernekee <cernekee@gmail.com>
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AES_X86
+#include <immintrin.h>
+#endif
+
+#include "crypto.h"
+#include "securid.h"
+
+const struct crypto_ops *const crypto = &CRYPTO_OPS;
+
+void aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in, uint8_t *out)
+{
+	crypto->aes128_ecb_encrypt(key, in, out, 1);
+}
+
+void aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in, uint8_t *out)
+{
+	crypto->aes128_ecb_decrypt(key, in, out, 1);
+}
+
+/********************************************************************
+ * Multi-key AES
+ ********************************************************************/
+
+#ifdef AES_X86
+
+/* blocks in flight; enough to cover the latency of AESENC */
+#define AESNI_LANES		8
+
+/* next AES-128 round key, given the previous one and AESKEYGENASSIST */
+static inline __attribute__((always_inline, target("aes,sse2")))
+__m128i aesni_next_key(__m128i key, __m128i kg)
+{
+	kg = _mm_shuffle_epi32(kg, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, kg);
+}
+
+/*
+ * Each lane expands its key schedule on the fly, one round ahead of its
+ * data, so nothing is stored and the lanes' dependency chains interleave.
+ */
+#define AESNI_ROUND(RCON)						\
+	for (l = 0; l < AESNI_LANES; l++) {				\
+		k[l] = aesni_next_key(k[l],				\
+				      _mm_aeskeygenassist_si128(k[l], RCON)); \
+		s[l] = _mm_aesenc_si128(s[l], k[l]);			\
+	}
+
+__attribute__((target("aes,sse2")))
+static void aesni_encrypt_lanes(const uint8_t *keys, const uint8_t *in,
+				uint8_t *out)
+{
+	__m128i k[AESNI_LANES], s[AESNI_LANES];
+	int l;
+
+	for (l = 0; l < AESNI_LANES; l++) {
+		k[l] = _mm_loadu_si128((const __m128i *)&keys[l * 16]);
+		s[l] = _mm_xor_si128(k[l],
+			_mm_loadu_si128((const __m128i *)&in[l * 16]));
+	}
+	AESNI_ROUND(0x01)
+	AESNI_ROUND(0x02)
+	AESNI_ROUND(0x04)
+	AESNI_ROUND(0x08)
+	AESNI_ROUND(0x10)
+	AESNI_ROUND(0x20)
+	AESNI_ROUND(0x40)
+	AESNI_ROUND(0x80)
+	AESNI_ROUND(0x1b)
+	for (l = 0; l < AESNI_LANES; l++) {
+		k[l] = aesni_next_key(k[l],
+				      _mm_aeskeygenassist_si128(k[l], 0x36));
+		s[l] = _mm_aesenclast_si128(s[l], k[l]);
+		_mm_storeu_si128((__m128i *)&out[l * 16], s[l]);
+	}
+}
+
+static int have_aesni(void)
+{
+	static int cached = -1;
+
+	if (cached < 0)
+		cached = __builtin_cpu_supports("aes") &&
+			 __builtin_cpu_supports("sse2");
+	return cached;
+}
+
+#endif /* AES_X86 */
+
+void aes128_ecb_encrypt_multikey_impl(int impl, const uint8_t *keys,
+	const uint8_t *in, uint8_t *out, int n)
+{
+	int i;
+
+#ifdef AES_X86
+	if (impl && have_aesni()) {
+		uint8_t k[AESNI_LANES * 16], b[AESNI_LANES * 16];
+
+		for (; n >= AESNI_LANES; n -= AESNI_LANES) {
+			aesni_encrypt_lanes(keys, in, out);
+			keys += AESNI_LANES * 16;
+			in += AESNI_LANES * 16;
+			out += AESNI_LANES * 16;
+		}
+		if (!n)
+			return;
+
+		/* pad the tail out to a full set of lanes */
+		memset(k, 0, sizeof(k));
+		memset(b, 0, sizeof(b));
+		memcpy(k, keys, n * 16);
+		memcpy(b, in, n * 16);
+		aesni_encrypt_lanes(k, b, b);
+		memcpy(out, b, n * 16);
+		memset(k, 0, sizeof(k));
+		memset(b, 0, sizeof(b));
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		crypto->aes128_ecb_encrypt(&keys[i * 16], &in[i * 16],
+					   &out[i * 16], 1);
+}
+
+void aes128_ecb_encrypt_multikey(const uint8_t *keys, const uint8_t *in,
+	uint8_t *out, int n)
+{
+	aes128_ecb_encrypt_multikey_impl(1, keys, in, out, n);
+}
+
+/********************************************************************
+ * Multi-lane PBKDF2
+ ********************************************************************/
+
+#ifdef __GNUC__
+
+/* independent derivations in flight; one 256-bit vector of words */
+#define PBKDF2_LANES		8
+
+typedef uint32_t sha256_vec __attribute__((vector_size(PBKDF2_LANES * 4)));
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/* one SHA256 compression per lane; W is clobbered */
+static inline __attribute__((always_inline))
+void sha256_lanes(sha256_vec *st, sha256_vec *w)
+{
+	sha256_vec a = st[0], b = st[1], c = st[2], d = st[3];
+	sha256_vec e = st[4], f = st[5], g = st[6], h = st[7];
+	sha256_vec t1, t2;
+	int i;
+
+	/* fully unrolled, the ring buffer indices and K[i] are constants */
+#pragma GCC unroll 64
+	for (i = 0; i < 64; i++) {
+		if (i >= 16) {
+			sha256_vec w2 = w[(i - 2) & 15], w15 = w[(i - 15) & 15];
+
+			w[i & 15] += (ROR32(w2, 17) ^ ROR32(w2, 19) ^ (w2 >> 10)) +
+				     w[(i - 7) & 15] +
+				     (ROR32(w15, 7) ^ ROR32(w15, 18) ^ (w15 >> 3));
+		}
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i & 15];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	st[0] += a;
+	st[1] += b;
+	st[2] += c;
+	st[3] += d;
+	st[4] += e;
+	st[5] += f;
+	st[6] += g;
+	st[7] += h;
+}
+
+static inline uint32_t be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * HMAC(key, msg) = H((key ^ opad) || H((key ^ ipad) || msg)), so each
+ * lane's two key blocks are compressed once up front, and every PBKDF2
+ * round after that is exactly two compressions of a padded 32-byte block.
+ */
+static inline __attribute__((always_inline))
+void pbkdf2_lanes(const uint8_t *const *pass, const int *pass_len,
+		  const uint8_t *const *salt, int salt_len, int n_rounds,
+		  uint8_t *const *out)
+{
+	sha256_vec istate[8], ostate[8], st[8], u[8], acc[8], w[16];
+	uint8_t blk[PBKDF2_LANES][SHA256_BLOCK_SIZE];
+	int i, j, l, round;
+
+	/* pass ^ ipad, pass ^ opad */
+	for (l = 0; l < PBKDF2_LANES; l++) {
+		memset(blk[l], 0, SHA256_BLOCK_SIZE);
+		if (pass_len[l] > SHA256_BLOCK_SIZE)
+			crypto->sha256(pass[l], pass_len[l], blk[l]);
+		else
+			memcpy(blk[l], pass[l], pass_len[l]);
+	}
+	for (j = 0; j < 16; j++)
+		for (l = 0; l < PBKDF2_LANES; l++)
+			w[j][l] = be32(&blk[l][j * 4]) ^ 0x36363636;
+	for (i = 0; i < 8; i++)
+		istate[i] = sha256_iv[i] + (sha256_vec){ 0 };
+	sha256_lanes(istate, w);
+
+	for (j = 0; j < 16; j++)
+		for (l = 0; l < PBKDF2_LANES; l++)
+			w[j][l] = be32(&blk[l][j * 4]) ^ 0x5c5c5c5c;
+	for (i = 0; i < 8; i++)
+		ostate[i] = sha256_iv[i] + (sha256_vec){ 0 };
+	sha256_lanes(ostate, w);
+
+	/* U1 = HMAC(pass, salt || INT(1)), in a single padded block */
+	for (l = 0; l < PBKDF2_LANES; l++) {
+		uint32_t bits = (SHA256_BLOCK_SIZE + salt_len + 4) * 8;
+
+		memset(blk[l], 0, SHA256_BLOCK_SIZE);
+		memcpy(blk[l], salt[l], salt_len);
+		blk[l][salt_len + 3] = 1;
+		blk[l][salt_len + 4] = 0x80;
+		blk[l][62] = bits >> 8;
+		blk[l][63] = bits;
+	}
+	for (j = 0; j < 16; j++)
+		for (l = 0; l < PBKDF2_LANES; l++)
+			w[j][l] = be32(&blk[l][j * 4]);
+	memcpy(u, istate, sizeof(u));
+	sha256_lanes(u, w);
+
+	for (round = 1; ; round++) {
+		/* outer hash of the inner digest in U */
+		for (i = 0; i < 8; i++)
+			w[i] = u[i];
+		w[8] = 0x80000000 + (sha256_vec){ 0 };
+		for (i = 9; i < 15; i++)
+			w[i] = (sha256_vec){ 0 };
+		w[15] = (SHA256_BLOCK_SIZE + SHA256_HASH_SIZE) * 8 +
+			(sha256_vec){ 0 };
+		memcpy(u, ostate, sizeof(u));
+		sha256_lanes(u, w);
+
+		if (round == 1)
+			memcpy(acc, u, sizeof(acc));
+		else
+			for (i = 0; i < 8; i++)
+				acc[i] ^= u[i];
+		if (round == n_rounds)
+			break;
+
+		/* inner hash of the previous U */
+		for (i = 0; i < 8; i++)
+			w[i] = u[i];
+		w[8] = 0x80000000 + (sha256_vec){ 0 };
+		for (i = 9; i < 15; i++)
+			w[i] = (sha256_vec){ 0 };
+		w[15] = (SHA256_BLOCK_SIZE + SHA256_HASH_SIZE) * 8 +
+			(sha256_vec){ 0 };
+		memcpy(st, istate, sizeof(st));
+		sha256_lanes(st, w);
+		memcpy(u, st, sizeof(u));
+	}
+
+	for (l = 0; l < PBKDF2_LANES; l++)
+		for (i = 0; i < 8; i++) {
+			out[l][i * 4 + 0] = acc[i][l] >> 24;
+			out[l][i * 4 + 1] = acc[i][l] >> 16;
+			out[l][i * 4 + 2] = acc[i][l] >> 8;
+			out[l][i * 4 + 3] = acc[i][l];
+		}
+
+	memset(blk, 0, sizeof(blk));
+	memset(istate, 0, sizeof(istate));
+	memset(ostate, 0, sizeof(ostate));
+	memset(u, 0, sizeof(u));
+	memset(acc, 0, sizeof(acc));
+	memset(w, 0, sizeof(w));
+}
+
+#ifdef AES_X86
+__attribute__((target("avx2")))
+static void pbkdf2_lanes_avx2(const uint8_t *const *pass,
+	const int *pass_len, const uint8_t *const *salt, int salt_len,
+	int n_rounds, uint8_t *const *out)
+{
+	pbkdf2_lanes(pass, pass_len, salt, salt_len, n_rounds, out);
+}
+
+static int have_avx2(void)
+{
+	static int cached = -1;
+
+	if (cached < 0)
+		cached = __builtin_cpu_supports("avx2");
+	return cached;
+}
+#endif
+
+static void pbkdf2_lanes_generic(const uint8_t *const *pass,
+	const int *pass_len, const uint8_t *const *salt, int salt_len,
+	int n_rounds, uint8_t *const *out)
+{
+	pbkdf2_lanes(pass, pass_len, salt, salt_len, n_rounds, out);
+}
+
+#endif /* __GNUC__ */
+
+void pbkdf2_sha256_multi_impl(int impl, const uint8_t *const *pass,
+	const int *pass_len, const uint8_t *salt, int salt_len, int n_rounds,
+	uint8_t *out, int n)
+{
+	int i;
+
+#ifdef __GNUC__
+	/* U1's message must fit in one block along with its padding */
+	if (impl && n_rounds >= 1 &&
+	    salt_len + 4 + 9 <= SHA256_BLOCK_SIZE) {
+		const uint8_t *p[PBKDF2_LANES], *s[PBKDF2_LANES];
+		uint8_t *o[PBKDF2_LANES], spare[SHA256_HASH_SIZE];
+		int len[PBKDF2_LANES], l;
+
+		for (; n > 0; n -= PBKDF2_LANES) {
+			/* a short tail repeats lane 0 and discards the output */
+			for (l = 0; l < PBKDF2_LANES; l++) {
+				i = l < n ? l : 0;
+				p[l] = pass[i];
+				len[l] = pass_len[i];
+				s[l] = &salt[i * salt_len];
+				o[l] = l < n ? &out[l * SHA256_HASH_SIZE] :
+					       spare;
+			}
+#ifdef AES_X86
+			if (have_avx2())
+				pbkdf2_lanes_avx2(p, len, s, salt_len,
+						  n_rounds, o);
+			else
+#endif
+				pbkdf2_lanes_generic(p, len, s, salt_len,
+						     n_rounds, o);
+			pass += PBKDF2_LANES;
+			pass_len += PBKDF2_LANES;
+			salt += PBKDF2_LANES * salt_len;
+			out += PBKDF2_LANES * SHA256_HASH_SIZE;
+		}
+		memset(spare, 0, sizeof(spare));
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		crypto->pbkdf2_sha256(pass[i], pass_len[i], &salt[i * salt_len],
+				      salt_len, n_rounds,
+				      &out[i * SHA256_HASH_SIZE]);
+}
+
+void pbkdf2_sha256_multi(const uint8_t *const *pass, const int *pass_len,
+	const uint8_t *salt, int salt_len, int n_rounds, uint8_t *out, int n)
+{
+	pbkdf2_sha256_multi_impl(1, pass, pass_len, salt, salt_len, n_rounds,
+				 out, n);
+}
+
+/********************************************************************
+ * Generic implementations
+ ********************************************************************/
+
+void crypto_generic_hmac_sha256(crypto_sha256_fn sha256,
+	const uint8_t *key, int key_len, const uint8_t *msg, int msg_len,
+	uint8_t *out)
+{
+	uint8_t tmp_key[SHA256_HASH_SIZE], *buf;
+	uint8_t outer[SHA256_BLOCK_SIZE + SHA256_HASH_SIZE];
+	int i;
+
+	if (key_len > SHA256_BLOCK_SIZE) {
+		sha256(key, key_len, tmp_key);
+		key = tmp_key;
+		key_len = SHA256_HASH_SIZE;
+	}
+
+	/* inner hash: (key ^ ipad) || msg */
+	buf = alloca(SHA256_BLOCK_SIZE + msg_len);
+	memset(buf, 0x36, SHA256_BLOCK_SIZE);
+	memset(outer, 0x5c, SHA256_BLOCK_SIZE);
+	for (i = 0; i < key_len; i++) {
+		buf[i] ^= key[i];
+		outer[i] ^= key[i];
+	}
+	memcpy(&buf[SHA256_BLOCK_SIZE], msg, msg_len);
+	sha256(buf, SHA256_BLOCK_SIZE + msg_len, &outer[SHA256_BLOCK_SIZE]);
+
+	/* outer hash: (key ^ opad) || inner */
+	sha256(outer, sizeof(outer), out);
+}
+
+void crypto_generic_pbkdf2_sha256(crypto_sha256_fn sha256,
+	const uint8_t *pass, int pass_len, const uint8_t *salt, int salt_len,
+	int n_rounds, uint8_t *out)
+{
+	uint8_t *ext_salt;
+	uint8_t hash[SHA256_HASH_SIZE];
+	int i, round;
+
+	ext_salt = alloca(salt_len + 4);
+	memcpy(ext_salt, salt, salt_len);
+
+	/* always 0x00000001, as the output size is fixed at SHA256_HASH_SIZE */
+	ext_salt[salt_len + 0] = 0;
+	ext_salt[salt_len + 1] = 0;
+	ext_salt[salt_len + 2] = 0;
+	ext_salt[salt_len + 3] = 1;
+
+	crypto_generic_hmac_sha256(sha256, pass, pass_len, ext_salt,
+				   salt_len + 4, out);
+	memcpy(hash, out, SHA256_HASH_SIZE);
+
+	for (round = 2; round <= n_rounds; round++) {
+		crypto_generic_hmac_sha256(sha256, pass, pass_len, hash,
+					   SHA256_HASH_SIZE, hash);
+
+		for (i = 0; i < SHA256_HASH_SIZE; i++)
+			out[i] ^= hash[i];
+	}
+}
+
+/********************************************************************
+ * Known-answer tests
+ ********************************************************************/
+
+static const uint8_t kat_aes128_key[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const uint8_t kat_aes128_pt[] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+	0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+static const uint8_t kat_aes128_ct[] = {
+	0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+	0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+
+static const uint8_t kat_aes256_key[] = {
+	0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+	0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+	0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+	0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+static const uint8_t kat_aes256_pt[] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+static const uint8_t kat_aes256_ct[] = {
+	0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba,
+	0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+	0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d,
+	0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d };
+
+static const uint8_t kat_sha256_abc[] = {
+	0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+	0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+	0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+	0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+
+/* RFC 4231 test case 2 */
+static const uint8_t kat_hmac[] = {
+	0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e,
+	0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+	0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83,
+	0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43 };
+
+/* P = "password", S = "salt", c = 4096 */
+static const uint8_t kat_pbkdf2[] = {
+	0xc5, 0xe4, 0x78, 0xd5, 0x92, 0x88, 0xc8, 0x41,
+	0xaa, 0x53, 0x0d, 0xb6, 0x84, 0x5c, 0x4c, 0x8d,
+	0x96, 0x28, 0x93, 0xa0, 0x01, 0xce, 0x4e, 0x11,
+	0xa4, 0x96, 0x38, 0x73, 0xaa, 0x98, 0x13, 0x4a };
+
+int crypto_selftest(const struct crypto_ops *ops)
+{
+	uint8_t buf[64], hash[SHA256_HASH_SIZE];
+	int i;
+
+	/* multi-block ECB must match block-at-a-time, and work in place */
+	for (i = 0; i < 4; i++)
+		memcpy(&buf[i * AES_BLOCK_SIZE], kat_aes128_pt, AES_BLOCK_SIZE);
+	ops->aes128_ecb_encrypt(kat_aes128_key, buf, buf, 4);
+	for (i = 0; i < 4; i++)
+		if (memcmp(&buf[i * AES_BLOCK_SIZE], kat_aes128_ct,
+			   AES_BLOCK_SIZE))
+			return ERR_GENERAL;
+	ops->aes128_ecb_decrypt(kat_aes128_key, buf, buf, 4);
+	for (i = 0; i < 4; i++)
+		if (memcmp(&buf[i * AES_BLOCK_SIZE], kat_aes128_pt,
+			   AES_BLOCK_SIZE))
+			return ERR_GENERAL;
+
+	ops->aes256_cbc_encrypt(kat_aes256_key, kat_aes256_pt,
+				sizeof(kat_aes256_pt), kat_aes128_key, buf);
+	if (memcmp(buf, kat_aes256_ct, sizeof(kat_aes256_ct)))
+		return ERR_GENERAL;
+	ops->aes256_cbc_decrypt(kat_aes256_key, buf, sizeof(kat_aes256_ct),
+				kat_aes128_key, buf);
+	if (memcmp(buf, kat_aes256_pt, sizeof(kat_aes256_pt)))
+		return ERR_GENERAL;
+
+	ops->sha256((const uint8_t *)"abc", 3, hash);
+	if (memcmp(hash, kat_sha256_abc, SHA256_HASH_SIZE))
+		return ERR_GENERAL;
+
+	ops->hmac_sha256((const uint8_t *)"Jefe", 4,
+			 (const uint8_t *)"what do ya want for nothing?", 28,
+			 hash);
+	if (memcmp(hash, kat_hmac, SHA256_HASH_SIZE))
+		return ERR_GENERAL;
+
+	ops->pbkdf2_sha256((const uint8_t *)"password", 8,
+			   (const uint8_t *)"salt", 4, 4096, hash);
+	if (memcmp(hash, kat_pbkdf2, SHA256_HASH_SIZE))
+		return ERR_GENERAL;
+
+	return ERR_NONE;
+}
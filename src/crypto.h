@@ -0,0 +1,138 @@
+/*
+ * crypto.h - internal crypto backend interface
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __STOKEN_CRYPTO_H__
+#define __STOKEN_CRYPTO_H__
+
+#include <stdint.h>
+
+/*
+ * Each crypto library is wrapped by one of these.  libstoken uses the
+ * backend chosen with ./configure --with-crypto; stoken-bench links every
+ * backend that was found, so they can be compared.
+ *
+ * None of these may fail.
+ */
+struct crypto_ops {
+	const char		*name;
+
+	/*
+	 * NBLK independent 16-byte blocks under one AES-128 key.  The key
+	 * schedule is computed once per call, so batch callers should pass
+	 * as many blocks as they have.  IN and OUT may be the same buffer.
+	 */
+	void (*aes128_ecb_encrypt)(const uint8_t *key, const uint8_t *in,
+				   uint8_t *out, int nblk);
+	void (*aes128_ecb_decrypt)(const uint8_t *key, const uint8_t *in,
+				   uint8_t *out, int nblk);
+
+	/* LEN must be a multiple of the block size */
+	void (*aes256_cbc_encrypt)(const uint8_t *key, const uint8_t *in,
+				   int len, const uint8_t *iv, uint8_t *out);
+	void (*aes256_cbc_decrypt)(const uint8_t *key, const uint8_t *in,
+				   int len, const uint8_t *iv, uint8_t *out);
+
+	void (*sha256)(const uint8_t *in, int len, uint8_t *out);
+	void (*hmac_sha256)(const uint8_t *key, int key_len,
+			    const uint8_t *msg, int msg_len, uint8_t *out);
+	/* output is always SHA256_HASH_SIZE bytes */
+	void (*pbkdf2_sha256)(const uint8_t *pass, int pass_len,
+			      const uint8_t *salt, int salt_len,
+			      int n_rounds, uint8_t *out);
+};
+
+extern const struct crypto_ops crypto_tomcrypt_ops;
+extern const struct crypto_ops crypto_openssl_ops;
+extern const struct crypto_ops crypto_nettle_ops;
+
+/* the backend selected at configure time */
+extern const struct crypto_ops *const crypto;
+
+/* convenience wrappers around the selected backend */
+void aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in, uint8_t *out);
+void aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in, uint8_t *out);
+
+static inline void aes256_cbc_encrypt(const uint8_t *key, const uint8_t *in,
+	int len, const uint8_t *iv, uint8_t *out)
+{
+	crypto->aes256_cbc_encrypt(key, in, len, iv, out);
+}
+
+static inline void aes256_cbc_decrypt(const uint8_t *key, const uint8_t *in,
+	int len, const uint8_t *iv, uint8_t *out)
+{
+	crypto->aes256_cbc_decrypt(key, in, len, iv, out);
+}
+
+static inline void sha256_hash(const uint8_t *in, int len, uint8_t *out)
+{
+	crypto->sha256(in, len, out);
+}
+
+/*
+ * N blocks, each under its own AES-128 key: block i of OUT is block i of IN
+ * encrypted with key i of KEYS (all arrays of 16-byte entries; IN and OUT
+ * may be the same buffer).  This is the securid_mac() pattern, where every
+ * step re-keys.  On CPUs with AES-NI, eight key schedules are expanded in
+ * flight at once; otherwise the selected backend is called per block.
+ *
+ * The _impl variant forces the backend path when IMPL is 0, for testing.
+ */
+void aes128_ecb_encrypt_multikey(const uint8_t *keys, const uint8_t *in,
+	uint8_t *out, int n);
+void aes128_ecb_encrypt_multikey_impl(int impl, const uint8_t *keys,
+	const uint8_t *in, uint8_t *out, int n);
+
+/*
+ * N independent PBKDF2-HMAC-SHA256 derivations: entry i uses PASS[i]
+ * (PASS_LEN[i] bytes) and the i-th SALT_LEN-byte salt in SALT, and writes
+ * SHA256_HASH_SIZE bytes to the i-th slot of OUT.  Eight derivations run
+ * in the lanes of one vector (AVX2 where the CPU has it), with the HMAC
+ * pads hashed once per derivation instead of once per round.
+ *
+ * The _impl variant forces the backend path when IMPL is 0, for testing.
+ */
+void pbkdf2_sha256_multi(const uint8_t *const *pass, const int *pass_len,
+	const uint8_t *salt, int salt_len, int n_rounds, uint8_t *out, int n);
+void pbkdf2_sha256_multi_impl(int impl, const uint8_t *const *pass,
+	const int *pass_len, const uint8_t *salt, int salt_len, int n_rounds,
+	uint8_t *out, int n);
+
+/*
+ * Generic code, for backends that lack a native implementation.  The
+ * HMAC/PBKDF2 helpers are built on the backend's SHA256 function.
+ */
+typedef void (*crypto_sha256_fn)(const uint8_t *in, int len, uint8_t *out);
+
+void crypto_generic_hmac_sha256(crypto_sha256_fn sha256,
+	const uint8_t *key, int key_len, const uint8_t *msg, int msg_len,
+	uint8_t *out);
+void crypto_generic_pbkdf2_sha256(crypto_sha256_fn sha256,
+	const uint8_t *pass, int pass_len, const uint8_t *salt, int salt_len,
+	int n_rounds, uint8_t *out);
+
+/*
+ * Known-answer tests (FIPS-197, SP 800-38A, RFC 4231 and
+ * PBKDF2-HMAC-SHA256).  Returns ERR_NONE, or ERR_GENERAL if any vector
+ * fails.
+ */
+int crypto_selftest(const struct crypto_ops *ops);
+
+#endif /* !__STOKEN_CRYPTO_H__ */
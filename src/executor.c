@@ -0,0 +1,494 @@
+/*
+ * executor.c - work-stealing thread pool shared by all batch operations
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stoken.h"
+#include "stoken-internal.h"
+
+/*
+ * Every worker owns a deque of tasks.  A task is either a range of a
+ * __stoken_parallel_for() batch or a detached __stoken_exec_async() call.
+ * A worker that picks up a range larger than the batch's grain splits it
+ * in half, pushes the upper half onto the bottom of its own deque, and
+ * keeps going with the lower half.  Idle workers steal from the top of
+ * other deques, so they take the biggest pieces that are left.
+ *
+ * Threads that are not workers push onto a shared injection deque.  A
+ * thread waiting for its batch helps by running other batch tasks, which
+ * also makes nested batches safe.  Async tasks can take a long time, so
+ * they are only ever run by workers.
+ *
+ * The deques are protected by plain mutexes.  There is little contention
+ * because each task typically runs one or more PBKDF2 or AES computations.
+ */
+
+struct ex_batch {
+	exec_fn_t		*fn;
+	void			*arg;
+	int			grain;
+	/* ranges queued or running */
+	int			pending;
+};
+
+struct ex_task {
+	struct ex_batch		*batch;
+	int			start;
+	int			end;
+	/* used instead of BATCH for detached tasks */
+	void			(*async_fn)(void *arg);
+	void			*async_arg;
+};
+
+struct ex_deque {
+	pthread_mutex_t		lock;
+	struct ex_task		*buf;
+	/* tasks are buf[head % cap] .. buf[(tail - 1) % cap] */
+	unsigned int		cap;
+	unsigned int		head;
+	unsigned int		tail;
+};
+
+struct ex_worker {
+	pthread_t		thread;
+	struct ex_deque		dq;
+};
+
+static struct {
+	/* protects everything below except the deques */
+	pthread_mutex_t		lock;
+	/* idle workers sleep here */
+	pthread_cond_t		wake;
+	/* broadcast when a batch finishes */
+	pthread_cond_t		done;
+	int			n_sleeping;
+	int			stop;
+
+	/* configuration from stoken_set_threads() */
+	int			n_threads;
+	int			*cpus;
+	int			n_cpus;
+
+	int			started;
+	/* deques to steal from, and threads actually created */
+	int			n_workers;
+	int			n_running;
+	struct ex_worker	*workers;
+	struct ex_deque		inject;
+} ex = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.n_threads = STOKEN_THREADS_AUTO,
+	.inject = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static pthread_once_t ex_once = PTHREAD_ONCE_INIT;
+
+/* the deque this thread pushes onto, if it is a worker */
+static __thread struct ex_deque *my_deque;
+/* spreads out where each thread starts looking for work to steal */
+static __thread unsigned int steal_start;
+
+/***********************************************************************
+ * Deques
+ ***********************************************************************/
+
+static int dq_push(struct ex_deque *dq, const struct ex_task *task)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail - dq->head == dq->cap) {
+		unsigned int i, cap = dq->cap ? dq->cap * 2 : 64;
+		struct ex_task *buf = malloc(cap * sizeof(*buf));
+
+		if (!buf) {
+			pthread_mutex_unlock(&dq->lock);
+			return -1;
+		}
+		for (i = dq->head; i != dq->tail; i++)
+			buf[i % cap] = dq->buf[i % dq->cap];
+		free(dq->buf);
+		dq->buf = buf;
+		dq->cap = cap;
+	}
+	dq->buf[dq->tail % dq->cap] = *task;
+	__atomic_store_n(&dq->tail, dq->tail + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dq->lock);
+	return 0;
+}
+
+/* owner end: most recently split, so most likely still in cache */
+static int dq_pop(struct ex_deque *dq, struct ex_task *task, int any)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head &&
+	    (any || !dq->buf[(dq->tail - 1) % dq->cap].async_fn)) {
+		*task = dq->buf[(dq->tail - 1) % dq->cap];
+		__atomic_store_n(&dq->tail, dq->tail - 1, __ATOMIC_RELEASE);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ret;
+}
+
+/* thief end: oldest, and therefore largest, pieces first */
+static int dq_steal(struct ex_deque *dq, struct ex_task *task, int any)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head &&
+	    (any || !dq->buf[dq->head % dq->cap].async_fn)) {
+		*task = dq->buf[dq->head % dq->cap];
+		__atomic_store_n(&dq->head, dq->head + 1, __ATOMIC_RELEASE);
+		ret = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ret;
+}
+
+/* lockless peek; head and tail are only ever stored atomically */
+static int dq_empty(struct ex_deque *dq)
+{
+	return __atomic_load_n(&dq->head, __ATOMIC_ACQUIRE) ==
+	       __atomic_load_n(&dq->tail, __ATOMIC_ACQUIRE);
+}
+
+static void dq_reset(struct ex_deque *dq)
+{
+	pthread_mutex_init(&dq->lock, NULL);
+	free(dq->buf);
+	dq->buf = NULL;
+	dq->cap = dq->head = dq->tail = 0;
+}
+
+/***********************************************************************
+ * Scheduling
+ ***********************************************************************/
+
+/* ANY: also accept detached tasks (workers only) */
+static int find_work(struct ex_task *task, int any)
+{
+	int i, n = ex.n_workers, start;
+
+	if (my_deque && dq_pop(my_deque, task, any))
+		return 1;
+	if (dq_steal(&ex.inject, task, any))
+		return 1;
+
+	start = n ? steal_start++ % n : 0;
+	for (i = 0; i < n; i++) {
+		struct ex_deque *dq = &ex.workers[(start + i) % n].dq;
+
+		if (dq != my_deque && dq_steal(dq, task, any))
+			return 1;
+	}
+	return 0;
+}
+
+static int work_visible(void)
+{
+	int i;
+
+	if (!dq_empty(&ex.inject))
+		return 1;
+	for (i = 0; i < ex.n_workers; i++)
+		if (!dq_empty(&ex.workers[i].dq))
+			return 1;
+	return 0;
+}
+
+static void wake_workers(void)
+{
+	pthread_mutex_lock(&ex.lock);
+	if (ex.n_sleeping)
+		pthread_cond_signal(&ex.wake);
+	pthread_mutex_unlock(&ex.lock);
+}
+
+static void run_task(struct ex_task *task)
+{
+	struct ex_batch *b = task->batch;
+	int start = task->start, end = task->end;
+
+	if (task->async_fn) {
+		task->async_fn(task->async_arg);
+		return;
+	}
+
+	while (end - start > b->grain) {
+		struct ex_task upper = { .batch = b };
+
+		upper.start = start + (end - start) / 2;
+		upper.end = end;
+		__atomic_add_fetch(&b->pending, 1, __ATOMIC_ACQ_REL);
+		if (dq_push(my_deque ? : &ex.inject, &upper) < 0) {
+			/* out of memory: just do all of it here */
+			__atomic_sub_fetch(&b->pending, 1, __ATOMIC_ACQ_REL);
+			break;
+		}
+		end = upper.start;
+		wake_workers();
+	}
+	b->fn(b->arg, start, end);
+
+	/* B may go out of scope as soon as PENDING hits 0 */
+	if (!__atomic_sub_fetch(&b->pending, 1, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&ex.lock);
+		pthread_cond_broadcast(&ex.done);
+		pthread_mutex_unlock(&ex.lock);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct ex_worker *w = arg;
+	struct ex_task task;
+
+	my_deque = &w->dq;
+	while (1) {
+		if (find_work(&task, 1)) {
+			run_task(&task);
+			continue;
+		}
+
+		pthread_mutex_lock(&ex.lock);
+		ex.n_sleeping++;
+		/* re-check under the lock so that a push can't be missed */
+		while (!work_visible() && !ex.stop)
+			pthread_cond_wait(&ex.wake, &ex.lock);
+		ex.n_sleeping--;
+		if (ex.stop && !work_visible()) {
+			pthread_mutex_unlock(&ex.lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&ex.lock);
+	}
+}
+
+/***********************************************************************
+ * Pool management
+ ***********************************************************************/
+
+/* the workers don't exist in a forked child; start over on next use */
+static void ex_atfork_child(void)
+{
+	pthread_mutex_init(&ex.lock, NULL);
+	pthread_cond_init(&ex.wake, NULL);
+	pthread_cond_init(&ex.done, NULL);
+	ex.n_sleeping = 0;
+	ex.started = 0;
+	ex.n_workers = 0;
+	ex.n_running = 0;
+	ex.workers = NULL;
+	dq_reset(&ex.inject);
+}
+
+static void ex_init(void)
+{
+	pthread_atfork(NULL, NULL, &ex_atfork_child);
+}
+
+static int configured_workers(void)
+{
+	long n;
+
+	if (ex.n_threads != STOKEN_THREADS_AUTO)
+		return ex.n_threads;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n;
+}
+
+static void set_affinity(int i)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+
+	if (!ex.n_cpus)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(ex.cpus[i % ex.n_cpus], &set);
+	/* a CPU that went offline shouldn't stop the worker from running */
+	pthread_setaffinity_np(ex.workers[i].thread, sizeof(set), &set);
+#endif
+}
+
+/* caller holds ex.lock */
+static int start_workers(void)
+{
+	int i, n = configured_workers(), ret = 0;
+
+	if (n) {
+		ex.workers = calloc(n, sizeof(*ex.workers));
+		if (!ex.workers) {
+			n = 0;
+			ret = -1;
+		}
+	}
+	for (i = 0; i < n; i++)
+		pthread_mutex_init(&ex.workers[i].dq.lock, NULL);
+
+	/* workers look at each other's deques as soon as they start */
+	ex.n_workers = n;
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&ex.workers[i].thread, NULL, &worker_main,
+				   &ex.workers[i])) {
+			ret = -1;
+			break;
+		}
+		set_affinity(i);
+	}
+	ex.n_running = i;
+	if (!ex.n_running)
+		ex.n_workers = 0;
+
+	__atomic_store_n(&ex.started, 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* caller holds ex.lock; drains all queued work first */
+static void stop_workers(void)
+{
+	int i, n = ex.n_workers;
+
+	ex.stop = 1;
+	pthread_cond_broadcast(&ex.wake);
+	pthread_mutex_unlock(&ex.lock);
+	for (i = 0; i < ex.n_running; i++)
+		pthread_join(ex.workers[i].thread, NULL);
+	pthread_mutex_lock(&ex.lock);
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_destroy(&ex.workers[i].dq.lock);
+		free(ex.workers[i].dq.buf);
+	}
+	free(ex.workers);
+	ex.workers = NULL;
+	ex.n_workers = 0;
+	ex.n_running = 0;
+	ex.started = 0;
+	ex.stop = 0;
+}
+
+static int ensure_started(void)
+{
+	int started;
+
+	pthread_once(&ex_once, &ex_init);
+
+	/* written once under the lock; stable until stoken_set_threads() */
+	if (__atomic_load_n(&ex.started, __ATOMIC_ACQUIRE))
+		return ex.n_workers;
+
+	pthread_mutex_lock(&ex.lock);
+	if (!ex.started)
+		start_workers();
+	started = ex.n_workers;
+	pthread_mutex_unlock(&ex.lock);
+	return started;
+}
+
+/***********************************************************************
+ * Internal API
+ ***********************************************************************/
+
+void __stoken_parallel_for(int n, int grain, exec_fn_t *fn, void *arg)
+{
+	struct ex_batch b = { .fn = fn, .arg = arg, .pending = 1 };
+	struct ex_task task = { .batch = &b, .start = 0, .end = n };
+
+	if (n <= 0)
+		return;
+	b.grain = grain < 1 ? 1 : grain;
+	if (n <= b.grain || !ensure_started()) {
+		fn(arg, 0, n);
+		return;
+	}
+
+	run_task(&task);
+	while (__atomic_load_n(&b.pending, __ATOMIC_ACQUIRE)) {
+		struct ex_task other;
+
+		if (find_work(&other, my_deque != NULL)) {
+			run_task(&other);
+			continue;
+		}
+		pthread_mutex_lock(&ex.lock);
+		if (__atomic_load_n(&b.pending, __ATOMIC_ACQUIRE) &&
+		    !work_visible())
+			pthread_cond_wait(&ex.done, &ex.lock);
+		pthread_mutex_unlock(&ex.lock);
+	}
+}
+
+int __stoken_exec_async(void (*fn)(void *arg), void *arg)
+{
+	struct ex_task task = { .async_fn = fn, .async_arg = arg };
+
+	if (!ensure_started())
+		return -1;
+	if (dq_push(my_deque ? : &ex.inject, &task) < 0)
+		return -1;
+	wake_workers();
+	return 0;
+}
+
+/***********************************************************************
+ * Exported functions
+ ***********************************************************************/
+
+int stoken_set_threads(int n_threads, const int *cpus, int n_cpus,
+	unsigned int flags)
+{
+	int *copy = NULL, ret = 0;
+
+	if (n_threads < STOKEN_THREADS_AUTO || n_cpus < 0 ||
+	    (n_cpus && !cpus))
+		return -EINVAL;
+	if (n_cpus) {
+		copy = malloc(n_cpus * sizeof(*copy));
+		if (!copy)
+			return -EIO;
+		memcpy(copy, cpus, n_cpus * sizeof(*copy));
+	}
+
+	pthread_once(&ex_once, &ex_init);
+
+	pthread_mutex_lock(&ex.lock);
+	if (ex.started)
+		stop_workers();
+	free(ex.cpus);
+	ex.cpus = copy;
+	ex.n_cpus = n_cpus;
+	ex.n_threads = n_threads;
+	if ((flags & STOKEN_THREADS_EAGER) && start_workers() < 0)
+		ret = -EIO;
+	pthread_mutex_unlock(&ex.lock);
+	return ret;
+}
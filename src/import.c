@@ -0,0 +1,479 @@
+/*
+ * import.c - bulk import of token directories into a keyring
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "securid.h"
+#include "sdtid.h"
+#include "stoken.h"
+#include "stoken-internal.h"
+
+/*
+ * The directory is processed IMPORT_CHUNK files at a time, which bounds
+ * the number of open descriptors and the size of the arena.  Each chunk
+ * goes through three parallel passes on the shared executor:
+ *
+ *   1. open + fstat every file
+ *   2. pread each file into its slot in one arena, close it, and split it
+ *      into lines (or parse it, if it's an sdtid document)
+ *   3. decode, decrypt and add each token to the keyring
+ *
+ * In a lazy keyring, step 3 stops after decoding, and the keyring decrypts
+ * each token when it is first used.
+ *
+ * Results are then reported in file name order on the calling thread.
+ */
+
+#define IMPORT_CHUNK		256
+
+/* larger files are rejected rather than read */
+#define IMPORT_MAX_FILE		(1 << 20)
+
+struct import_file {
+	char			*name;
+	int			fd;
+	size_t			size;
+	char			*data;
+	/* parsed once, for all of the file's tokens */
+	struct sdtid_doc	*doc;
+	int			n_tokens;
+	/* 0, or a negative errno if the file couldn't be used */
+	int			rc;
+};
+
+struct import_token {
+	struct import_file	*file;
+	/* the line holding the token, or NULL for an sdtid entry */
+	const char		*str;
+	int			which;
+
+	int			rc;
+	char			serial[SERIAL_CHARS + 1];
+};
+
+struct import_pass {
+	int			dirfd;
+	struct import_file	*files;
+	struct import_token	*tokens;
+
+	struct stoken_keyring	*kr;
+	const char		*pass;
+	const char		*devid;
+	const char		*pin;
+	struct securid_key_cache *key_cache;
+	struct keyring_lazy	*lazy;
+};
+
+/* same test as "stoken provision" uses for its list entries */
+static const char *token_line(const char *line)
+{
+	while (isspace(*line))
+		line++;
+	if (isdigit(*line) || strcasestr(line, "ctfData="))
+		return line;
+	return NULL;
+}
+
+static void open_files(void *arg, int start, int end)
+{
+	struct import_pass *p = arg;
+	int i;
+
+	for (i = start; i < end; i++) {
+		struct import_file *f = &p->files[i];
+		struct stat st;
+
+		f->fd = openat(p->dirfd, f->name, O_RDONLY | O_CLOEXEC);
+		if (f->fd < 0) {
+			f->rc = -errno;
+			continue;
+		}
+		if (fstat(f->fd, &st) < 0)
+			f->rc = -errno;
+		else if (!S_ISREG(st.st_mode) || st.st_size > IMPORT_MAX_FILE)
+			f->rc = -EINVAL;
+		else {
+			f->size = st.st_size;
+			continue;
+		}
+		close(f->fd);
+		f->fd = -1;
+	}
+}
+
+static void read_files(void *arg, int start, int end)
+{
+	struct import_pass *p = arg;
+	int i;
+
+	for (i = start; i < end; i++) {
+		struct import_file *f = &p->files[i];
+		size_t len = 0;
+		char *s;
+
+		if (f->fd < 0)
+			continue;
+		while (len < f->size) {
+			ssize_t ret = pread(f->fd, &f->data[len],
+					    f->size - len, len);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				f->rc = -errno;
+				break;
+			}
+			if (ret == 0)
+				break;
+			len += ret;
+		}
+		close(f->fd);
+		f->fd = -1;
+		if (f->rc)
+			continue;
+		f->data[len] = 0;
+
+		if (strcasestr(f->data, "<?xml ")) {
+			f->rc = sdtid_doc_new(f->data, &f->doc) == ERR_NONE ?
+				0 : -EINVAL;
+			if (f->doc)
+				f->n_tokens = sdtid_doc_count(f->doc);
+			continue;
+		}
+		for (s = f->data; s < &f->data[len]; s += strlen(s) + 1) {
+			s[strcspn(s, "\r\n")] = 0;
+			if (token_line(s))
+				f->n_tokens++;
+		}
+	}
+}
+
+static int import_rc(int rc)
+{
+	switch (rc) {
+	case ERR_NONE:
+		return 0;
+	case ERR_BAD_PASSWORD:
+	case ERR_MISSING_PASSWORD:
+	case ERR_DECRYPT_FAILED:
+	case ERR_BAD_DEVID:
+		return -EACCES;
+	case ERR_NO_MEMORY:
+		return -EIO;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * v3 serial numbers are encrypted, so those can't wait.  Unprotected sdtid
+ * seeds were already decrypted by the decoder.
+ */
+static int can_defer(struct import_pass *p, const struct securid_token *t)
+{
+	return p->lazy && !t->v3 && !t->has_dec_seed;
+}
+
+/*
+ * Unlock and add one token; T is wiped afterward.  RC is the decoder's
+ * result, and T only holds anything to release if that succeeded.
+ */
+static void import_one(struct import_pass *p, struct import_token *it,
+		       struct securid_token *t, int rc)
+{
+	if (rc != ERR_NONE) {
+		it->rc = import_rc(rc);
+		memset(t, 0, sizeof(*t));
+		return;
+	}
+
+	memcpy(it->serial, t->serial, sizeof(it->serial));
+	if (can_defer(p, t)) {
+		it->rc = __stoken_keyring_add_lazy(p->kr, t, p->lazy,
+						   t->sdtid ? it->file->doc :
+						   NULL, it->which);
+		goto out;
+	}
+	t->key_cache = p->key_cache;
+	rc = securid_decrypt_seed(t, p->pass, p->devid);
+	/* v3 serial numbers are only known now */
+	if (rc == ERR_NONE)
+		memcpy(it->serial, t->serial, sizeof(it->serial));
+	it->rc = import_rc(rc);
+	if (!it->rc)
+		it->rc = __stoken_keyring_add(p->kr, t, p->pin);
+
+out:
+	securid_finalize_token(t);
+	memset(t, 0, sizeof(*t));
+}
+
+/* ctf strings are decoded a group at a time, to batch the v2 checksums */
+static void import_group(struct import_pass *p, const char *const *str,
+			 const int *idx, int n)
+{
+	struct securid_token t[MAC_LANES];
+	int i, rc[MAC_LANES];
+
+	__stoken_parse_and_decode_tokens(str, n, t, rc);
+	for (i = 0; i < n; i++)
+		import_one(p, &p->tokens[idx[i]], &t[i], rc[i]);
+}
+
+static void import_tokens(void *arg, int start, int end)
+{
+	struct import_pass *p = arg;
+	const char *str[MAC_LANES];
+	int i, m = 0, idx[MAC_LANES];
+
+	for (i = start; i < end; i++) {
+		struct import_token *it = &p->tokens[i];
+
+		if (!it->str) {
+			struct securid_token t;
+
+			memset(&t, 0, sizeof(t));
+			import_one(p, it, &t, sdtid_decode_doc(it->file->doc,
+							       &t, it->which));
+			continue;
+		}
+		str[m] = it->str;
+		idx[m++] = i;
+		if (m == MAC_LANES) {
+			import_group(p, str, idx, m);
+			m = 0;
+		}
+	}
+	if (m)
+		import_group(p, str, idx, m);
+}
+
+static int list_dir(int dirfd, char ***names)
+{
+	struct dirent *de;
+	int n = 0, size = 0, fd;
+	char **list = NULL;
+	DIR *dir;
+
+	/* closedir() closes the descriptor it was given */
+	fd = dup(dirfd);
+	if (fd < 0)
+		return -errno;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return -errno;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (n == size) {
+			char **tmp;
+
+			size = size ? size * 2 : 256;
+			tmp = realloc(list, size * sizeof(*list));
+			if (!tmp)
+				goto nomem;
+			list = tmp;
+		}
+		list[n] = strdup(de->d_name);
+		if (!list[n])
+			goto nomem;
+		n++;
+	}
+	closedir(dir);
+	*names = list;
+	return n;
+
+nomem:
+	while (--n >= 0)
+		free(list[n]);
+	free(list);
+	closedir(dir);
+	return -EIO;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* tokens and keyring entries hold their own references */
+static void put_docs(struct import_file *files, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sdtid_doc_put(files[i].doc);
+		files[i].doc = NULL;
+	}
+}
+
+int stoken_keyring_import_dir(struct stoken_keyring *kr,
+	const char *dirname, const char *pass, const char *devid,
+	const char *pin, stoken_import_cb_t *callback, void *arg)
+{
+	struct import_file files[IMPORT_CHUNK];
+	struct import_pass p;
+	int n_files, base, added = 0, ret, i, j;
+	size_t arena_size = 0, token_size = 0;
+	char **names = NULL, *arena = NULL;
+
+	memset(&p, 0, sizeof(p));
+	p.dirfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (p.dirfd < 0)
+		return -errno;
+
+	n_files = list_dir(p.dirfd, &names);
+	if (n_files < 0) {
+		close(p.dirfd);
+		return n_files;
+	}
+	qsort(names, n_files, sizeof(*names), &cmp_names);
+
+	p.files = files;
+	p.kr = kr;
+	p.pass = pass;
+	p.devid = devid;
+	p.pin = pin;
+	p.key_cache = securid_key_cache_new();
+	p.lazy = __stoken_keyring_lazy_new(kr, pass, devid, pin);
+
+	for (base = 0; base < n_files; base += IMPORT_CHUNK) {
+		int n = n_files - base < IMPORT_CHUNK ?
+			n_files - base : IMPORT_CHUNK;
+		size_t need = 0;
+		int n_tokens = 0;
+
+		memset(files, 0, n * sizeof(*files));
+		for (i = 0; i < n; i++) {
+			files[i].name = names[base + i];
+			files[i].fd = -1;
+		}
+		__stoken_parallel_for(n, 1, &open_files, &p);
+
+		for (i = 0; i < n; i++)
+			if (files[i].fd >= 0)
+				need += files[i].size + 1;
+		if (need > arena_size) {
+			char *tmp = realloc(arena, need);
+
+			if (!tmp) {
+				for (i = 0; i < n; i++)
+					if (files[i].fd >= 0)
+						close(files[i].fd);
+				ret = -EIO;
+				goto out;
+			}
+			arena = tmp;
+			arena_size = need;
+		}
+		for (i = 0, need = 0; i < n; i++) {
+			if (files[i].fd < 0)
+				continue;
+			files[i].data = &arena[need];
+			need += files[i].size + 1;
+		}
+		__stoken_parallel_for(n, 1, &read_files, &p);
+
+		for (i = 0; i < n; i++)
+			n_tokens += files[i].n_tokens;
+		if (n_tokens * sizeof(*p.tokens) > token_size) {
+			struct import_token *tmp =
+				realloc(p.tokens, n_tokens * sizeof(*p.tokens));
+
+			if (!tmp) {
+				put_docs(files, n);
+				ret = -EIO;
+				goto out;
+			}
+			p.tokens = tmp;
+			token_size = n_tokens * sizeof(*p.tokens);
+		}
+
+		for (i = 0, n_tokens = 0; i < n; i++) {
+			struct import_file *f = &files[i];
+			const char *s = f->data;
+
+			for (j = 0; j < f->n_tokens; j++) {
+				struct import_token *it = &p.tokens[n_tokens++];
+
+				memset(it, 0, sizeof(*it));
+				it->file = f;
+				it->which = j;
+				if (f->doc)
+					continue;
+				while (!token_line(s))
+					s += strlen(s) + 1;
+				it->str = token_line(s);
+				s += strlen(s) + 1;
+			}
+		}
+		__stoken_parallel_for(n_tokens, MAC_LANES, &import_tokens, &p);
+		put_docs(files, n);
+
+		for (i = 0, j = 0; i < n; i++) {
+			struct import_file *f = &files[i];
+			int end = j + f->n_tokens;
+
+			if (!f->rc && !f->n_tokens)
+				f->rc = -EINVAL;
+			if (f->rc && callback)
+				callback(arg, f->name, NULL, f->rc);
+			for (; j < end; j++) {
+				struct import_token *it = &p.tokens[j];
+
+				if (!it->rc)
+					added++;
+				if (callback)
+					callback(arg, f->name,
+						 it->serial[0] ? it->serial :
+						 NULL, it->rc);
+			}
+		}
+		memset(arena, 0, need);
+	}
+	ret = added;
+
+out:
+	__stoken_keyring_lazy_put(p.lazy);
+	securid_key_cache_free(p.key_cache);
+	if (arena) {
+		memset(arena, 0, arena_size);
+		free(arena);
+	}
+	free(p.tokens);
+	for (i = 0; i < n_files; i++)
+		free(names[i]);
+	free(names);
+	close(p.dirfd);
+	return ret;
+}
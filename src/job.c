@@ -0,0 +1,228 @@
+/*
+ * job.c - background jobs with pollable completion handles
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "stoken.h"
+#include "stoken-internal.h"
+
+/*
+ * Jobs run on the shared executor (see executor.c).  Each job owns an
+ * eventfd (or a pipe, where eventfd is unavailable) that becomes readable
+ * when the job finishes, and stays readable until the job is freed.  If
+ * the executor has no worker threads, jobs run before
+ * __stoken_job_submit() returns.
+ *
+ * The caller and the executor each hold a reference to the job, so that
+ * a queued job can be cancelled without waiting for a worker to reach it.
+ */
+
+enum {
+	JOB_QUEUED = 0,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_CANCELLED,
+};
+
+struct stoken_job {
+	job_fn_t		*fn;
+	void			(*free_arg)(void *arg);
+	void			*arg;
+
+	/* protected by job_lock */
+	int			state;
+	int			result;
+	int			refs;
+
+	/* fds[0] is handed out; fds[1] is written (same fd for eventfd) */
+	int			fds[2];
+
+	/* protected by job_lock; called once, after the job finishes */
+	stoken_job_cb_t		*notify;
+	void			*notify_arg;
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast when a job finishes */
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static int open_fds(int *fds)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	return fds[0] < 0 ? -1 : 0;
+#else
+	int i;
+
+	if (pipe(fds) < 0)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+	}
+	return 0;
+#endif
+}
+
+static void close_fds(int *fds)
+{
+	close(fds[0]);
+	if (fds[1] != fds[0])
+		close(fds[1]);
+}
+
+static void signal_fd(int fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+	ssize_t ret;
+
+	do
+		ret = write(fd, &one, sizeof(one));
+	while (ret < 0 && errno == EINTR);
+}
+
+static void put_job(struct stoken_job *job)
+{
+	int refs;
+
+	pthread_mutex_lock(&job_lock);
+	refs = --job->refs;
+	pthread_mutex_unlock(&job_lock);
+	if (refs)
+		return;
+
+	close_fds(job->fds);
+	if (job->free_arg)
+		job->free_arg(job->arg);
+	free(job);
+}
+
+static void run_job(void *arg)
+{
+	struct stoken_job *job = arg;
+	stoken_job_cb_t *notify;
+	int rc;
+
+	pthread_mutex_lock(&job_lock);
+	if (job->state == JOB_CANCELLED) {
+		pthread_mutex_unlock(&job_lock);
+		put_job(job);
+		return;
+	}
+	job->state = JOB_RUNNING;
+	pthread_mutex_unlock(&job_lock);
+
+	rc = job->fn(job->arg);
+
+	pthread_mutex_lock(&job_lock);
+	job->result = rc;
+	job->state = JOB_DONE;
+	notify = job->notify;
+	signal_fd(job->fds[1]);
+	pthread_cond_broadcast(&job_done);
+	pthread_mutex_unlock(&job_lock);
+
+	/* the caller's reference keeps the job alive until it is freed */
+	if (notify)
+		notify(job->notify_arg);
+	put_job(job);
+}
+
+struct stoken_job *__stoken_job_submit(job_fn_t *fn,
+	void (*free_arg)(void *arg), void *arg)
+{
+	struct stoken_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+	if (open_fds(job->fds) < 0) {
+		free(job);
+		return NULL;
+	}
+	job->fn = fn;
+	job->free_arg = free_arg;
+	job->arg = arg;
+	job->refs = 2;
+
+	if (__stoken_exec_async(&run_job, job) < 0)
+		run_job(job);
+	return job;
+}
+
+int stoken_job_fd(struct stoken_job *job)
+{
+	return job->fds[0];
+}
+
+int stoken_job_result(struct stoken_job *job)
+{
+	int ret;
+
+	pthread_mutex_lock(&job_lock);
+	ret = job->state == JOB_DONE ? job->result : -EAGAIN;
+	pthread_mutex_unlock(&job_lock);
+	return ret;
+}
+
+int stoken_job_notify(struct stoken_job *job, stoken_job_cb_t *fn, void *arg)
+{
+	int ret = 1;
+
+	pthread_mutex_lock(&job_lock);
+	if (job->state != JOB_DONE) {
+		job->notify = fn;
+		job->notify_arg = arg;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&job_lock);
+	return ret;
+}
+
+void stoken_job_free(struct stoken_job *job)
+{
+	if (!job)
+		return;
+
+	pthread_mutex_lock(&job_lock);
+	if (job->state == JOB_QUEUED)
+		job->state = JOB_CANCELLED;
+	while (job->state == JOB_RUNNING)
+		pthread_cond_wait(&job_done, &job_lock);
+	pthread_mutex_unlock(&job_lock);
+
+	put_job(job);
+}
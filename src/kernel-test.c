@@ -0,0 +1,407 @@
+/*
+ * kernel-test.c - exhaustive differential test of the tokencode kernels
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Usage: stoken-kernel-test [FIRST_YEAR [LAST_YEAR]]
+ *
+ * Computes a code for every 30-second interval from Jan 1 of FIRST_YEAR
+ * (default 2000) through Dec 31 of LAST_YEAR (default 2040), for a set of
+ * tokens covering each digits/interval/PIN kernel.  Every code from the
+ * optimized paths is checked against a straight port of the original
+ * gmtime_r() + five-AES implementation.  Days are spread across the
+ * stoken_set_threads() workers.  Exits with status 1 on any mismatch.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crypto.h"
+#include "securid.h"
+#include "stoken-internal.h"
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
+#endif
+
+#define INTERVALS_PER_DAY	(24 * 60 * 2)
+
+/* mismatches printed before going quiet */
+#define MAX_REPORTS		10
+
+static const char *const seeds[] = {
+	"000102030405060708090a0b0c0d0e0f",
+	"8f1e6c29d07a4b35e2c9915d3ab0477c",
+};
+
+static const char *const serials[] = {
+	"000123456789",
+	"274153098612",
+};
+
+static const int digit_counts[] = { 6, 8, 7 };
+static const int intervals[] = { 30, 60 };
+/* including a PIN longer than the shortest code */
+static const char *const pins[] = { "", "1234", "87654321" };
+
+#define N_TOKENS	(ARRAY_SIZE(seeds) * ARRAY_SIZE(digit_counts) * \
+			 ARRAY_SIZE(intervals) * ARRAY_SIZE(pins))
+
+enum {
+	PATH_REFERENCE,
+	PATH_SINGLE,
+	PATH_MANY,
+	PATH_MULTI,
+	PATH_TIME_KEYS,
+	N_PATHS,
+};
+
+static const char *const path_names[N_PATHS] = {
+	"reference",
+	"securid_compute_tokencode",
+	"securid_compute_tokencodes",
+	"securid_compute_tokencodes_multi",
+	"securid_time_keys",
+};
+
+struct sweep {
+	struct securid_token	tokens[N_TOKENS];
+	struct securid_token	*token_ptrs[N_TOKENS];
+	long			first_day;
+
+	/* updated atomically by the workers */
+	long			mismatches[N_PATHS];
+	int64_t			cpu_nsec[N_PATHS];
+	long			reports;
+};
+
+typedef char code_t[STOKEN_MAX_TOKENCODE + 1];
+
+static double wall_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t thread_cpu_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/********************************************************************
+ * Reference implementation
+ ********************************************************************/
+
+static void bcd_write(uint8_t *out, int val, unsigned int bytes)
+{
+	out += bytes - 1;
+	for (; bytes; bytes--) {
+		*out = val % 10;
+		val /= 10;
+		*(out--) |= (val % 10) << 4;
+		val /= 10;
+	}
+}
+
+static void ref_bcd_time(time_t now, int interval, uint8_t *bcd_time,
+			 int *blk)
+{
+	struct tm gmt;
+
+	gmtime_r(&now, &gmt);
+	bcd_write(&bcd_time[0], gmt.tm_year + 1900, 2);
+	bcd_write(&bcd_time[2], gmt.tm_mon + 1, 1);
+	bcd_write(&bcd_time[3], gmt.tm_mday, 1);
+	bcd_write(&bcd_time[4], gmt.tm_hour, 1);
+	bcd_write(&bcd_time[5], gmt.tm_min & ~(interval == 30 ? 0x01 : 0x03),
+		  1);
+	bcd_time[6] = bcd_time[7] = 0;
+
+	if (interval == 30)
+		*blk = ((gmt.tm_min & 0x01) << 3) | ((gmt.tm_sec >= 30) << 2);
+	else
+		*blk = (gmt.tm_min & 0x03) << 2;
+}
+
+static void ref_key_from_time(const uint8_t *bcd_time, int bcd_time_bytes,
+			      const char *serial, uint8_t *key)
+{
+	int i;
+
+	memset(key, 0xaa, 8);
+	memcpy(key, bcd_time, bcd_time_bytes);
+	memset(key + 12, 0xbb, 4);
+
+	key += 8;
+	for (i = 4; i < 12; i += 2)
+		*(key++) = ((serial[i] - '0') << 4) | (serial[i + 1] - '0');
+}
+
+static void ref_tokencode(const struct securid_token *t, time_t now,
+			  char *code_out)
+{
+	uint8_t bcd_time[8], key0[AES_KEY_SIZE], key1[AES_KEY_SIZE];
+	int pin_len = strlen(t->pin), i, j;
+	uint32_t tokencode;
+
+	ref_bcd_time(now, securid_token_interval(t), bcd_time, &i);
+
+	ref_key_from_time(bcd_time, 2, t->serial, key0);
+	aes128_ecb_encrypt(t->dec_seed, key0, key0);
+	ref_key_from_time(bcd_time, 3, t->serial, key1);
+	aes128_ecb_encrypt(key0, key1, key1);
+	ref_key_from_time(bcd_time, 4, t->serial, key0);
+	aes128_ecb_encrypt(key1, key0, key0);
+	ref_key_from_time(bcd_time, 5, t->serial, key1);
+	aes128_ecb_encrypt(key0, key1, key1);
+	ref_key_from_time(bcd_time, 8, t->serial, key0);
+	aes128_ecb_encrypt(key1, key0, key0);
+
+	tokencode = (key0[i + 0] << 24) | (key0[i + 1] << 16) |
+		    (key0[i + 2] << 8)  | (key0[i + 3] << 0);
+
+	j = (t->flags & FLD_DIGIT_MASK) >> FLD_DIGIT_SHIFT;
+	code_out[j + 1] = 0;
+	for (i = 0; j >= 0; j--, i++) {
+		uint8_t c = tokencode % 10;
+
+		tokencode /= 10;
+		if (i < pin_len)
+			c += t->pin[pin_len - i - 1] - '0';
+		code_out[j] = c % 10 + '0';
+	}
+}
+
+/********************************************************************
+ * Sweep
+ ********************************************************************/
+
+static void mismatch(struct sweep *s, int path, const struct securid_token *t,
+		     time_t when, const char *want, const char *got)
+{
+	char buf[32];
+	struct tm gmt;
+
+	__atomic_add_fetch(&s->mismatches[path], 1, __ATOMIC_RELAXED);
+	if (__atomic_fetch_add(&s->reports, 1, __ATOMIC_RELAXED) >=
+	    MAX_REPORTS)
+		return;
+
+	gmtime_r(&when, &gmt);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &gmt);
+	printf("MISMATCH %s: serial %s flags %04x pin '%s' at %s: "
+	       "want %s, got %s\n", path_names[path], t->serial, t->flags,
+	       t->pin, buf, want, got);
+}
+
+/* one timestamp per 30s interval, at a different offset in each */
+static void day_times(long day, time_t *when)
+{
+	int k;
+
+	for (k = 0; k < INTERVALS_PER_DAY; k++)
+		when[k] = (time_t)day * 86400 + k * 30 + (k * 13) % 30;
+}
+
+static void sweep_days(void *arg, int start, int end)
+{
+	struct sweep *s = arg;
+	time_t when[INTERVALS_PER_DAY];
+	code_t *ref = malloc(N_TOKENS * INTERVALS_PER_DAY * sizeof(code_t));
+	code_t *out = malloc(INTERVALS_PER_DAY * sizeof(code_t));
+	struct securid_time_key *tk =
+		malloc(INTERVALS_PER_DAY * sizeof(*tk));
+	int64_t cpu[N_PATHS] = { 0 }, mark;
+	long bad[N_PATHS] = { 0 };
+	int d, i, k;
+
+	if (!ref || !out || !tk) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (d = start; d < end; d++) {
+		day_times(s->first_day + d, when);
+
+		for (i = 0; i < (int)N_TOKENS; i++) {
+			struct securid_token *t = &s->tokens[i];
+			code_t *r = &ref[i * INTERVALS_PER_DAY];
+
+			mark = thread_cpu_nsec();
+			for (k = 0; k < INTERVALS_PER_DAY; k++)
+				ref_tokencode(t, when[k], r[k]);
+			cpu[PATH_REFERENCE] += thread_cpu_nsec() - mark;
+
+			mark = thread_cpu_nsec();
+			for (k = 0; k < INTERVALS_PER_DAY; k++)
+				securid_compute_tokencode(t, when[k], out[k]);
+			cpu[PATH_SINGLE] += thread_cpu_nsec() - mark;
+			for (k = 0; k < INTERVALS_PER_DAY; k++)
+				if (strcmp(r[k], out[k]))
+					mismatch(s, PATH_SINGLE, t, when[k],
+						 r[k], out[k]);
+
+			mark = thread_cpu_nsec();
+			securid_compute_tokencodes(t, when, INTERVALS_PER_DAY,
+						   out);
+			cpu[PATH_MANY] += thread_cpu_nsec() - mark;
+			for (k = 0; k < INTERVALS_PER_DAY; k++)
+				if (strcmp(r[k], out[k]))
+					mismatch(s, PATH_MANY, t, when[k],
+						 r[k], out[k]);
+		}
+
+		for (k = 0; k < INTERVALS_PER_DAY; k++) {
+			code_t multi[N_TOKENS];
+
+			mark = thread_cpu_nsec();
+			securid_compute_tokencodes_multi(s->token_ptrs,
+							 N_TOKENS, when[k],
+							 multi);
+			cpu[PATH_MULTI] += thread_cpu_nsec() - mark;
+			for (i = 0; i < (int)N_TOKENS; i++) {
+				const char *r = ref[i * INTERVALS_PER_DAY + k];
+
+				if (strcmp(r, multi[i]))
+					mismatch(s, PATH_MULTI, &s->tokens[i],
+						 when[k], r, multi[i]);
+			}
+		}
+
+		for (i = 0; i < (int)ARRAY_SIZE(intervals); i++) {
+			int interval = intervals[i];
+
+			mark = thread_cpu_nsec();
+			securid_time_keys(when, INTERVALS_PER_DAY, interval,
+					  tk);
+			cpu[PATH_TIME_KEYS] += thread_cpu_nsec() - mark;
+			for (k = 0; k < INTERVALS_PER_DAY; k++) {
+				uint8_t bcd_time[8];
+				int blk;
+
+				ref_bcd_time(when[k], interval, bcd_time,
+					     &blk);
+				if (memcmp(bcd_time, tk[k].bcd_time, 8) ||
+				    blk != tk[k].blk)
+					bad[PATH_TIME_KEYS]++;
+			}
+		}
+	}
+
+	for (i = 0; i < N_PATHS; i++) {
+		__atomic_add_fetch(&s->cpu_nsec[i], cpu[i], __ATOMIC_RELAXED);
+		__atomic_add_fetch(&s->mismatches[i], bad[i],
+				   __ATOMIC_RELAXED);
+	}
+	free(ref);
+	free(out);
+	free(tk);
+}
+
+static uint8_t hex_nibble(char c)
+{
+	return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+static void init_tokens(struct sweep *s)
+{
+	unsigned int a, b, c, d, n = 0, i;
+
+	for (a = 0; a < ARRAY_SIZE(seeds); a++)
+	for (b = 0; b < ARRAY_SIZE(digit_counts); b++)
+	for (c = 0; c < ARRAY_SIZE(intervals); c++)
+	for (d = 0; d < ARRAY_SIZE(pins); d++, n++) {
+		struct securid_token *t = &s->tokens[n];
+
+		memset(t, 0, sizeof(*t));
+		t->version = 2;
+		t->has_dec_seed = 1;
+		for (i = 0; i < AES_KEY_SIZE; i++)
+			t->dec_seed[i] = (hex_nibble(seeds[a][2 * i]) << 4) |
+					 hex_nibble(seeds[a][2 * i + 1]);
+		strcpy(t->serial, serials[a]);
+		t->flags = FL_TIMESEEDS | FL_128BIT | FLD_PINMODE_MASK |
+			   ((digit_counts[b] - 1) << FLD_DIGIT_SHIFT) |
+			   ((intervals[c] == 60) << FLD_NUMSECONDS_SHIFT);
+		t->pinmode = 3;
+		strcpy(t->pin, pins[d]);
+		s->token_ptrs[n] = t;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static struct sweep s;
+	int first_year = 2000, last_year = 2040, i, ret = 0;
+	struct tm tm = { 0 };
+	long days, codes;
+	double start, wall;
+
+	if (argc > 1)
+		first_year = atoi(argv[1]);
+	if (argc > 2)
+		last_year = atoi(argv[2]);
+	if (first_year < 1970 || last_year < first_year || last_year > 9999) {
+		fprintf(stderr, "usage: %s [FIRST_YEAR [LAST_YEAR]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	tm.tm_mday = 1;
+	tm.tm_year = first_year - 1900;
+	s.first_day = timegm(&tm) / 86400;
+	tm.tm_year = last_year + 1 - 1900;
+	days = timegm(&tm) / 86400 - s.first_day;
+
+	init_tokens(&s);
+
+	printf("%d-%d: %ld days, %d tokens, %s backend\n", first_year,
+	       last_year, days, (int)N_TOKENS, crypto->name);
+
+	start = wall_time();
+	__stoken_parallel_for(days, 1, &sweep_days, &s);
+	wall = wall_time() - start;
+
+	codes = days * INTERVALS_PER_DAY * (long)N_TOKENS;
+	for (i = 0; i < N_PATHS; i++) {
+		/* time keys are checked once per interval length, not token */
+		long n = i == PATH_TIME_KEYS ?
+			 days * INTERVALS_PER_DAY * (long)ARRAY_SIZE(intervals) :
+			 codes;
+
+		printf("%-34s %10ld mismatches %8.1f ns/code/core\n",
+		       path_names[i], s.mismatches[i],
+		       (double)s.cpu_nsec[i] / n);
+		if (s.mismatches[i])
+			ret = 1;
+	}
+	printf("%ld codes per path in %.1f s wall time\n", codes, wall);
+
+	return ret;
+}
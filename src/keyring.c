@@ -0,0 +1,1279 @@
+/*
+ * keyring.c - multi-token keyring with background tokencode precomputation
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sdtid.h"
+#include "securid.h"
+#include "stoken.h"
+#include "stoken-internal.h"
+
+/*
+ * Each token gets a ring of DEPTH precomputed codes.  Interval number N
+ * (i.e. UNIX time / token interval) lives in slot N % DEPTH, tagged with N
+ * so that stale or missing slots are detected.  The precompute thread keeps
+ * the slots for the current interval and the next DEPTH-1 intervals filled;
+ * lookups that miss the ring just compute the code directly.
+ */
+struct keyring_entry {
+	struct keyring_entry	*next;
+	struct securid_token	t;
+	int			interval;
+
+	/*
+	 * One reference for the hash table, plus one for each thread that
+	 * dropped the shard lock while still using the entry.
+	 */
+	int			refs;
+
+	/*
+	 * In lazy keyrings, T starts out decoded but not decrypted, and
+	 * is only used for its serial number and flags until materialize()
+	 * moves STATE to KE_READY.  LAZY and DOC are what it needs for that,
+	 * and are released afterward.
+	 */
+	int			state;
+	struct keyring_lazy	*lazy;
+	struct sdtid_doc	*doc;
+	int			which;
+
+	pthread_mutex_t		lock;
+	int			ring_depth;
+	int64_t			*ring_n;
+	char			(*ring_code)[STOKEN_MAX_TOKENCODE + 1];
+
+	/*
+	 * Verification state: how many intervals the token's clock is
+	 * ahead of ours, and the last interval accepted (codes are single
+	 * use).
+	 */
+	int			drift;
+	int64_t			last_n;
+};
+
+/*
+ * Tokens are partitioned across shards by serial number hash.  Each shard
+ * has its own lock, hash table and entries, so requests for tokens in
+ * different shards never write to the same cache line.  In NUMA mode, all
+ * of a shard's memory is first touched by a thread running on the shard's
+ * home CPU, so that it is allocated on that CPU's node.
+ */
+struct keyring_shard {
+	/* protects the hash table, and keeps entries alive while in use */
+	pthread_rwlock_t	lock;
+	struct keyring_entry	**buckets;
+	int			n_buckets;
+	int			n_tokens;
+	int			cpu;
+
+	/*
+	 * Entries are carved out of slabs of whole pages, which are locked
+	 * (if RLIMIT_MEMLOCK allows) since entries hold decrypted seeds.  In
+	 * NUMA mode the slabs are node-local.
+	 */
+	struct keyring_entry	*free_entries;
+	struct keyring_slab	*slabs;
+	int			n_slabs;
+	size_t			locked_bytes;
+} __attribute__((aligned(64)));
+
+struct keyring_slab {
+	struct keyring_slab	*next;
+	struct keyring_entry	entries[];
+};
+
+struct stoken_keyring {
+	unsigned int		flags;
+	int			n_shards;
+	struct keyring_shard	**shards;
+
+	/* precompute thread state, protected by pc_lock */
+	pthread_mutex_t		pc_lock;
+	pthread_cond_t		pc_cond;
+	pthread_t		pc_thread;
+	int			pc_running;
+	int			pc_stop;
+	int			pc_kick;
+	int			pc_depth;
+	int			pc_cpu_percent;
+
+	/* lazy entries that haven't been materialized yet */
+	int			n_pending;
+};
+
+enum {
+	KE_READY = 0,
+	KE_PENDING,
+	/* the seed could not be decrypted */
+	KE_FAILED,
+};
+
+/*
+ * Shared by all of the tokens from one lazy import: the credentials, and
+ * a key cache for the v2 key hashes.  Copies of the password and device
+ * ID are kept until the last of those tokens is materialized or removed.
+ */
+struct keyring_lazy {
+	int			refs;
+	char			*pass;
+	char			*devid;
+	char			*pin;
+	struct securid_key_cache *key_cache;
+};
+
+#define KEYRING_MIN_BUCKETS	64
+#define KEYRING_MAX_SHARDS	1024
+
+/* entries per NUMA slab */
+#define KEYRING_SLAB_ENTRIES	256
+
+/* one day of 60-second codes */
+#define KEYRING_MAX_DEPTH	1440
+
+/* stoken_keyring_verify() searches at most this many intervals each way */
+#define KEYRING_MAX_WINDOW	10
+
+/* how much CPU time to spend before pausing to honor the budget */
+#define KEYRING_PACE_NSEC	10000000L
+
+/* buckets per task when precomputing with no CPU budget */
+#define KEYRING_FILL_GRAIN	16
+
+/* every token interval is a multiple of this */
+#define KEYRING_TICK		30
+
+static unsigned int serial_hash(const char *serial)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *serial; serial++)
+		h = (h ^ (uint8_t)*serial) * 16777619u;
+	return h;
+}
+
+/* buckets use the low bits of the hash, so pick the shard with the high */
+static struct keyring_shard *find_shard(struct stoken_keyring *kr,
+					unsigned int h)
+{
+	return kr->shards[((uint64_t)h * kr->n_shards) >> 32];
+}
+
+static struct keyring_entry *find_entry(struct keyring_shard *sh,
+					const char *serial, unsigned int h)
+{
+	struct keyring_entry *e;
+
+	e = sh->buckets[h & (sh->n_buckets - 1)];
+	for (; e; e = e->next)
+		if (!strcmp(e->t.serial, serial))
+			return e;
+	return NULL;
+}
+
+/***********************************************************************
+ * Shard memory
+ ***********************************************************************/
+
+struct touch_req {
+	void			*p;
+	size_t			len;
+};
+
+static void *touch_thread(void *arg)
+{
+	struct touch_req *r = arg;
+
+	memset(r->p, 0, r->len);
+	return NULL;
+}
+
+/* zero P on CPU, so that the kernel backs it with CPU's node */
+static void first_touch(int cpu, void *p, size_t len)
+{
+#ifdef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+	struct touch_req r = { p, len };
+	pthread_attr_t attr;
+	pthread_t thread;
+	cpu_set_t set;
+	int rc;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	rc = pthread_create(&thread, &attr, &touch_thread, &r);
+	pthread_attr_destroy(&attr);
+	if (!rc) {
+		pthread_join(thread, NULL);
+		return;
+	}
+#endif
+	memset(p, 0, len);
+}
+
+/*
+ * In NUMA mode, shard memory comes straight from mmap() so that no page
+ * has been touched yet.  Otherwise it's zeroed, cache line aligned heap.
+ */
+static void *shard_alloc(struct stoken_keyring *kr, int cpu, size_t len)
+{
+	void *p;
+
+	if (!(kr->flags & STOKEN_KEYRING_NUMA)) {
+		if (posix_memalign(&p, 64, len))
+			return NULL;
+		return memset(p, 0, len);
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	first_touch(cpu, p, len);
+	return p;
+}
+
+static void shard_free(struct stoken_keyring *kr, void *p, size_t len)
+{
+	if (!p)
+		return;
+	if (kr->flags & STOKEN_KEYRING_NUMA)
+		munmap(p, len);
+	else
+		free(p);
+}
+
+#define SLAB_SIZE	(sizeof(struct keyring_slab) + \
+			 KEYRING_SLAB_ENTRIES * sizeof(struct keyring_entry))
+
+/* caller holds the write lock */
+static struct keyring_entry *alloc_entry(struct stoken_keyring *kr,
+					 struct keyring_shard *sh)
+{
+	struct keyring_entry *e;
+	int i;
+
+	if (!sh->free_entries) {
+		struct keyring_slab *slab;
+
+		slab = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED)
+			return NULL;
+		/* locking faults the pages in, so place them first */
+		if (kr->flags & STOKEN_KEYRING_NUMA)
+			first_touch(sh->cpu, slab, SLAB_SIZE);
+		if (securid_lock_pages(slab, SLAB_SIZE))
+			sh->locked_bytes += SLAB_SIZE;
+
+		slab->next = sh->slabs;
+		sh->slabs = slab;
+		sh->n_slabs++;
+		for (i = 0; i < KEYRING_SLAB_ENTRIES; i++) {
+			slab->entries[i].next = sh->free_entries;
+			sh->free_entries = &slab->entries[i];
+		}
+	}
+	e = sh->free_entries;
+	sh->free_entries = e->next;
+	e->next = NULL;
+	return e;
+}
+
+/* caller holds the write lock, or is the only user of SH */
+static void free_entry(struct stoken_keyring *kr, struct keyring_shard *sh,
+		       struct keyring_entry *e)
+{
+	if (e->state == KE_PENDING)
+		__atomic_sub_fetch(&kr->n_pending, 1, __ATOMIC_RELAXED);
+	__stoken_keyring_lazy_put(e->lazy);
+	sdtid_doc_put(e->doc);
+	pthread_mutex_destroy(&e->lock);
+	free(e->ring_n);
+	free(e->ring_code);
+	memset(e, 0, sizeof(*e));
+
+	e->next = sh->free_entries;
+	sh->free_entries = e;
+}
+
+/* caller holds the write lock */
+static void grow_table(struct stoken_keyring *kr, struct keyring_shard *sh)
+{
+	int i, n = sh->n_buckets * 2;
+	struct keyring_entry **b = shard_alloc(kr, sh->cpu, n * sizeof(*b));
+
+	/* not fatal; the chains just get longer */
+	if (!b)
+		return;
+
+	for (i = 0; i < sh->n_buckets; i++) {
+		struct keyring_entry *e, *next;
+
+		for (e = sh->buckets[i]; e; e = next) {
+			unsigned int h = serial_hash(e->t.serial) & (n - 1);
+
+			next = e->next;
+			e->next = b[h];
+			b[h] = e;
+		}
+	}
+	shard_free(kr, sh->buckets, sh->n_buckets * sizeof(*b));
+	sh->buckets = b;
+	sh->n_buckets = n;
+}
+
+static struct keyring_shard *shard_new(struct stoken_keyring *kr, int cpu)
+{
+	struct keyring_shard *sh = shard_alloc(kr, cpu, sizeof(*sh));
+
+	if (!sh)
+		return NULL;
+	sh->cpu = cpu;
+	sh->n_buckets = KEYRING_MIN_BUCKETS;
+	sh->buckets = shard_alloc(kr, cpu,
+				  sh->n_buckets * sizeof(*sh->buckets));
+	if (!sh->buckets) {
+		shard_free(kr, sh, sizeof(*sh));
+		return NULL;
+	}
+	pthread_rwlock_init(&sh->lock, NULL);
+	return sh;
+}
+
+static void shard_destroy(struct stoken_keyring *kr, struct keyring_shard *sh)
+{
+	struct keyring_slab *slab, *next;
+	int i;
+
+	for (i = 0; i < sh->n_buckets; i++) {
+		struct keyring_entry *e, *next;
+
+		for (e = sh->buckets[i]; e; e = next) {
+			next = e->next;
+			free_entry(kr, sh, e);
+		}
+	}
+	for (slab = sh->slabs; slab; slab = next) {
+		next = slab->next;
+		munmap(slab, SLAB_SIZE);
+	}
+	shard_free(kr, sh->buckets, sh->n_buckets * sizeof(*sh->buckets));
+	pthread_rwlock_destroy(&sh->lock);
+	shard_free(kr, sh, sizeof(*sh));
+}
+
+/* home CPUs are handed out from the CPUs this process may run on */
+static int shard_cpus(int *cpus, int n)
+{
+	int i, n_cpus = 0;
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	if (!sched_getaffinity(0, sizeof(set), &set))
+		for (i = 0; i < CPU_SETSIZE && n_cpus < n; i++)
+			if (CPU_ISSET(i, &set))
+				cpus[n_cpus++] = i;
+#endif
+	if (!n_cpus) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+		for (i = 0; i < n && i < online; i++)
+			cpus[n_cpus++] = i;
+	}
+	if (!n_cpus)
+		cpus[n_cpus++] = 0;
+	return n_cpus;
+}
+
+/***********************************************************************
+ * Lazy materialization
+ ***********************************************************************/
+
+static void zap_string(char *s)
+{
+	if (s) {
+		memset(s, 0, strlen(s));
+		free(s);
+	}
+}
+
+struct keyring_lazy *__stoken_keyring_lazy_new(struct stoken_keyring *kr,
+	const char *pass, const char *devid, const char *pin)
+{
+	struct keyring_lazy *l;
+
+	if (!(kr->flags & STOKEN_KEYRING_LAZY))
+		return NULL;
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return NULL;
+	l->refs = 1;
+	if ((pass && !(l->pass = strdup(pass))) ||
+	    (devid && !(l->devid = strdup(devid))) ||
+	    (pin && !(l->pin = strdup(pin)))) {
+		__stoken_keyring_lazy_put(l);
+		return NULL;
+	}
+	/* not fatal; v2 key hashes are just computed per token */
+	l->key_cache = securid_key_cache_new();
+	return l;
+}
+
+void __stoken_keyring_lazy_put(struct keyring_lazy *l)
+{
+	if (!l || __atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	zap_string(l->pass);
+	zap_string(l->devid);
+	zap_string(l->pin);
+	securid_key_cache_free(l->key_cache);
+	free(l);
+}
+
+/* only the decrypted seed and metadata are needed from here on */
+static void entry_set_token(struct keyring_entry *e,
+			    const struct securid_token *t, const char *pin)
+{
+	e->t = *t;
+	e->t.sdtid = NULL;
+	e->t.v3 = NULL;
+	e->t.enc_pin_str = NULL;
+	e->t.key_cache = NULL;
+	e->t.interactive = 0;
+	e->t.finalized = 1;
+	if (securid_pin_required(t) && pin && strlen(pin))
+		strncpy(e->t.pin, pin, MAX_PIN + 1);
+	securid_prepare_token(&e->t);
+}
+
+/*
+ * Decrypt a pending entry's seed, once.  Threads that get here at the same
+ * time wait on E->lock for the first one to finish, so the work is never
+ * repeated.  The caller must not hold E->lock, and should only hold the
+ * shard lock if E is known not to be pending (see find_ready()).  Returns
+ * 0, or -EPERM if the seed couldn't be decrypted.
+ */
+static int materialize(struct stoken_keyring *kr, struct keyring_entry *e)
+{
+	struct securid_token t;
+	int rc = ERR_NONE, ret;
+
+	if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) == KE_READY)
+		return 0;
+
+	pthread_mutex_lock(&e->lock);
+	if (e->state == KE_PENDING) {
+		struct keyring_lazy *l = e->lazy;
+
+		t = e->t;
+		if (e->doc) {
+			memset(&t, 0, sizeof(t));
+			rc = sdtid_decode_doc(e->doc, &t, e->which);
+		}
+		if (rc == ERR_NONE) {
+			t.key_cache = l->key_cache;
+			rc = securid_decrypt_seed(&t, l->pass, l->devid);
+			if (rc == ERR_NONE)
+				entry_set_token(e, &t, l->pin);
+			securid_finalize_token(&t);
+		}
+		memset(&t, 0, sizeof(t));
+
+		__stoken_keyring_lazy_put(e->lazy);
+		sdtid_doc_put(e->doc);
+		e->lazy = NULL;
+		e->doc = NULL;
+		__atomic_store_n(&e->state, rc == ERR_NONE ? KE_READY :
+				 KE_FAILED, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&kr->n_pending, 1, __ATOMIC_RELAXED);
+	}
+	ret = e->state == KE_READY ? 0 : -EPERM;
+	pthread_mutex_unlock(&e->lock);
+	return ret;
+}
+
+/* caller holds SH->lock; E stays allocated until put_entry() */
+static void get_entry(struct keyring_entry *e)
+{
+	__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* caller must not hold SH->lock */
+static void put_entry(struct stoken_keyring *kr, struct keyring_shard *sh,
+		      struct keyring_entry *e)
+{
+	if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	/* it was removed from the table while we were using it */
+	pthread_rwlock_wrlock(&sh->lock);
+	free_entry(kr, sh, e);
+	pthread_rwlock_unlock(&sh->lock);
+}
+
+/*
+ * Look up SERIAL with SH->lock held for reading, making sure that the
+ * entry isn't pending.  The first use of a lazy entry drops the shard lock
+ * for the decrypt, so that adds and removes on the shard aren't held up;
+ * the entry is pinned meanwhile, and the lookup is redone afterward.
+ */
+static struct keyring_entry *find_ready(struct stoken_keyring *kr,
+					struct keyring_shard *sh,
+					const char *serial, unsigned int h)
+{
+	struct keyring_entry *e;
+
+	while ((e = find_entry(sh, serial, h)) != NULL &&
+	       __atomic_load_n(&e->state, __ATOMIC_ACQUIRE) == KE_PENDING) {
+		get_entry(e);
+		pthread_rwlock_unlock(&sh->lock);
+		materialize(kr, e);
+		put_entry(kr, sh, e);
+		pthread_rwlock_rdlock(&sh->lock);
+	}
+	return e;
+}
+
+/***********************************************************************
+ * Precomputation
+ ***********************************************************************/
+
+static int64_t thread_cpu_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* returns nonzero if the thread was asked to stop while waiting */
+static int pc_wait(struct stoken_keyring *kr, const struct timespec *until)
+{
+	int stop;
+
+	pthread_mutex_lock(&kr->pc_lock);
+	while (!kr->pc_stop && !kr->pc_kick)
+		if (pthread_cond_timedwait(&kr->pc_cond, &kr->pc_lock,
+					   until) == ETIMEDOUT)
+			break;
+	kr->pc_kick = 0;
+	stop = kr->pc_stop;
+	pthread_mutex_unlock(&kr->pc_lock);
+	return stop;
+}
+
+static int pc_sleep_nsec(struct stoken_keyring *kr, int64_t nsec)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	nsec += until.tv_nsec;
+	until.tv_sec += nsec / 1000000000;
+	until.tv_nsec = nsec % 1000000000;
+	return pc_wait(kr, &until);
+}
+
+/*
+ * Make sure E's ring covers [CUR, CUR + DEPTH) intervals.  Returns the
+ * number of codes computed, or -1 on allocation failure.
+ */
+static int fill_entry(struct keyring_entry *e, int depth, time_t now,
+		      time_t *when, char (*codes)[STOKEN_MAX_TOKENCODE + 1])
+{
+	int64_t cur = now / e->interval, n;
+	int i, missing = 0;
+
+	/* lazy tokens are only precomputed once something has used them */
+	if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) != KE_READY)
+		return 0;
+
+	pthread_mutex_lock(&e->lock);
+	if (e->ring_depth != depth) {
+		free(e->ring_n);
+		free(e->ring_code);
+		e->ring_n = malloc(depth * sizeof(*e->ring_n));
+		e->ring_code = malloc(depth * sizeof(*e->ring_code));
+		if (!e->ring_n || !e->ring_code) {
+			free(e->ring_n);
+			free(e->ring_code);
+			e->ring_n = NULL;
+			e->ring_code = NULL;
+			e->ring_depth = 0;
+			pthread_mutex_unlock(&e->lock);
+			return -1;
+		}
+		for (i = 0; i < depth; i++)
+			e->ring_n[i] = -1;
+		e->ring_depth = depth;
+	}
+	for (n = cur; n < cur + depth; n++)
+		if (e->ring_n[n % depth] != n)
+			when[missing++] = n * e->interval;
+	pthread_mutex_unlock(&e->lock);
+
+	if (!missing)
+		return 0;
+
+	/* consecutive intervals share most of the AES chain */
+	securid_compute_tokencodes(&e->t, when, missing, codes);
+
+	pthread_mutex_lock(&e->lock);
+	if (e->ring_depth == depth) {
+		for (i = 0; i < missing; i++) {
+			n = when[i] / e->interval;
+			e->ring_n[n % depth] = n;
+			memcpy(e->ring_code[n % depth], codes[i],
+			       sizeof(codes[i]));
+		}
+	}
+	pthread_mutex_unlock(&e->lock);
+	return missing;
+}
+
+struct fill_pass {
+	struct keyring_shard	*sh;
+	int			depth;
+	time_t			now;
+	int			filled;
+};
+
+/* unthrottled pass: buckets are spread across the executor's workers */
+static void fill_buckets(void *arg, int start, int end)
+{
+	struct fill_pass *p = arg;
+	struct keyring_shard *sh = p->sh;
+	time_t *when = malloc(p->depth * sizeof(*when));
+	char (*codes)[STOKEN_MAX_TOKENCODE + 1] =
+		malloc(p->depth * sizeof(*codes));
+	int b, filled = 0;
+
+	for (b = start; when && codes && b < end; b++) {
+		struct keyring_entry *e;
+
+		pthread_rwlock_rdlock(&sh->lock);
+		if (b >= sh->n_buckets) {
+			pthread_rwlock_unlock(&sh->lock);
+			break;
+		}
+		for (e = sh->buckets[b]; e; e = e->next) {
+			int rc = fill_entry(e, p->depth, p->now, when, codes);
+
+			if (rc > 0)
+				filled += rc;
+		}
+		pthread_rwlock_unlock(&sh->lock);
+	}
+	__atomic_add_fetch(&p->filled, filled, __ATOMIC_RELAXED);
+	free(when);
+	free(codes);
+}
+
+static int fill_parallel(struct stoken_keyring *kr, int depth, time_t now)
+{
+	int i, filled = 0;
+
+	for (i = 0; i < kr->n_shards; i++) {
+		struct fill_pass p = { kr->shards[i], depth, now, 0 };
+		int n;
+
+		pthread_rwlock_rdlock(&p.sh->lock);
+		n = p.sh->n_buckets;
+		pthread_rwlock_unlock(&p.sh->lock);
+		__stoken_parallel_for(n, KEYRING_FILL_GRAIN, &fill_buckets, &p);
+		filled += p.filled;
+	}
+	return filled;
+}
+
+/*
+ * Throttled pass, on the precompute thread alone so that its CPU time can
+ * be measured.  Returns the number of codes computed, or -1 if the thread
+ * was asked to stop.
+ */
+static int fill_paced(struct stoken_keyring *kr, int depth, int pct,
+		      time_t now, time_t *when,
+		      char (*codes)[STOKEN_MAX_TOKENCODE + 1],
+		      int64_t *cpu_mark)
+{
+	int i, b, filled = 0;
+
+	for (i = 0; i < kr->n_shards; i++) {
+		struct keyring_shard *sh = kr->shards[i];
+
+		for (b = 0; ; b++) {
+			struct keyring_entry *e;
+			int64_t used;
+
+			/* the table may be resized between buckets; anything
+			 * skipped is picked up on the next pass */
+			pthread_rwlock_rdlock(&sh->lock);
+			if (b >= sh->n_buckets) {
+				pthread_rwlock_unlock(&sh->lock);
+				break;
+			}
+			for (e = sh->buckets[b]; e; e = e->next) {
+				int rc = fill_entry(e, depth, now, when, codes);
+
+				if (rc > 0)
+					filled += rc;
+			}
+			pthread_rwlock_unlock(&sh->lock);
+
+			used = thread_cpu_nsec() - *cpu_mark;
+			if (used >= KEYRING_PACE_NSEC) {
+				if (pc_sleep_nsec(kr,
+						  used * (100 - pct) / pct))
+					return -1;
+				*cpu_mark = thread_cpu_nsec();
+			}
+		}
+	}
+	return filled;
+}
+
+static void *precompute_thread(void *arg)
+{
+	struct stoken_keyring *kr = arg;
+	int depth = kr->pc_depth, pct = kr->pc_cpu_percent;
+	time_t *when = malloc(depth * sizeof(*when));
+	char (*codes)[STOKEN_MAX_TOKENCODE + 1] =
+		malloc(depth * sizeof(*codes));
+	int64_t cpu_mark = thread_cpu_nsec();
+
+	if (!when || !codes)
+		goto out;
+
+	while (1) {
+		time_t now = time(NULL);
+		struct timespec tick;
+		int filled;
+
+		if (pct == 100) {
+			filled = fill_parallel(kr, depth, now);
+		} else {
+			filled = fill_paced(kr, depth, pct, now, when, codes,
+					    &cpu_mark);
+			if (filled < 0)
+				goto out;
+		}
+
+		/*
+		 * If anything was filled, go around again in case a slow pass
+		 * straddled a boundary.  Otherwise sleep until the next
+		 * interval starts, or until a token is added.
+		 */
+		if (filled)
+			continue;
+		tick.tv_sec = (now / KEYRING_TICK + 1) * KEYRING_TICK;
+		tick.tv_nsec = 0;
+		if (pc_wait(kr, &tick))
+			goto out;
+	}
+
+out:
+	free(when);
+	free(codes);
+	return NULL;
+}
+
+static void stop_precompute(struct stoken_keyring *kr)
+{
+	pthread_mutex_lock(&kr->pc_lock);
+	if (!kr->pc_running) {
+		pthread_mutex_unlock(&kr->pc_lock);
+		return;
+	}
+	kr->pc_stop = 1;
+	pthread_cond_broadcast(&kr->pc_cond);
+	pthread_mutex_unlock(&kr->pc_lock);
+
+	pthread_join(kr->pc_thread, NULL);
+	kr->pc_running = 0;
+	kr->pc_stop = 0;
+}
+
+/***********************************************************************
+ * Verification
+ ***********************************************************************/
+
+/* caller holds E->lock */
+static void entry_code(struct keyring_entry *e, int64_t n, char *out)
+{
+	if (e->ring_depth && e->ring_n[n % e->ring_depth] == n)
+		memcpy(out, e->ring_code[n % e->ring_depth],
+		       STOKEN_MAX_TOKENCODE + 1);
+	else
+		securid_compute_tokencode(&e->t, n * e->interval, out);
+}
+
+/* don't leak how many leading digits were right */
+static int codes_equal(const char *a, const char *b)
+{
+	unsigned int diff = 0;
+	int i;
+
+	for (i = 0; i <= STOKEN_MAX_TOKENCODE; i++) {
+		diff |= (uint8_t)a[i] ^ (uint8_t)b[i];
+		if (!a[i] || !b[i])
+			break;
+	}
+	return !diff;
+}
+
+/*
+ * Look for CODE within WINDOW intervals of where the token's clock is
+ * expected to be, nearest first.  A match re-centers the drift, and
+ * that interval and everything before it can't be used again.
+ */
+static int verify_entry(struct stoken_keyring *kr, struct keyring_entry *e,
+			time_t when, const char *code, int window)
+{
+	char buf[STOKEN_MAX_TOKENCODE + 1];
+	int64_t n0 = when / e->interval, n;
+	int i, ret;
+
+	if (strlen(code) > STOKEN_MAX_TOKENCODE)
+		return -EACCES;
+	ret = materialize(kr, e);
+	if (ret)
+		return ret;
+	ret = -EACCES;
+
+	pthread_mutex_lock(&e->lock);
+	for (i = 0; i <= 2 * window; i++) {
+		/* drift, drift + 1, drift - 1, drift + 2, ... */
+		n = n0 + e->drift + (i & 1 ? (i + 1) / 2 : -(i / 2));
+		if (n <= e->last_n || n < 0)
+			continue;
+		entry_code(e, n, buf);
+		if (codes_equal(buf, code)) {
+			e->drift = n - n0;
+			e->last_n = n;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	memset(buf, 0, sizeof(buf));
+	return ret;
+}
+
+struct verify_batch {
+	struct stoken_keyring	*kr;
+	struct stoken_verify_req *reqs;
+	int			window;
+	unsigned int		*hash;
+	/* request indices grouped by shard: shard i is idx[start[i]..] */
+	int			*idx;
+	int			*start;
+};
+
+/*
+ * Materialize the batch's pending entries up front, spread across the
+ * executor, rather than one shard at a time in verify_shards().
+ */
+static void materialize_reqs(void *arg, int first, int last)
+{
+	struct verify_batch *vb = arg;
+	int i;
+
+	for (i = first; i < last; i++) {
+		struct keyring_shard *sh = find_shard(vb->kr, vb->hash[i]);
+
+		pthread_rwlock_rdlock(&sh->lock);
+		find_ready(vb->kr, sh, vb->reqs[i].serial, vb->hash[i]);
+		pthread_rwlock_unlock(&sh->lock);
+	}
+}
+
+static void verify_shards(void *arg, int first, int last)
+{
+	struct verify_batch *vb = arg;
+	int i, j;
+
+	for (i = first; i < last; i++) {
+		struct keyring_shard *sh = vb->kr->shards[i];
+
+		if (vb->start[i] == vb->start[i + 1])
+			continue;
+
+		/* one lock round trip per shard, not per request */
+		pthread_rwlock_rdlock(&sh->lock);
+		for (j = vb->start[i]; j < vb->start[i + 1]; j++) {
+			struct stoken_verify_req *r = &vb->reqs[vb->idx[j]];
+			struct keyring_entry *e;
+
+			e = find_ready(vb->kr, sh, r->serial,
+				       vb->hash[vb->idx[j]]);
+			r->result = e ? verify_entry(vb->kr, e, r->when,
+						     r->code, vb->window) :
+				    -ENOENT;
+		}
+		pthread_rwlock_unlock(&sh->lock);
+	}
+}
+
+/***********************************************************************
+ * Exported functions
+ ***********************************************************************/
+
+struct stoken_keyring *stoken_keyring_new_sharded(int n_shards,
+	unsigned int flags)
+{
+	struct stoken_keyring *kr;
+	int cpus[KEYRING_MAX_SHARDS], n_cpus, i;
+
+	if (n_shards < 0 || n_shards > KEYRING_MAX_SHARDS ||
+	    (flags & ~(STOKEN_KEYRING_NUMA | STOKEN_KEYRING_LAZY)))
+		return NULL;
+
+	n_cpus = shard_cpus(cpus, KEYRING_MAX_SHARDS);
+	if (!n_shards)
+		n_shards = n_cpus;
+
+	kr = calloc(1, sizeof(*kr));
+	if (!kr)
+		return NULL;
+	kr->flags = flags;
+	kr->shards = calloc(n_shards, sizeof(*kr->shards));
+	if (!kr->shards) {
+		free(kr);
+		return NULL;
+	}
+	for (i = 0; i < n_shards; i++) {
+		kr->shards[i] = shard_new(kr, cpus[i % n_cpus]);
+		if (!kr->shards[i]) {
+			while (--i >= 0)
+				shard_destroy(kr, kr->shards[i]);
+			free(kr->shards);
+			free(kr);
+			return NULL;
+		}
+	}
+	kr->n_shards = n_shards;
+	pthread_mutex_init(&kr->pc_lock, NULL);
+	pthread_cond_init(&kr->pc_cond, NULL);
+	return kr;
+}
+
+struct stoken_keyring *stoken_keyring_new(void)
+{
+	return stoken_keyring_new_sharded(1, 0);
+}
+
+void stoken_keyring_destroy(struct stoken_keyring *kr)
+{
+	int i;
+
+	if (!kr)
+		return;
+	stop_precompute(kr);
+
+	for (i = 0; i < kr->n_shards; i++)
+		shard_destroy(kr, kr->shards[i]);
+	free(kr->shards);
+	pthread_mutex_destroy(&kr->pc_lock);
+	pthread_cond_destroy(&kr->pc_cond);
+	free(kr);
+}
+
+static int check_pin(const struct securid_token *t, const char *pin)
+{
+	if (!securid_pin_required(t))
+		return 0;
+	if (pin && strlen(pin))
+		return securid_pin_format_ok(pin) == ERR_NONE ? 0 : -EINVAL;
+	return strlen(t->pin) ? 0 : -EINVAL;
+}
+
+/* LAZY is NULL to add a decrypted token */
+static int insert_entry(struct stoken_keyring *kr,
+			const struct securid_token *t, const char *pin,
+			struct keyring_lazy *lazy, struct sdtid_doc *doc,
+			int which)
+{
+	struct keyring_shard *sh;
+	struct keyring_entry *e;
+	unsigned int h;
+
+	h = serial_hash(t->serial);
+	sh = find_shard(kr, h);
+	pthread_rwlock_wrlock(&sh->lock);
+	if (find_entry(sh, t->serial, h)) {
+		pthread_rwlock_unlock(&sh->lock);
+		return -EEXIST;
+	}
+	e = alloc_entry(kr, sh);
+	if (!e) {
+		pthread_rwlock_unlock(&sh->lock);
+		return -EIO;
+	}
+
+	if (lazy) {
+		e->t = *t;
+		e->t.sdtid = NULL;
+		e->t.v3 = NULL;
+		e->t.enc_pin_str = NULL;
+		e->t.key_cache = NULL;
+		e->state = KE_PENDING;
+		e->lazy = lazy;
+		__atomic_add_fetch(&lazy->refs, 1, __ATOMIC_RELAXED);
+		e->doc = doc ? sdtid_doc_get(doc) : NULL;
+		e->which = which;
+		__atomic_add_fetch(&kr->n_pending, 1, __ATOMIC_RELAXED);
+	} else {
+		entry_set_token(e, t, pin);
+	}
+	e->interval = securid_token_interval(t);
+	e->last_n = -1;
+	e->refs = 1;
+	pthread_mutex_init(&e->lock, NULL);
+
+	if (sh->n_tokens >= sh->n_buckets)
+		grow_table(kr, sh);
+	h &= sh->n_buckets - 1;
+	e->next = sh->buckets[h];
+	sh->buckets[h] = e;
+	sh->n_tokens++;
+	pthread_rwlock_unlock(&sh->lock);
+
+	if (lazy)
+		return 0;
+
+	/* get the new token's ring filled without waiting for the next tick */
+	pthread_mutex_lock(&kr->pc_lock);
+	kr->pc_kick = 1;
+	pthread_cond_broadcast(&kr->pc_cond);
+	pthread_mutex_unlock(&kr->pc_lock);
+
+	return 0;
+}
+
+int __stoken_keyring_add(struct stoken_keyring *kr,
+			 const struct securid_token *t, const char *pin)
+{
+	if (!t->has_dec_seed || check_pin(t, pin))
+		return -EINVAL;
+	return insert_entry(kr, t, pin, NULL, NULL, 0);
+}
+
+int __stoken_keyring_add_lazy(struct stoken_keyring *kr,
+			      const struct securid_token *t,
+			      struct keyring_lazy *lazy,
+			      struct sdtid_doc *doc, int which)
+{
+	if (check_pin(t, lazy->pin))
+		return -EINVAL;
+	return insert_entry(kr, t, NULL, lazy, doc, which);
+}
+
+int stoken_keyring_remove(struct stoken_keyring *kr, const char *serial)
+{
+	unsigned int h = serial_hash(serial);
+	struct keyring_shard *sh = find_shard(kr, h);
+	struct keyring_entry **pe, *e;
+
+	pthread_rwlock_wrlock(&sh->lock);
+	pe = &sh->buckets[h & (sh->n_buckets - 1)];
+	for (; (e = *pe) != NULL; pe = &e->next) {
+		if (!strcmp(e->t.serial, serial)) {
+			*pe = e->next;
+			sh->n_tokens--;
+			/* a pinned entry is freed by its last user */
+			if (!__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL))
+				free_entry(kr, sh, e);
+			pthread_rwlock_unlock(&sh->lock);
+			return 0;
+		}
+	}
+	pthread_rwlock_unlock(&sh->lock);
+	return -ENOENT;
+}
+
+int stoken_keyring_compute_tokencode(struct stoken_keyring *kr,
+	const char *serial, time_t when, char *out)
+{
+	unsigned int h = serial_hash(serial);
+	struct keyring_shard *sh = find_shard(kr, h);
+	struct keyring_entry *e;
+	int hit = 0;
+
+	pthread_rwlock_rdlock(&sh->lock);
+	e = find_ready(kr, sh, serial, h);
+	if (!e) {
+		pthread_rwlock_unlock(&sh->lock);
+		return -ENOENT;
+	}
+	if (materialize(kr, e)) {
+		pthread_rwlock_unlock(&sh->lock);
+		return -EPERM;
+	}
+
+	if (when >= 0) {
+		int64_t n = when / e->interval;
+
+		pthread_mutex_lock(&e->lock);
+		if (e->ring_depth && e->ring_n[n % e->ring_depth] == n) {
+			memcpy(out, e->ring_code[n % e->ring_depth],
+			       STOKEN_MAX_TOKENCODE + 1);
+			hit = 1;
+		}
+		pthread_mutex_unlock(&e->lock);
+	}
+	if (!hit)
+		securid_compute_tokencode(&e->t, when, out);
+
+	pthread_rwlock_unlock(&sh->lock);
+	return 0;
+}
+
+int stoken_keyring_verify(struct stoken_keyring *kr, const char *serial,
+	time_t when, const char *code, int window)
+{
+	unsigned int h = serial_hash(serial);
+	struct keyring_shard *sh = find_shard(kr, h);
+	struct keyring_entry *e;
+	int ret;
+
+	if (window < 0 || window > KEYRING_MAX_WINDOW || when < 0)
+		return -EINVAL;
+
+	pthread_rwlock_rdlock(&sh->lock);
+	e = find_ready(kr, sh, serial, h);
+	ret = e ? verify_entry(kr, e, when, code, window) : -ENOENT;
+	pthread_rwlock_unlock(&sh->lock);
+	return ret;
+}
+
+int stoken_keyring_verify_batch(struct stoken_keyring *kr,
+	struct stoken_verify_req *reqs, int n, int window)
+{
+	struct verify_batch vb = { kr, reqs, window };
+	int i, ret = -EIO, *shard_of;
+
+	if (window < 0 || window > KEYRING_MAX_WINDOW || n < 0)
+		return -EINVAL;
+	for (i = 0; i < n; i++)
+		if (reqs[i].when < 0)
+			return -EINVAL;
+
+	vb.hash = malloc(n * sizeof(*vb.hash));
+	vb.idx = malloc(n * sizeof(*vb.idx));
+	vb.start = calloc(kr->n_shards + 1, sizeof(*vb.start));
+	shard_of = malloc(n * sizeof(*shard_of));
+	if ((n && (!vb.hash || !vb.idx || !shard_of)) || !vb.start)
+		goto out;
+
+	/* counting sort by shard */
+	for (i = 0; i < n; i++) {
+		vb.hash[i] = serial_hash(reqs[i].serial);
+		shard_of[i] = ((uint64_t)vb.hash[i] * kr->n_shards) >> 32;
+		vb.start[shard_of[i] + 1]++;
+	}
+	for (i = 1; i <= kr->n_shards; i++)
+		vb.start[i] += vb.start[i - 1];
+	for (i = 0; i < n; i++)
+		vb.idx[vb.start[shard_of[i]]++] = i;
+	/* the placement loop advanced each start to the next shard's */
+	memmove(&vb.start[1], &vb.start[0], kr->n_shards * sizeof(int));
+	vb.start[0] = 0;
+
+	if (__atomic_load_n(&kr->n_pending, __ATOMIC_RELAXED))
+		__stoken_parallel_for(n, 1, &materialize_reqs, &vb);
+	__stoken_parallel_for(kr->n_shards, 1, &verify_shards, &vb);
+	ret = 0;
+
+out:
+	free(vb.hash);
+	free(vb.idx);
+	free(vb.start);
+	free(shard_of);
+	return ret;
+}
+
+int stoken_keyring_precompute(struct stoken_keyring *kr, int intervals,
+	int cpu_percent)
+{
+	if (intervals < 0 || intervals > KEYRING_MAX_DEPTH ||
+	    cpu_percent < 1 || cpu_percent > 100)
+		return -EINVAL;
+
+	stop_precompute(kr);
+	if (!intervals)
+		return 0;
+
+	kr->pc_depth = intervals;
+	kr->pc_cpu_percent = cpu_percent;
+	kr->pc_kick = 0;
+	if (pthread_create(&kr->pc_thread, NULL, &precompute_thread, kr))
+		return -EIO;
+	kr->pc_running = 1;
+	return 0;
+}
+
+struct stoken_keyring_stats *stoken_keyring_get_stats(struct stoken_keyring *kr)
+{
+	struct stoken_keyring_stats *st = calloc(1, sizeof(*st));
+	int i, j;
+
+	if (!st)
+		return NULL;
+
+	st->token_bytes = sizeof(struct keyring_entry);
+	st->table_bytes = sizeof(*kr) + kr->n_shards * sizeof(*kr->shards);
+
+	for (i = 0; i < kr->n_shards; i++) {
+		struct keyring_shard *sh = kr->shards[i];
+
+		pthread_rwlock_rdlock(&sh->lock);
+		st->n_tokens += sh->n_tokens;
+		st->slot_bytes += sh->n_slabs * SLAB_SIZE;
+		st->locked_bytes += sh->locked_bytes;
+		st->table_bytes += sizeof(*sh) +
+				   sh->n_buckets * sizeof(*sh->buckets);
+
+		for (j = 0; j < sh->n_buckets; j++) {
+			struct keyring_entry *e;
+
+			for (e = sh->buckets[j]; e; e = e->next) {
+				pthread_mutex_lock(&e->lock);
+				if (e->state == KE_PENDING)
+					st->n_pending++;
+				st->ring_bytes += e->ring_depth *
+					(sizeof(*e->ring_n) +
+					 sizeof(*e->ring_code));
+				pthread_mutex_unlock(&e->lock);
+			}
+		}
+		pthread_rwlock_unlock(&sh->lock);
+	}
+	return st;
+}
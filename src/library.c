@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -34,6 +35,8 @@
 struct stoken_ctx {
 	struct securid_token	*t;
 	struct stoken_cfg	cfg;
+	/* t lives in its own mmap()ed page; see stoken_finalize() */
+	int			t_mapped;
 };
 
 static struct stoken_guid stoken_guid_list[] = {
@@ -56,15 +59,15 @@ static int strstarts(const char *str, const char *prefix)
 	return strncmp(str, prefix, strlen(prefix)) == 0;
 }
 
-int __stoken_parse_and_decode_token(const char *str, struct securid_token *t,
-				    int interactive)
+/*
+ * Find the ctf string in STR (which may be wrapped in a URL) and copy it
+ * into BUF.  Returns ERR_NONE, ERR_GENERAL if STR doesn't look like a token,
+ * or ERR_BAD_LEN.  sdtid documents are left to the caller.
+ */
+static int extract_token(const char *str, char *buf)
 {
-	char buf[BUFLEN];
 	const char *p;
-	int i, ret;
-
-	memset(t, 0, sizeof(*t));
-	t->interactive = interactive;
+	int i;
 
 	do {
 		/* try to handle broken quoted-printable input */
@@ -81,11 +84,6 @@ int __stoken_parse_and_decode_token(const char *str, struct securid_token *t,
 			break;
 		}
 
-		/* sdtid (XML) token format */
-		p = strcasestr(str, "<?xml ");
-		if (p)
-			return sdtid_decode(p, t);
-
 		p = str;
 		if (isdigit(*p))
 			break;
@@ -113,15 +111,89 @@ int __stoken_parse_and_decode_token(const char *str, struct securid_token *t,
 		return ERR_GENERAL;
 
 	buf[i] = 0;
+	return ERR_NONE;
+}
+
+static int is_smartphone_url(const char *str)
+{
+	return strstarts(str, "com.rsa.securid.iphone://ctf") ||
+	       strstarts(str, "com.rsa.securid://ctf") ||
+	       strstarts(str, "http://127.0.0.1/securid/ctf");
+}
+
+int __stoken_parse_and_decode_token(const char *str, struct securid_token *t,
+				    int interactive)
+{
+	char buf[BUFLEN];
+	const char *p;
+	int ret;
+
+	memset(t, 0, sizeof(*t));
+	t->interactive = interactive;
+
+	/* sdtid (XML) token format */
+	if (!strcasestr(str, "ctfData=")) {
+		p = strcasestr(str, "<?xml ");
+		if (p)
+			return sdtid_decode(p, t);
+	}
+
+	ret = extract_token(str, buf);
+	if (ret != ERR_NONE)
+		return ret;
 	ret = securid_decode_token(buf, t);
 
-	if (strstarts(str, "com.rsa.securid.iphone://ctf") ||
-	    strstarts(str, "com.rsa.securid://ctf") ||
-	    strstarts(str, "http://127.0.0.1/securid/ctf"))
+	if (is_smartphone_url(str))
 		t->is_smartphone = 1;
 	return ret;
 }
 
+void __stoken_parse_and_decode_tokens(const char *const *str, int n,
+				      struct securid_token *t, int *rc)
+{
+	char (*buf)[BUFLEN];
+	const char *in[MAC_LANES];
+	int idx[MAC_LANES], res[MAC_LANES], base, i, m;
+	struct securid_token tmp[MAC_LANES];
+
+	buf = malloc(MAC_LANES * sizeof(*buf));
+	if (!buf) {
+		for (i = 0; i < n; i++)
+			rc[i] = __stoken_parse_and_decode_token(str[i], &t[i],
+								0);
+		return;
+	}
+
+	for (base = 0; base < n; base += MAC_LANES) {
+		int lanes = n - base < MAC_LANES ? n - base : MAC_LANES;
+
+		for (i = base, m = 0; i < base + lanes; i++) {
+			memset(&t[i], 0, sizeof(t[i]));
+			if (strcasestr(str[i], "<?xml ") &&
+			    !strcasestr(str[i], "ctfData=")) {
+				rc[i] = __stoken_parse_and_decode_token(str[i],
+								&t[i], 0);
+				continue;
+			}
+			rc[i] = extract_token(str[i], buf[m]);
+			if (rc[i] != ERR_NONE)
+				continue;
+			in[m] = buf[m];
+			idx[m++] = i;
+		}
+
+		memset(tmp, 0, m * sizeof(tmp[0]));
+		securid_decode_tokens(in, m, tmp, res);
+		for (i = 0; i < m; i++) {
+			t[idx[i]] = tmp[i];
+			t[idx[i]].is_smartphone = is_smartphone_url(str[idx[i]]);
+			rc[idx[i]] = res[i];
+		}
+	}
+	memset(buf, 0, MAC_LANES * sizeof(*buf));
+	free(buf);
+}
+
 static int next_token(char **in, char *tok, int maxlen)
 {
 	int len;
@@ -282,12 +354,16 @@ int __stoken_write_rcfile(const char *override, const struct stoken_cfg *cfg,
 
 static void zap_current_token(struct stoken_ctx *ctx)
 {
-	if (ctx->t) {
+	if (ctx->t && ctx->t_mapped) {
+		memset(ctx->t, 0, sizeof(*ctx->t));
+		munmap(ctx->t, sizeof(*ctx->t));
+	} else if (ctx->t) {
 		free(ctx->t->v3);
 		sdtid_free(ctx->t->sdtid);
 		free(ctx->t);
 	}
 	ctx->t = NULL;
+	ctx->t_mapped = 0;
 }
 
 static int clone_token(struct stoken_ctx *ctx, struct securid_token *tmp)
@@ -423,6 +499,17 @@ int stoken_check_devid(struct stoken_ctx *ctx, const char *devid)
 	return -EINVAL;
 }
 
+int stoken_find_devid(struct stoken_ctx *ctx, const char * const *candidates,
+	int n)
+{
+	int ret;
+
+	if (!securid_devid_required(ctx->t))
+		return -EINVAL;
+	ret = securid_find_devid(ctx->t, candidates, n);
+	return ret < 0 ? -ENOENT : ret;
+}
+
 int stoken_decrypt_seed(struct stoken_ctx *ctx, const char *pass,
 	const char *devid)
 {
@@ -437,6 +524,87 @@ int stoken_decrypt_seed(struct stoken_ctx *ctx, const char *pass,
 	return 0;
 }
 
+int stoken_finalize(struct stoken_ctx *ctx)
+{
+	struct securid_token *t;
+
+	if (!ctx->t || !ctx->t->has_dec_seed)
+		return -EINVAL;
+	if (ctx->t_mapped)
+		return 0;
+
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED)
+		return -EIO;
+	securid_lock_pages(t, sizeof(*t));
+
+	/* the PIN was decrypted along with the seed */
+	ctx->t->enc_pin_str = NULL;
+	securid_finalize_token(ctx->t);
+	__stoken_zap_rcfile_data(&ctx->cfg);
+
+	memcpy(t, ctx->t, sizeof(*t));
+	memset(ctx->t, 0, sizeof(*ctx->t));
+	free(ctx->t);
+	ctx->t = t;
+	ctx->t_mapped = 1;
+	return 0;
+}
+
+struct decrypt_job {
+	struct stoken_ctx	*ctx;
+	char			*pass;
+	char			*devid;
+};
+
+static int decrypt_job_run(void *arg)
+{
+	struct decrypt_job *j = arg;
+
+	return stoken_decrypt_seed(j->ctx, j->pass, j->devid);
+}
+
+static void zap_string(char *s)
+{
+	if (s) {
+		memset(s, 0, strlen(s));
+		free(s);
+	}
+}
+
+static void decrypt_job_free(void *arg)
+{
+	struct decrypt_job *j = arg;
+
+	zap_string(j->pass);
+	zap_string(j->devid);
+	free(j);
+}
+
+struct stoken_job *stoken_decrypt_seed_async(struct stoken_ctx *ctx,
+	const char *pass, const char *devid)
+{
+	struct decrypt_job *j;
+	struct stoken_job *job;
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return NULL;
+	j->ctx = ctx;
+	if ((pass && !(j->pass = strdup(pass))) ||
+	    (devid && !(j->devid = strdup(devid))))
+		goto err;
+
+	job = __stoken_job_submit(&decrypt_job_run, &decrypt_job_free, j);
+	if (job)
+		return job;
+
+err:
+	decrypt_job_free(j);
+	return NULL;
+}
+
 char *stoken_encrypt_seed(struct stoken_ctx *ctx, const char *pass,
 	const char *devid)
 {
@@ -471,6 +639,24 @@ int stoken_compute_tokencode(struct stoken_ctx *ctx, time_t when,
 	return 0;
 }
 
+int stoken_keyring_add(struct stoken_keyring *kr, struct stoken_ctx *ctx,
+	const char *pin)
+{
+	return __stoken_keyring_add(kr, ctx->t, pin);
+}
+
+int stoken_shm_publish(struct stoken_shm *shm, struct stoken_ctx *ctx,
+	time_t when)
+{
+	return __stoken_shm_publish(shm, ctx->t, when);
+}
+
+struct stoken_subscription *stoken_subscribe(struct stoken_ctx *ctx,
+	const char *pin)
+{
+	return __stoken_subscribe(ctx->t, pin);
+}
+
 char *stoken_format_tokencode(const char *tokencode)
 {
 	int code_len = strlen(tokencode);
@@ -0,0 +1,691 @@
+/*
+ * qr.c - QR code encoder for token export
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qr.h"
+#include "stoken-internal.h"
+
+/*
+ * This only implements what token export needs: byte mode, ECC level H
+ * (the same "-l H" we used to pass to qrencode), automatic version and mask
+ * selection.  See ISO/IEC 18004 for the gory details.
+ */
+
+#define MIN_VERSION		1
+#define MAX_VERSION		40
+
+/* format bits for ECC level H */
+#define ECL_H_BITS		0x02
+
+/* indexed by version; level H only */
+static const uint8_t ecc_per_block[MAX_VERSION + 1] = {
+	0,
+	17, 28, 22, 16, 22, 28, 26, 26, 24, 28,
+	24, 28, 22, 24, 24, 30, 28, 28, 26, 28,
+	30, 24, 30, 30, 30, 30, 30, 30, 30, 30,
+	30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+};
+
+static const uint8_t ecc_blocks[MAX_VERSION + 1] = {
+	0,
+	 1,  1,  2,  4,  4,  4,  5,  6,  8,  8,
+	11, 11, 16, 16, 18, 16, 19, 21, 25, 25,
+	25, 34, 30, 32, 35, 37, 40, 42, 45, 48,
+	51, 54, 57, 60, 63, 66, 70, 74, 77, 81,
+};
+
+struct qr_work {
+	int			size;
+	uint8_t			*modules;
+	uint8_t			*is_func;
+};
+
+/************************************************************************
+ * Sizing
+ ************************************************************************/
+
+static int raw_data_modules(int ver)
+{
+	int ret = (16 * ver + 128) * ver + 64;
+
+	if (ver >= 2) {
+		int n_align = ver / 7 + 2;
+		ret -= (25 * n_align - 10) * n_align - 55;
+		if (ver >= 7)
+			ret -= 36;
+	}
+	return ret;
+}
+
+static int data_codewords(int ver)
+{
+	return raw_data_modules(ver) / 8 - ecc_per_block[ver] * ecc_blocks[ver];
+}
+
+static int alignment_positions(int ver, int *out)
+{
+	int i, n, step, pos;
+
+	if (ver == 1)
+		return 0;
+
+	n = ver / 7 + 2;
+	step = ver == 32 ? 26 : (ver * 4 + n * 2 + 1) / (n * 2 - 2) * 2;
+
+	out[0] = 6;
+	for (i = n - 1, pos = ver * 4 + 10; i >= 1; i--, pos -= step)
+		out[i] = pos;
+	return n;
+}
+
+/************************************************************************
+ * Reed-Solomon over GF(2^8) / 0x11d
+ ************************************************************************/
+
+static uint8_t gf_mul(uint8_t x, uint8_t y)
+{
+	int i, z = 0;
+
+	for (i = 7; i >= 0; i--) {
+		z = (z << 1) ^ ((z >> 7) * 0x11d);
+		z ^= ((y >> i) & 1) * x;
+	}
+	return z;
+}
+
+static void rs_divisor(int degree, uint8_t *out)
+{
+	int i, j;
+	uint8_t root = 1;
+
+	memset(out, 0, degree);
+	out[degree - 1] = 1;
+
+	for (i = 0; i < degree; i++) {
+		for (j = 0; j < degree; j++) {
+			out[j] = gf_mul(out[j], root);
+			if (j + 1 < degree)
+				out[j] ^= out[j + 1];
+		}
+		root = gf_mul(root, 0x02);
+	}
+}
+
+static void rs_remainder(const uint8_t *data, int len, const uint8_t *div,
+			 int degree, uint8_t *out)
+{
+	int i, j;
+
+	memset(out, 0, degree);
+	for (i = 0; i < len; i++) {
+		uint8_t factor = data[i] ^ out[0];
+
+		memmove(out, out + 1, degree - 1);
+		out[degree - 1] = 0;
+		for (j = 0; j < degree; j++)
+			out[j] ^= gf_mul(div[j], factor);
+	}
+}
+
+/************************************************************************
+ * Codeword generation
+ ************************************************************************/
+
+static void put_bits(uint8_t *buf, int *bitpos, uint32_t val, int n_bits)
+{
+	for (n_bits--; n_bits >= 0; n_bits--, (*bitpos)++)
+		if ((val >> n_bits) & 1)
+			buf[*bitpos >> 3] |= 0x80 >> (*bitpos & 7);
+}
+
+/* returns the interleaved data + ECC codewords; caller frees */
+static uint8_t *make_codewords(const char *str, int len, int ver)
+{
+	int n_data = data_codewords(ver), n_raw = raw_data_modules(ver) / 8;
+	int n_blocks = ecc_blocks[ver], ecc_len = ecc_per_block[ver];
+	int n_short = n_blocks - n_raw % n_blocks;
+	int short_len = n_raw / n_blocks;
+	int i, j, k, bitpos = 0;
+	uint8_t *data, *out, *ecc, div[30];
+
+	data = calloc(1, n_data);
+	out = calloc(1, n_raw);
+	ecc = calloc(n_blocks, ecc_len);
+	if (!data || !out || !ecc) {
+		free(data);
+		free(out);
+		free(ecc);
+		return NULL;
+	}
+
+	/* mode indicator, character count, payload, terminator */
+	put_bits(data, &bitpos, 0x4, 4);
+	put_bits(data, &bitpos, len, ver < 10 ? 8 : 16);
+	for (i = 0; i < len; i++)
+		put_bits(data, &bitpos, (uint8_t)str[i], 8);
+	bitpos += n_data * 8 - bitpos < 4 ? n_data * 8 - bitpos : 4;
+
+	/* pad to a byte boundary, then alternate 0xec / 0x11 */
+	for (i = (bitpos + 7) / 8, k = 0; i < n_data; i++, k ^= 1)
+		data[i] = k ? 0x11 : 0xec;
+
+	rs_divisor(ecc_len, div);
+	for (i = 0, k = 0; i < n_blocks; i++) {
+		int dlen = short_len - ecc_len + (i >= n_short);
+		rs_remainder(&data[k], dlen, div, ecc_len, &ecc[i * ecc_len]);
+		k += dlen;
+	}
+
+	/* interleave: data columns first (short blocks end early), then ECC */
+	k = 0;
+	for (j = 0; j <= short_len - ecc_len; j++) {
+		int ofs = 0;
+		for (i = 0; i < n_blocks; i++) {
+			int dlen = short_len - ecc_len + (i >= n_short);
+			if (j < dlen)
+				out[k++] = data[ofs + j];
+			ofs += dlen;
+		}
+	}
+	for (j = 0; j < ecc_len; j++)
+		for (i = 0; i < n_blocks; i++)
+			out[k++] = ecc[i * ecc_len + j];
+
+	free(data);
+	free(ecc);
+	return out;
+}
+
+/************************************************************************
+ * Module placement
+ ************************************************************************/
+
+static void set_func(struct qr_work *w, int x, int y, int dark)
+{
+	w->modules[y * w->size + x] = dark;
+	w->is_func[y * w->size + x] = 1;
+}
+
+static void draw_finder(struct qr_work *w, int cx, int cy)
+{
+	int dx, dy;
+
+	for (dy = -4; dy <= 4; dy++) {
+		for (dx = -4; dx <= 4; dx++) {
+			int x = cx + dx, y = cy + dy;
+			int dist = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+
+			if (x >= 0 && x < w->size && y >= 0 && y < w->size)
+				set_func(w, x, y, dist != 2 && dist != 4);
+		}
+	}
+}
+
+static void draw_alignment(struct qr_work *w, int cx, int cy)
+{
+	int dx, dy;
+
+	for (dy = -2; dy <= 2; dy++)
+		for (dx = -2; dx <= 2; dx++)
+			set_func(w, cx + dx, cy + dy,
+				 (abs(dx) > abs(dy) ? abs(dx) : abs(dy)) != 1);
+}
+
+static void draw_format(struct qr_work *w, int mask)
+{
+	int i, data = (ECL_H_BITS << 3) | mask, rem = data, bits;
+	const int sz = w->size;
+
+	for (i = 0; i < 10; i++)
+		rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+	bits = ((data << 10) | rem) ^ 0x5412;
+
+#define FBIT(i) (((bits) >> (i)) & 1)
+	/* first copy, around the top left finder */
+	for (i = 0; i <= 5; i++)
+		set_func(w, 8, i, FBIT(i));
+	set_func(w, 8, 7, FBIT(6));
+	set_func(w, 8, 8, FBIT(7));
+	set_func(w, 7, 8, FBIT(8));
+	for (i = 9; i < 15; i++)
+		set_func(w, 14 - i, 8, FBIT(i));
+
+	/* second copy, split between the other two finders */
+	for (i = 0; i < 8; i++)
+		set_func(w, sz - 1 - i, 8, FBIT(i));
+	for (i = 8; i < 15; i++)
+		set_func(w, 8, sz - 15 + i, FBIT(i));
+#undef FBIT
+
+	/* the "dark module" */
+	set_func(w, 8, sz - 8, 1);
+}
+
+static void draw_version(struct qr_work *w, int ver)
+{
+	int i, rem = ver, bits;
+
+	if (ver < 7)
+		return;
+
+	for (i = 0; i < 12; i++)
+		rem = (rem << 1) ^ ((rem >> 11) * 0x1f25);
+	bits = (ver << 12) | rem;
+
+	for (i = 0; i < 18; i++) {
+		int bit = (bits >> i) & 1;
+		int a = w->size - 11 + i % 3, b = i / 3;
+
+		set_func(w, a, b, bit);
+		set_func(w, b, a, bit);
+	}
+}
+
+static void draw_function_patterns(struct qr_work *w, int ver)
+{
+	int i, j, n, pos[7];
+	const int sz = w->size;
+
+	for (i = 0; i < sz; i++) {
+		set_func(w, 6, i, i % 2 == 0);
+		set_func(w, i, 6, i % 2 == 0);
+	}
+
+	draw_finder(w, 3, 3);
+	draw_finder(w, sz - 4, 3);
+	draw_finder(w, 3, sz - 4);
+
+	n = alignment_positions(ver, pos);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			/* skip the three finder corners */
+			if ((i == 0 && j == 0) || (i == 0 && j == n - 1) ||
+			    (i == n - 1 && j == 0))
+				continue;
+			draw_alignment(w, pos[i], pos[j]);
+		}
+	}
+
+	/* reserve the format areas; real values are drawn per mask */
+	draw_format(w, 0);
+	draw_version(w, ver);
+}
+
+static void draw_codewords(struct qr_work *w, const uint8_t *cw, int n_cw)
+{
+	int right, vert, j, i = 0;
+	const int sz = w->size;
+
+	/* two-module wide columns, zigzagging up and down from the right */
+	for (right = sz - 1; right >= 1; right -= 2) {
+		if (right == 6)
+			right = 5;
+		for (vert = 0; vert < sz; vert++) {
+			for (j = 0; j < 2; j++) {
+				int x = right - j;
+				int up = ((right + 1) & 2) == 0;
+				int y = up ? sz - 1 - vert : vert;
+
+				if (w->is_func[y * sz + x] || i >= n_cw * 8)
+					continue;
+				w->modules[y * sz + x] =
+					(cw[i >> 3] >> (7 - (i & 7))) & 1;
+				i++;
+			}
+		}
+	}
+}
+
+static int mask_bit(int mask, int x, int y)
+{
+	switch (mask) {
+	case 0: return (x + y) % 2 == 0;
+	case 1: return y % 2 == 0;
+	case 2: return x % 3 == 0;
+	case 3: return (x + y) % 3 == 0;
+	case 4: return (x / 3 + y / 2) % 2 == 0;
+	case 5: return x * y % 2 + x * y % 3 == 0;
+	case 6: return (x * y % 2 + x * y % 3) % 2 == 0;
+	default: return ((x + y) % 2 + x * y % 3) % 2 == 0;
+	}
+}
+
+/* XOR is its own inverse, so this both applies and removes MASK */
+static void apply_mask(struct qr_work *w, int mask)
+{
+	int x, y;
+	const int sz = w->size;
+
+	for (y = 0; y < sz; y++)
+		for (x = 0; x < sz; x++)
+			if (!w->is_func[y * sz + x])
+				w->modules[y * sz + x] ^= mask_bit(mask, x, y);
+}
+
+/************************************************************************
+ * Mask selection
+ ************************************************************************/
+
+static int get_mod(const struct qr_work *w, int x, int y, int transpose)
+{
+	return transpose ? w->modules[x * w->size + y] :
+			   w->modules[y * w->size + x];
+}
+
+static int is_finder_like(const struct qr_work *w, int x, int y,
+			  int transpose)
+{
+	static const uint8_t pat[] = { 1, 0, 1, 1, 1, 0, 1 };
+	int i, before = 1, after = 1;
+
+	for (i = 0; i < 7; i++)
+		if (get_mod(w, x + i, y, transpose) != pat[i])
+			return 0;
+
+	/* four light modules (or the edge of the symbol) on either side */
+	for (i = 1; i <= 4; i++) {
+		if (x - i >= 0 && get_mod(w, x - i, y, transpose))
+			before = 0;
+		if (x + 6 + i < w->size && get_mod(w, x + 6 + i, y, transpose))
+			after = 0;
+	}
+	return before || after;
+}
+
+static long penalty(const struct qr_work *w)
+{
+	long ret = 0, dark = 0, total;
+	int x, y, t;
+	const int sz = w->size;
+
+	/* N1: runs of 5+ identical modules, in rows and in columns */
+	for (t = 0; t < 2; t++) {
+		for (y = 0; y < sz; y++) {
+			int run = 0, color = -1;
+
+			for (x = 0; x < sz; x++) {
+				int c = get_mod(w, x, y, t);
+
+				if (c == color) {
+					run++;
+					if (run == 5)
+						ret += 3;
+					else if (run > 5)
+						ret++;
+				} else {
+					color = c;
+					run = 1;
+				}
+			}
+		}
+	}
+
+	/* N2: 2x2 blocks of one color */
+	for (y = 0; y < sz - 1; y++) {
+		for (x = 0; x < sz - 1; x++) {
+			int c = get_mod(w, x, y, 0);
+
+			if (c == get_mod(w, x + 1, y, 0) &&
+			    c == get_mod(w, x, y + 1, 0) &&
+			    c == get_mod(w, x + 1, y + 1, 0))
+				ret += 3;
+		}
+	}
+
+	/* N3: 1:1:3:1:1 patterns that could be mistaken for a finder */
+	for (t = 0; t < 2; t++)
+		for (y = 0; y < sz; y++)
+			for (x = 0; x <= sz - 7; x++)
+				if (is_finder_like(w, x, y, t))
+					ret += 40;
+
+	/* N4: dark/light balance, 10 points per 5% deviation from 50% */
+	for (x = 0; x < sz * sz; x++)
+		dark += w->modules[x];
+	total = (long)sz * sz;
+	ret += ((labs(dark * 20 - total * 10) + total - 1) / total - 1) * 10;
+
+	return ret;
+}
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+int qr_encode(const char *str, struct qr_code *qr)
+{
+	struct qr_work w;
+	int ver, mask, best_mask = 0, len = strlen(str);
+	long best = -1;
+	uint8_t *cw;
+
+	memset(qr, 0, sizeof(*qr));
+
+	for (ver = MIN_VERSION; ; ver++) {
+		if (ver > MAX_VERSION)
+			return ERR_BAD_LEN;
+		if (4 + (ver < 10 ? 8 : 16) + len * 8 <= data_codewords(ver) * 8)
+			break;
+	}
+
+	w.size = ver * 4 + 17;
+	w.modules = calloc(w.size, w.size);
+	w.is_func = calloc(w.size, w.size);
+	cw = make_codewords(str, len, ver);
+	if (!w.modules || !w.is_func || !cw) {
+		free(w.modules);
+		free(w.is_func);
+		free(cw);
+		return ERR_NO_MEMORY;
+	}
+
+	draw_function_patterns(&w, ver);
+	draw_codewords(&w, cw, raw_data_modules(ver) / 8);
+	free(cw);
+
+	for (mask = 0; mask < 8; mask++) {
+		long score;
+
+		apply_mask(&w, mask);
+		draw_format(&w, mask);
+		score = penalty(&w);
+		if (best < 0 || score < best) {
+			best = score;
+			best_mask = mask;
+		}
+		apply_mask(&w, mask);
+	}
+	apply_mask(&w, best_mask);
+	draw_format(&w, best_mask);
+
+	free(w.is_func);
+	qr->version = ver;
+	qr->size = w.size;
+	qr->modules = w.modules;
+	return ERR_NONE;
+}
+
+void qr_free(struct qr_code *qr)
+{
+	free(qr->modules);
+	memset(qr, 0, sizeof(*qr));
+}
+
+/************************************************************************
+ * Output
+ ************************************************************************/
+
+static int qr_dark(const struct qr_code *qr, int x, int y)
+{
+	x -= QR_QUIET_ZONE;
+	y -= QR_QUIET_ZONE;
+	if (x < 0 || y < 0 || x >= qr->size || y >= qr->size)
+		return 0;
+	return qr->modules[y * qr->size + x];
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	static uint32_t table[256];
+	size_t i;
+
+	if (!table[1]) {
+		uint32_t c;
+		int n, k;
+
+		for (n = 0; n < 256; n++) {
+			for (c = n, k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	}
+
+	crc ^= 0xffffffff;
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+static void put_be32(uint8_t *out, uint32_t val)
+{
+	out[0] = val >> 24;
+	out[1] = val >> 16;
+	out[2] = val >> 8;
+	out[3] = val;
+}
+
+static int png_chunk(FILE *f, const char *type, const uint8_t *data,
+		     size_t len)
+{
+	uint8_t hdr[8], crc[4];
+	uint32_t c;
+
+	put_be32(hdr, len);
+	memcpy(&hdr[4], type, 4);
+	c = crc32_update(0, &hdr[4], 4);
+	c = crc32_update(c, data, len);
+	put_be32(crc, c);
+
+	return fwrite(hdr, 8, 1, f) != 1 ||
+	       (len && fwrite(data, len, 1, f) != 1) ||
+	       fwrite(crc, 4, 1, f) != 1;
+}
+
+/*
+ * 1-bit grayscale PNG.  The image data goes into "stored" (uncompressed)
+ * deflate blocks so that we don't need zlib just for this.
+ */
+int qr_write_png(const struct qr_code *qr, FILE *f, int scale)
+{
+	static const uint8_t sig[] = { 0x89, 'P', 'N', 'G', '\r', '\n',
+				       0x1a, '\n' };
+	int dim = (qr->size + 2 * QR_QUIET_ZONE) * scale;
+	int row_len = 1 + (dim + 7) / 8, x, y;
+	size_t raw_len = (size_t)row_len * dim, n_blk, i, pos;
+	uint8_t ihdr[13], *raw, *z;
+	uint32_t a = 1, b = 0;
+	int ret = ERR_GENERAL;
+
+	raw = calloc(1, raw_len);
+	n_blk = (raw_len + 65534) / 65535;
+	z = malloc(2 + raw_len + n_blk * 5 + 4);
+	if (!raw || !z) {
+		free(raw);
+		free(z);
+		return ERR_NO_MEMORY;
+	}
+
+	/* filter type 0 at the start of each row; bit set = white */
+	for (y = 0; y < dim; y++) {
+		uint8_t *row = &raw[y * row_len + 1];
+		for (x = 0; x < dim; x++)
+			if (!qr_dark(qr, x / scale, y / scale))
+				row[x >> 3] |= 0x80 >> (x & 7);
+	}
+
+	z[0] = 0x78;
+	z[1] = 0x01;
+	for (i = 0, pos = 2; i < raw_len; i += 65535) {
+		size_t len = raw_len - i > 65535 ? 65535 : raw_len - i;
+
+		z[pos++] = i + len == raw_len;
+		z[pos++] = len;
+		z[pos++] = len >> 8;
+		z[pos++] = ~len;
+		z[pos++] = ~len >> 8;
+		memcpy(&z[pos], &raw[i], len);
+		pos += len;
+	}
+	for (i = 0; i < raw_len; i++) {
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	put_be32(&z[pos], (b << 16) | a);
+	pos += 4;
+
+	put_be32(&ihdr[0], dim);
+	put_be32(&ihdr[4], dim);
+	ihdr[8] = 1;		/* bit depth */
+	ihdr[9] = 0;		/* grayscale */
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+	if (fwrite(sig, sizeof(sig), 1, f) == 1 &&
+	    !png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) &&
+	    !png_chunk(f, "IDAT", z, pos) &&
+	    !png_chunk(f, "IEND", NULL, 0))
+		ret = ERR_NONE;
+
+	free(raw);
+	free(z);
+	return ret;
+}
+
+/*
+ * Two rows per line using half-block characters, drawn dark-on-light
+ * regardless of the terminal's color scheme.
+ */
+void qr_write_ansi(const struct qr_code *qr, FILE *f)
+{
+	int x, y, dim = qr->size + 2 * QR_QUIET_ZONE;
+
+	for (y = 0; y < dim; y += 2) {
+		fputs("\033[30;47m", f);
+		for (x = 0; x < dim; x++) {
+			int top = qr_dark(qr, x, y);
+			int bot = qr_dark(qr, x, y + 1);
+
+			if (top && bot)
+				fputs("\xe2\x96\x88", f);	/* full block */
+			else if (top)
+				fputs("\xe2\x96\x80", f);	/* upper half */
+			else if (bot)
+				fputs("\xe2\x96\x84", f);	/* lower half */
+			else
+				fputc(' ', f);
+		}
+		fputs("\033[0m\n", f);
+	}
+}
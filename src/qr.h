@@ -0,0 +1,51 @@
+/*
+ * qr.h - QR code encoder for token export
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __STOKEN_QR_H__
+#define __STOKEN_QR_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* modules of light border required around the symbol */
+#define QR_QUIET_ZONE		4
+
+/* default PNG pixels per module */
+#define QR_PNG_SCALE		4
+
+struct qr_code {
+	int			version;
+	int			size;
+	/* size * size entries, row major; nonzero = dark */
+	uint8_t			*modules;
+};
+
+/*
+ * Encode STR in byte mode at ECC level H, using the smallest version that
+ * fits.  Returns ERR_NONE, ERR_BAD_LEN if STR is too long for a version 40
+ * symbol, or ERR_NO_MEMORY.
+ */
+int qr_encode(const char *str, struct qr_code *qr);
+void qr_free(struct qr_code *qr);
+
+int qr_write_png(const struct qr_code *qr, FILE *f, int scale);
+void qr_write_ansi(const struct qr_code *qr, FILE *f);
+
+#endif /* !__STOKEN_QR_H__ */
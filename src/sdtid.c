@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -30,13 +31,16 @@
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
-#include <tomcrypt.h>
 
+#include "base64.h"
+#include "crypto.h"
 #include "securid.h"
 #include "sdtid.h"
 #include "stoken-internal.h"
 
 struct sdtid {
+	/* DOC belongs to SHARED, if set */
+	struct sdtid_doc	*shared;
 	xmlDoc			*doc;
 	xmlNode			*header_node;
 	xmlNode			*tkn_node;
@@ -50,6 +54,45 @@ struct sdtid {
 	uint8_t			batch_mac_key[AES_KEY_SIZE];
 	uint8_t			token_mac_key[AES_KEY_SIZE];
 	uint8_t			token_enc_key[AES_KEY_SIZE];
+
+	/*
+	 * Everything sdtid_decrypt() needs from the XML, parsed once per
+	 * token.  The serialized sections don't depend on the keys, so
+	 * each decrypt attempt only runs the CBC-MACs over them.
+	 */
+	int			have_fields;
+	char			*origin, *dest, *name;
+	uint8_t			secret[AES_BLOCK_SIZE];
+	uint8_t			enc_seed[AES_BLOCK_SIZE];
+	uint8_t			good_mac0[AES_BLOCK_SIZE];
+	uint8_t			good_mac1[AES_BLOCK_SIZE];
+	uint8_t			*header_data, *tkn_data;
+	int			header_len, tkn_len;
+
+	/*
+	 * If HAVE_KEYS is set, the keys above were derived from the password
+	 * (or <Origin>) whose salted digest is KEYS_DIGEST; the password
+	 * itself isn't kept.  Unlocking with the same password again reuses
+	 * the keys, along with the MAC results: -1 = not checked yet,
+	 * 0 = bad, 1 = good.
+	 */
+	int			have_keys;
+	uint8_t			pass_salt[AES_BLOCK_SIZE];
+	uint8_t			keys_digest[SHA256_HASH_SIZE];
+	int			mac0_passed, mac1_passed;
+};
+
+/*
+ * A batch file parsed once for all of its tokens.  Decoding only reads
+ * the tree, so tokens can be decoded from it on any number of threads.
+ */
+struct sdtid_doc {
+	int			refs;
+	xmlDoc			*doc;
+	xmlNode			*header_node;
+	xmlNode			*trailer_node;
+	xmlNode			**tkn_nodes;
+	int			n_tkns;
 };
 
 static const uint8_t batch_mac_iv[] =
@@ -188,64 +231,36 @@ static xmlNode *find_child_named(xmlNode *node, const char *name)
 	return NULL;
 }
 
-static int __replace_string(struct sdtid *s, xmlNode *node,
-			    const char *name, const char *value)
-{
-	int ret;
-
-	for (node = node->children; node; node = node->next) {
-		ret = __replace_string(s, node, name, value);
-		if (ret != ERR_GENERAL)
-			return ret;
-		if (xmlnode_is_named(node, name)) {
-			xmlChar *input = xmlEncodeEntitiesReentrant(s->doc,
-								    value);
-			if (!input)
-				return ERR_NO_MEMORY;
-			xmlNodeSetContent(node, input);
-			free(input);
-			return ERR_NONE;
-		}
-	}
-	return ERR_GENERAL;
-}
-
-static int replace_string(struct sdtid *s, xmlNode *node,
-			  const char *name, const char *value)
+static void set_slot(struct sdtid *s, xmlNode *node, const char *value)
 {
-	int ret = __replace_string(s, node, name, value);
-	if (ret != ERR_GENERAL) {
-		s->error = ret;
-		return ret;
-	}
+	xmlChar *input = xmlEncodeEntitiesReentrant(s->doc, XCAST(value));
 
-	/* not found => create a new string at the end of the section */
-	if (xmlNewTextChild(node, NULL, XCAST(name), XCAST(value)) == NULL) {
+	if (!input) {
 		s->error = ERR_NO_MEMORY;
-		return ERR_NO_MEMORY;
+		return;
 	}
-
-	return ERR_NONE;
+	xmlNodeSetContent(node, input);
+	free(input);
 }
 
-static int replace_b64(struct sdtid *s, xmlNode *node, const char *name,
-		       const uint8_t *data, int len)
+static void set_slot_b64(struct sdtid *s, xmlNode *node, const uint8_t *data,
+			 int len)
 {
 	unsigned long enclen = BASE64_INPUT_LEN(len);
-	char *out = malloc(enclen);
-	int ret;
+	/* +1 for the leading '=' */
+	char *out = malloc(enclen + 1);
 
-	if (!out)
-		return ERR_NO_MEMORY;
+	if (!out) {
+		s->error = ERR_NO_MEMORY;
+		return;
+	}
 
 	/* the first character of <Seed> will be ignored by the reader */
 	*out = '=';
-	base64_encode(data, len, out + 1, &enclen);
-	ret = replace_string(s, node, name,
-			     !strcmp(name, "Seed") ? out : out + 1);
+	b64_encode(data, len, out + 1, &enclen);
+	set_slot(s, node, xmlnode_is_named(node, "Seed") ? out : out + 1);
 
 	free(out);
-	return ret;
 }
 
 static char *__lookup_common(struct sdtid *s, xmlNode *node, const char *name)
@@ -338,7 +353,7 @@ static int lookup_b64(struct sdtid *s, const char *name, uint8_t *out,
 	if (*p && !strcmp(name, "Seed"))
 		p++;
 
-	len = base64_decode(p, strlen(p), out, &actual) == CRYPT_OK ?
+	len = b64_decode(p, strlen(p), out, &actual) == ERR_NONE ?
 	      actual : -1;
 
 	free(data);
@@ -459,11 +474,35 @@ static int hash_section(struct sdtid *s, xmlNode *node, uint8_t *mac,
 	return ERR_NONE;
 }
 
+/* like hash_section(), but keep the serialized data instead of hashing it */
+static int serialize_section(xmlNode *node, uint8_t **data, int *len)
+{
+	struct hash_status *hs = calloc(1, sizeof(*hs));
+
+	if (!hs)
+		return ERR_NO_MEMORY;
+	hs->root = node;
+	if (__hash_section(hs, (char *)node->name, node) < 0) {
+		free(hs);
+		return ERR_NO_MEMORY;
+	}
+
+	*data = malloc(hs->pos ? : 1);
+	if (*data) {
+		memcpy(*data, hs->data, hs->pos);
+		*len = hs->pos;
+	}
+	free(hs);
+	return *data ? ERR_NONE : ERR_NO_MEMORY;
+}
+
+#define HASH_PASSWORD_ROUNDS	1000
+
 static void hash_password(uint8_t *result, const char *pass, const char *salt0,
 			  const char *salt1)
 {
-	uint8_t key[AES_KEY_SIZE], iv[AES_BLOCK_SIZE], tmp[AES_BLOCK_SIZE];
-	uint8_t data[0x50];
+	uint8_t key[AES_KEY_SIZE], iv[AES_BLOCK_SIZE], prefix[AES_BLOCK_SIZE];
+	uint8_t data[0x50], blk[HASH_PASSWORD_ROUNDS][AES_BLOCK_SIZE];
 	unsigned int i;
 
 	memset(result, 0, AES_BLOCK_SIZE);
@@ -478,12 +517,26 @@ static void hash_password(uint8_t *result, const char *pass, const char *salt0,
 	strncpy(&data[0x00], pass, 0x20);
 	strncpy(&data[0x20], salt0, 0x20);
 
-	for (i = 0; i < 1000; i++) {
-		data[0x4f] = i >> 0;
-		data[0x4e] = i >> 8;
-		cbc_hash(tmp, key, iv, data, sizeof(data));
-		xor_block(result, tmp);
+	/*
+	 * Every round CBC-hashes the same 0x50 bytes except for the round
+	 * number in the last two, so the chaining value after the first four
+	 * blocks is common to all rounds, and the final blocks can be
+	 * encrypted in one batch under a single key schedule.
+	 */
+	cbc_hash(prefix, key, iv, data, 0x40);
+	for (i = 0; i < HASH_PASSWORD_ROUNDS; i++) {
+		memcpy(blk[i], &data[0x40], AES_BLOCK_SIZE);
+		blk[i][0x0f] = i >> 0;
+		blk[i][0x0e] = i >> 8;
+		xor_block(blk[i], prefix);
 	}
+	crypto->aes128_ecb_encrypt(key, blk[0], blk[0], HASH_PASSWORD_ROUNDS);
+
+	for (i = 0; i < HASH_PASSWORD_ROUNDS; i++)
+		xor_block(result, blk[i]);
+
+	memset(data, 0, sizeof(data));
+	memset(blk, 0, sizeof(blk));
 }
 
 static void decrypt_secret(uint8_t *result, const uint8_t *enc_bin,
@@ -549,9 +602,25 @@ static int b64_or_warn(struct sdtid *s, const char *name, uint8_t *out,
 	return ret;
 }
 
+static void derive_keys(struct sdtid *s, const char *pass, const char *dest,
+			const char *name, const uint8_t *secret)
+{
+	uint8_t key0[AES_KEY_SIZE], key1[AES_KEY_SIZE];
+
+	hash_password(key0, pass, dest, name);
+	decrypt_secret(key1, secret, name, key0);
+
+	calc_key(s->batch_mac_key, "BatchMAC", name, key1, batch_mac_iv);
+	calc_key(s->token_mac_key, "TokenMAC", s->sn, key1, token_mac_iv);
+	calc_key(s->token_enc_key, "TokenEncrypt", s->sn, key1, token_enc_iv);
+
+	memset(key0, 0, sizeof(key0));
+	memset(key1, 0, sizeof(key1));
+}
+
 static int generate_all_keys(struct sdtid *s, const char *pass)
 {
-	uint8_t secret[AES_BLOCK_SIZE], key0[AES_KEY_SIZE], key1[AES_KEY_SIZE];
+	uint8_t secret[AES_BLOCK_SIZE];
 
 	char *origin = NULL, *dest = NULL, *name = NULL;
 	int ret = ERR_GENERAL;
@@ -564,12 +633,7 @@ static int generate_all_keys(struct sdtid *s, const char *pass)
 	    b64_or_warn(s, "Secret", secret, AES_KEY_SIZE))
 		goto err;
 
-	hash_password(key0, pass ? pass : origin, dest, name);
-	decrypt_secret(key1, secret, name, key0);
-
-	calc_key(s->batch_mac_key, "BatchMAC", name, key1, batch_mac_iv);
-	calc_key(s->token_mac_key, "TokenMAC", s->sn, key1, token_mac_iv);
-	calc_key(s->token_enc_key, "TokenEncrypt", s->sn, key1, token_enc_iv);
+	derive_keys(s, pass ? pass : origin, dest, name, secret);
 	ret = ERR_NONE;
 
 err:
@@ -579,6 +643,59 @@ err:
 	return s->error ? : ret;
 }
 
+static int load_fields(struct sdtid *s)
+{
+	if (s->have_fields)
+		return ERR_NONE;
+
+	free(s->sn);
+	s->sn = NULL;
+	if (str_or_warn(s, "SN", &s->sn) ||
+	    str_or_warn(s, "Origin", &s->origin) ||
+	    str_or_warn(s, "Dest", &s->dest) ||
+	    str_or_warn(s, "Name", &s->name) ||
+	    b64_or_warn(s, "Secret", s->secret, AES_KEY_SIZE))
+		return s->error ? : ERR_GENERAL;
+
+	if (securid_rand(s->pass_salt, sizeof(s->pass_salt), 0) != ERR_NONE)
+		return ERR_GENERAL;
+
+	if (b64_or_warn(s, "Seed", s->enc_seed, AES_BLOCK_SIZE) ||
+	    b64_or_warn(s, "HeaderMAC", s->good_mac0, AES_BLOCK_SIZE) ||
+	    b64_or_warn(s, "TokenMAC", s->good_mac1, AES_BLOCK_SIZE) ||
+	    serialize_section(s->header_node, &s->header_data,
+			      &s->header_len) ||
+	    serialize_section(s->tkn_node, &s->tkn_data, &s->tkn_len))
+		return ERR_GENERAL;
+
+	s->have_fields = 1;
+	return ERR_NONE;
+}
+
+static void clear_keys(struct sdtid *s)
+{
+	s->have_keys = 0;
+	memset(s->keys_digest, 0, sizeof(s->keys_digest));
+	memset(s->batch_mac_key, 0, sizeof(s->batch_mac_key));
+	memset(s->token_mac_key, 0, sizeof(s->token_mac_key));
+	memset(s->token_enc_key, 0, sizeof(s->token_enc_key));
+}
+
+static void pass_digest(struct sdtid *s, const char *pass, uint8_t *out)
+{
+	crypto->hmac_sha256(s->pass_salt, sizeof(s->pass_salt),
+			    pass, strlen(pass), out);
+}
+
+static int mac_ok(const uint8_t *data, int len, const uint8_t *key,
+		  const uint8_t *iv, const uint8_t *good_mac)
+{
+	uint8_t mac[AES_BLOCK_SIZE];
+
+	cbc_hash(mac, key, iv, data, len);
+	return !memcmp(mac, good_mac, AES_BLOCK_SIZE);
+}
+
 /************************************************************************
  * Public functions
  ************************************************************************/
@@ -586,39 +703,46 @@ err:
 int sdtid_decrypt(struct securid_token *t, const char *pass)
 {
 	struct sdtid *s = t->sdtid;
-	uint8_t good_mac0[AES_BLOCK_SIZE], mac0[AES_BLOCK_SIZE],
-		good_mac1[AES_BLOCK_SIZE], mac1[AES_BLOCK_SIZE];
-	int ret, mac0_passed, mac1_passed;
+	uint8_t digest[SHA256_HASH_SIZE];
+	const char *key_pass;
+	int ret;
 
-	ret = generate_all_keys(s, pass);
+	ret = load_fields(s);
 	if (ret != ERR_NONE)
 		return ret;
 
-	if (b64_or_warn(s, "Seed", t->enc_seed, AES_BLOCK_SIZE))
-		return ERR_GENERAL;
+	memcpy(t->enc_seed, s->enc_seed, AES_BLOCK_SIZE);
 	t->has_enc_seed = 1;
 
-	if (b64_or_warn(s, "HeaderMAC", good_mac0, AES_BLOCK_SIZE) ||
-	    hash_section(s, s->header_node, mac0,
-			 s->batch_mac_key, batch_mac_iv))
-		return ERR_GENERAL;
-
-	if (b64_or_warn(s, "TokenMAC", good_mac1, AES_BLOCK_SIZE) ||
-	    hash_section(s, s->tkn_node, mac1,
-			 s->token_mac_key, token_mac_iv))
-		return ERR_GENERAL;
+	/* the expensive part: only redo it if the password changed */
+	key_pass = pass ? pass : s->origin;
+	pass_digest(s, key_pass, digest);
+	if (!s->have_keys || memcmp(s->keys_digest, digest, sizeof(digest))) {
+		clear_keys(s);
+		derive_keys(s, key_pass, s->dest, s->name, s->secret);
+		memcpy(s->keys_digest, digest, sizeof(digest));
+		s->have_keys = 1;
+		s->mac0_passed = s->mac1_passed = -1;
+	}
+	memset(digest, 0, sizeof(digest));
 
-	mac0_passed = !memcmp(mac0, good_mac0, AES_BLOCK_SIZE);
-	mac1_passed = !memcmp(mac1, good_mac1, AES_BLOCK_SIZE);
+	if (s->mac0_passed < 0)
+		s->mac0_passed = mac_ok(s->header_data, s->header_len,
+					s->batch_mac_key, batch_mac_iv,
+					s->good_mac0);
+	if (s->mac1_passed < 0)
+		s->mac1_passed = mac_ok(s->tkn_data, s->tkn_len,
+					s->token_mac_key, token_mac_iv,
+					s->good_mac1);
 
 	/* note that we cannot diagnose a corrupted <Secret> field */
-	if (!mac0_passed && !mac1_passed)
+	if (!s->mac0_passed && !s->mac1_passed)
 		return pass ? ERR_DECRYPT_FAILED : ERR_MISSING_PASSWORD;
 
-	if (!mac0_passed) {
+	if (!s->mac0_passed) {
 		err_printf(s, "header MAC check failed - malformed input\n");
 		return ERR_DECRYPT_FAILED;
-	} else if (!mac1_passed) {
+	} else if (!s->mac1_passed) {
 		err_printf(s, "token MAC check failed - malformed input\n");
 		return ERR_DECRYPT_FAILED;
 	}
@@ -768,10 +892,23 @@ static int parse_sdtid(const char *in, struct sdtid *s, int which, int strict)
 
 err:
 	xmlFreeDoc(s->doc);
+	s->doc = NULL;
 	return ret;
 }
 
-static int decode_one(const char *in, struct securid_token *t, int which)
+/* T takes ownership of S, which is freed on failure */
+static int decode_one(struct sdtid *s, struct securid_token *t)
+{
+	t->sdtid = s;
+	if (decode_fields(t) != ERR_NONE) {
+		t->sdtid = NULL;
+		sdtid_free(s);
+		return ERR_GENERAL;
+	}
+	return ERR_NONE;
+}
+
+int sdtid_decode(const char *in, struct securid_token *t)
 {
 	struct sdtid *s;
 	int ret;
@@ -782,30 +919,173 @@ static int decode_one(const char *in, struct securid_token *t, int which)
 
 	s->interactive = t->interactive;
 
-	ret = parse_sdtid(in, s, which, 1);
+	ret = parse_sdtid(in, s, -1, 1);
 	if (ret) {
 		free(s);
 		return ret;
 	}
+	return decode_one(s, t);
+}
 
-	t->sdtid = s;
-	if (decode_fields(t) != ERR_NONE) {
-		ret = ERR_GENERAL;
+int sdtid_doc_new(const char *in, struct sdtid_doc **out)
+{
+	struct sdtid_doc *d;
+	xmlNode *batch, *node;
+	int ret = ERR_GENERAL, n = 0;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return ERR_NO_MEMORY;
+	d->refs = 1;
+
+	d->doc = xmlReadMemory(in, strlen(in), "sdtid.xml", NULL,
+			       XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+	if (!d->doc)
+		goto err;
+
+	batch = find_child_named(xmlDocGetRootElement(d->doc), "TKNBatch");
+	if (!batch)
+		goto err;
+	d->header_node = find_child_named(batch->children, "TKNHeader");
+	d->trailer_node = find_child_named(batch->children, "TKNTrailer");
+
+	for (node = batch->children; node; node = node->next)
+		if (xmlnode_is_named(node, "TKN"))
+			n++;
+	d->tkn_nodes = malloc((n ? : 1) * sizeof(*d->tkn_nodes));
+	if (!d->tkn_nodes) {
+		ret = ERR_NO_MEMORY;
 		goto err;
 	}
+	for (node = batch->children; node; node = node->next)
+		if (xmlnode_is_named(node, "TKN"))
+			d->tkn_nodes[d->n_tkns++] = node;
 
+	*out = d;
 	return ERR_NONE;
 
 err:
-	sdtid_free(s);
+	sdtid_doc_put(d);
 	return ret;
 }
 
-int sdtid_decode(const char *in, struct securid_token *t)
+int sdtid_doc_count(const struct sdtid_doc *d)
+{
+	return d->n_tkns;
+}
+
+struct sdtid_doc *sdtid_doc_get(struct sdtid_doc *d)
+{
+	__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+	return d;
+}
+
+void sdtid_doc_put(struct sdtid_doc *d)
 {
-	return decode_one(in, t, -1);
+	if (!d || __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	xmlFreeDoc(d->doc);
+	free(d->tkn_nodes);
+	free(d);
+}
+
+int sdtid_decode_doc(struct sdtid_doc *d, struct securid_token *t, int which)
+{
+	struct sdtid *s;
+
+	if (which < 0 || which >= d->n_tkns ||
+	    !d->header_node || !d->trailer_node)
+		return ERR_GENERAL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return ERR_NO_MEMORY;
+
+	s->interactive = t->interactive;
+	s->shared = sdtid_doc_get(d);
+	s->doc = d->doc;
+	s->header_node = d->header_node;
+	s->tkn_node = d->tkn_nodes[which];
+	s->trailer_node = d->trailer_node;
+	return decode_one(s, t);
 }
 
+/*
+ * Exports and issues start from a skeleton document that is built once
+ * per template: the default sections with every field the template file
+ * supplied already filled in, and placeholders for everything that is
+ * written per token.  The position of each placeholder ("slot") is
+ * recorded, so an export copies the skeleton and writes straight into
+ * the slots instead of re-reading the template and searching the tree.
+ */
+
+enum {
+	SEC_HEADER,
+	SEC_TKN,
+	SEC_ATTR,
+};
+
+enum {
+	SLOT_SECRET,
+	SLOT_BIRTH,
+	SLOT_DEATH,
+	SLOT_TIMESEEDS,
+	SLOT_APPSEEDS,
+	SLOT_MODE,
+	SLOT_ALG,
+	SLOT_ADDPIN,
+	SLOT_LOCALPIN,
+	SLOT_DIGITS,
+	SLOT_INTERVAL,
+	SLOT_HEADER_MAC,
+	SLOT_SN,
+	SLOT_SEED,
+	SLOT_TOKEN_MAC,
+	SLOT_DEVID,
+	N_SLOTS,
+};
+
+struct tpl_slot {
+	/* name used to check whether the template overrides the slot */
+	const char		*field;
+	const char		*node;
+	int			section;
+};
+
+static const struct tpl_slot tpl_slots[N_SLOTS] = {
+	[SLOT_SECRET] =		{ "Secret", "Secret", SEC_HEADER },
+	[SLOT_BIRTH] =		{ "Birth", "DefBirth", SEC_HEADER },
+	[SLOT_DEATH] =		{ "Death", "DefDeath", SEC_HEADER },
+	[SLOT_TIMESEEDS] =	{ "TimeDerivedSeeds", "DefTimeDerivedSeeds",
+				  SEC_HEADER },
+	[SLOT_APPSEEDS] =	{ "AppDerivedSeeds", "DefAppDerivedSeeds",
+				  SEC_HEADER },
+	[SLOT_MODE] =		{ "Mode", "DefMode", SEC_HEADER },
+	[SLOT_ALG] =		{ "Alg", "DefAlg", SEC_HEADER },
+	[SLOT_ADDPIN] =		{ "AddPIN", "DefAddPIN", SEC_HEADER },
+	[SLOT_LOCALPIN] =	{ "LocalPIN", "DefLocalPIN", SEC_HEADER },
+	[SLOT_DIGITS] =		{ "Digits", "DefDigits", SEC_HEADER },
+	[SLOT_INTERVAL] =	{ "Interval", "DefInterval", SEC_HEADER },
+	[SLOT_HEADER_MAC] =	{ NULL, "HeaderMAC", SEC_HEADER },
+	[SLOT_SN] =		{ "SN", "SN", SEC_TKN },
+	[SLOT_SEED] =		{ "Seed", "Seed", SEC_TKN },
+	[SLOT_TOKEN_MAC] =	{ NULL, "TokenMAC", SEC_TKN },
+	[SLOT_DEVID] =		{ NULL, "DeviceSerialNumber", SEC_ATTR },
+};
+
+struct sdtid_template {
+	/* the parsed template file, or NULL */
+	struct sdtid		*tpl;
+	xmlDoc			*skel;
+
+	int			slot_pos[N_SLOTS];
+	uint8_t			present[N_SLOTS];
+
+	/* unencrypted <Seed> from the template, if present and valid */
+	int			seed_ok;
+	uint8_t			seed[AES_KEY_SIZE];
+};
+
 static int read_template_file(const char *filename, struct sdtid *s)
 {
 	size_t len;
@@ -890,6 +1170,12 @@ static struct sdtid *new_sdtid(struct sdtid *tpl)
 	if (!s->header_node || !s->tkn_node || !s->trailer_node || !attr)
 		goto bad;
 
+	/* the MACs go last, where they would have been appended */
+	if (!xmlNewTextChild(s->header_node, NULL, XCAST("HeaderMAC"),
+			     XCAST(" ")) ||
+	    !xmlNewTextChild(s->tkn_node, NULL, XCAST("TokenMAC"), XCAST(" ")))
+		goto bad;
+
 	return s;
 
 bad:
@@ -897,39 +1183,124 @@ bad:
 	return NULL;
 }
 
-static int clone_from_template(const char *filename, struct sdtid **tpl,
-			       struct sdtid **dst)
+static xmlNode *slot_parent(struct sdtid *s, int section)
 {
-	int ret;
+	switch (section) {
+	case SEC_HEADER:
+		return s->header_node;
+	case SEC_TKN:
+		return s->tkn_node;
+	default:
+		return find_child_named(s->tkn_node->children,
+					"TokenAttributes");
+	}
+}
+
+int sdtid_template_new(const char *filename, struct sdtid_template **out)
+{
+	struct sdtid_template *tpl;
+	struct sdtid *s = NULL;
+	int ret = ERR_NO_MEMORY, i;
 
-	*tpl = *dst = NULL;
+	*out = NULL;
+	tpl = calloc(1, sizeof(*tpl));
+	if (!tpl)
+		return ERR_NO_MEMORY;
 
 	/* note that filename is OPTIONAL */
 	if (filename) {
-		*tpl = calloc(1, sizeof(**tpl));
-		if (!*tpl)
-			return ERR_NO_MEMORY;
+		tpl->tpl = calloc(1, sizeof(*tpl->tpl));
+		if (!tpl->tpl)
+			goto err;
 
-		(*tpl)->interactive = 1;
-		ret = read_template_file(filename, *tpl);
+		tpl->tpl->interactive = 1;
+		ret = read_template_file(filename, tpl->tpl);
 		if (ret != ERR_NONE)
-			goto out;
+			goto err;
 	}
 
-	*dst = new_sdtid(*tpl);
-	if (*dst)
-		return ERR_NONE;
+	for (i = 0; i < N_SLOTS; i++)
+		tpl->present[i] = tpl_slots[i].field &&
+				  node_present(tpl->tpl, tpl_slots[i].field);
+	if (tpl->present[SLOT_SEED])
+		tpl->seed_ok = !lookup_b64(tpl->tpl, "Seed", tpl->seed,
+					   AES_KEY_SIZE);
 
 	ret = ERR_NO_MEMORY;
+	s = new_sdtid(tpl->tpl);
+	if (!s)
+		goto err;
 
-out:
-	sdtid_free(*tpl);
-	sdtid_free(*dst);
+	ret = ERR_GENERAL;
+	for (i = 0; i < N_SLOTS; i++) {
+		xmlNode *node = slot_parent(s, tpl_slots[i].section)->children;
+		int pos = 0;
+
+		for (; node; node = node->next, pos++)
+			if (xmlnode_is_named(node, tpl_slots[i].node))
+				break;
+		if (!node)
+			goto err;
+		tpl->slot_pos[i] = pos;
+	}
+
+	tpl->skel = s->doc;
+	s->doc = NULL;
+	sdtid_free(s);
+
+	*out = tpl;
+	return ERR_NONE;
+
+err:
+	sdtid_free(s);
+	sdtid_template_free(tpl);
 	return ret;
 }
 
-static int overwrite_secret(struct sdtid *s, xmlNode *node, const char *name,
-			    int paranoid)
+void sdtid_template_free(struct sdtid_template *tpl)
+{
+	if (!tpl)
+		return;
+	sdtid_free(tpl->tpl);
+	xmlFreeDoc(tpl->skel);
+	memset(tpl, 0, sizeof(*tpl));
+	free(tpl);
+}
+
+/* copy the skeleton and locate the slots in the copy */
+static struct sdtid *clone_from_template(const struct sdtid_template *tpl,
+					 xmlNode **slot)
+{
+	struct sdtid *s;
+	xmlNode *batch;
+	int i, j;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->doc = xmlCopyDoc(tpl->skel, 1);
+	if (!s->doc) {
+		free(s);
+		return NULL;
+	}
+
+	batch = xmlDocGetRootElement(s->doc);
+	s->header_node = find_child_named(batch->children, "TKNHeader");
+	s->tkn_node = find_child_named(batch->children, "TKN");
+	s->trailer_node = find_child_named(batch->children, "TKNTrailer");
+
+	for (i = 0; i < N_SLOTS; i++) {
+		xmlNode *node = slot_parent(s, tpl_slots[i].section)->children;
+
+		for (j = 0; j < tpl->slot_pos[i]; j++)
+			node = node->next;
+		slot[i] = node;
+	}
+	return s;
+}
+
+static int overwrite_secret(struct sdtid *s, xmlNode *node, int paranoid)
 {
 	uint8_t data[AES_BLOCK_SIZE];
 	int ret;
@@ -940,38 +1311,41 @@ static int overwrite_secret(struct sdtid *s, xmlNode *node, const char *name,
 		return ret;
 	}
 
-	return replace_b64(s, node, name, data, sizeof(data));
+	set_slot_b64(s, node, data, sizeof(data));
+	return s->error;
 }
 
-static int recompute_macs(struct sdtid *s)
+static int recompute_macs(struct sdtid *s, xmlNode **slot)
 {
 	uint8_t mac[AES_BLOCK_SIZE];
 
-	if (hash_section(s, s->header_node, mac, s->batch_mac_key, batch_mac_iv) ||
-	    replace_b64(s, s->header_node, "HeaderMAC", mac, sizeof(mac)) ||
-	    hash_section(s, s->tkn_node, mac, s->token_mac_key, token_mac_iv) ||
-	    replace_b64(s, s->tkn_node, "TokenMAC", mac, sizeof(mac))) {
+	if (hash_section(s, s->header_node, mac, s->batch_mac_key,
+			 batch_mac_iv)) {
 		s->error = ERR_GENERAL;
 		return ERR_GENERAL;
 	}
+	set_slot_b64(s, slot[SLOT_HEADER_MAC], mac, sizeof(mac));
 
-	return ERR_NONE;
+	if (hash_section(s, s->tkn_node, mac, s->token_mac_key,
+			 token_mac_iv)) {
+		s->error = ERR_GENERAL;
+		return ERR_GENERAL;
+	}
+	set_slot_b64(s, slot[SLOT_TOKEN_MAC], mac, sizeof(mac));
+
+	return s->error;
 }
 
-static void check_and_store_int(struct sdtid *s, struct sdtid *tpl,
-				const char *name, int val)
+static void check_and_store_int(struct sdtid *s,
+				const struct sdtid_template *tpl,
+				xmlNode **slot, int idx, int val)
 {
-	char *tmp, str[32];
-	if (node_present(tpl, name))
-		return;
+	char str[32];
 
-	if (asprintf(&tmp, "Def%s", name) < 0) {
-		s->error = ERR_NO_MEMORY;
+	if (tpl->present[idx])
 		return;
-	}
 	snprintf(str, sizeof(str), "%d", val);
-	replace_string(s, s->header_node, tmp, str);
-	free(tmp);
+	set_slot(s, slot[idx], str);
 }
 
 static int generate_sn(char *str)
@@ -986,132 +1360,167 @@ static int generate_sn(char *str)
 	return ERR_NONE;
 }
 
-int sdtid_issue(const char *filename, const char *pass,
-		const char *devid)
+int sdtid_issue_tpl(const struct sdtid_template *tpl, const char *pass,
+		    const char *devid, FILE *f)
 {
-	struct sdtid *s = NULL, *tpl = NULL;
+	struct sdtid *s;
+	xmlNode *slot[N_SLOTS];
 	int ret = ERR_GENERAL;
 	uint8_t dec_seed[AES_KEY_SIZE], enc_seed[AES_KEY_SIZE];
 	char str[32];
 
-	if (clone_from_template(filename, &tpl, &s) ||
-	    overwrite_secret(s, s->header_node, "Secret", 1) ||
+	s = clone_from_template(tpl, slot);
+	if (!s)
+		return ERR_NO_MEMORY;
+
+	if (overwrite_secret(s, slot[SLOT_SECRET], 1) ||
 	    securid_rand(dec_seed, sizeof(dec_seed), 1))
 		goto out;
 
-	if (!node_present(tpl, "SN")) {
+	if (!tpl->present[SLOT_SN]) {
 		if (generate_sn(str) != ERR_NONE)
 			goto out;
-		replace_string(s, s->tkn_node, "SN", str);
+		set_slot(s, slot[SLOT_SN], str);
 	}
 
 	if (devid && strlen(devid))
-		replace_string(s, s->tkn_node, "DeviceSerialNumber", devid);
+		set_slot(s, slot[SLOT_DEVID], devid);
 
 	ret = generate_all_keys(s, pass);
 	if (ret != ERR_NONE || s->error != ERR_NONE)
 		goto out;
 
 	decrypt_seed(enc_seed, dec_seed, s->sn, s->token_enc_key);
-	replace_b64(s, s->tkn_node, "Seed", enc_seed, sizeof(enc_seed));
+	set_slot_b64(s, slot[SLOT_SEED], enc_seed, sizeof(enc_seed));
 
-	if (!node_present(tpl, "Birth")) {
+	if (!tpl->present[SLOT_BIRTH]) {
 		format_date(-1, str, 32);
-		replace_string(s, s->header_node, "DefBirth", str);
+		set_slot(s, slot[SLOT_BIRTH], str);
 	}
 
-	if (!node_present(tpl, "Death")) {
+	if (!tpl->present[SLOT_DEATH]) {
 		/* if unspecified, use (today + 5 years) */
 		format_date(-5*365*24*60*60, str, 32);
-		replace_string(s, s->header_node, "DefDeath", str);
+		set_slot(s, slot[SLOT_DEATH], str);
 	}
 
-	recompute_macs(s);
+	recompute_macs(s, slot);
 
-	if (s->error != ERR_NONE)
+	ret = s->error;
+	if (ret != ERR_NONE)
 		goto out;
 
-	xmlDocFormatDump(stdout, s->doc, 1);
-	ret = ERR_NONE;
+	xmlDocFormatDump(f, s->doc, 1);
 
 out:
-	sdtid_free(tpl);
 	sdtid_free(s);
 	memset(dec_seed, 0, sizeof(dec_seed));
 	return ret;
 }
 
-int sdtid_export(const char *filename, struct securid_token *t,
-		 const char *pass, const char *devid)
+int sdtid_export_tpl(const struct sdtid_template *tpl,
+		     struct securid_token *t, const char *pass,
+		     const char *devid, FILE *f)
 {
-	struct sdtid *s = NULL, *tpl = NULL;
+	struct sdtid *s;
+	xmlNode *slot[N_SLOTS];
 	int ret, tmp;
 	uint8_t dec_seed[AES_KEY_SIZE], enc_seed[AES_KEY_SIZE];
 
-	ret = clone_from_template(filename, &tpl, &s);
-	if (ret != ERR_NONE)
-		return ret;
+	s = clone_from_template(tpl, slot);
+	if (!s)
+		return ERR_NO_MEMORY;
 
-	if (!node_present(tpl, "Secret"))
-		overwrite_secret(s, s->header_node, "Secret", 0);
+	if (!tpl->present[SLOT_SECRET])
+		overwrite_secret(s, slot[SLOT_SECRET], 0);
 
 	/* this section should largely mirror decode_fields() */
 
-	if (!node_present(tpl, "SN"))
-		replace_string(s, s->tkn_node, "SN", t->serial);
+	if (!tpl->present[SLOT_SN])
+		set_slot(s, slot[SLOT_SN], t->serial);
 
-	check_and_store_int(s, tpl, "TimeDerivedSeeds",
+	check_and_store_int(s, tpl, slot, SLOT_TIMESEEDS,
 			    !!(t->flags & FL_TIMESEEDS));
-	check_and_store_int(s, tpl, "AppDerivedSeeds",
+	check_and_store_int(s, tpl, slot, SLOT_APPSEEDS,
 			    !!(t->flags & FL_APPSEEDS));
-	check_and_store_int(s, tpl, "Mode", !!(t->flags & FL_FEAT4));
-	check_and_store_int(s, tpl, "Alg", !!(t->flags & FL_128BIT));
+	check_and_store_int(s, tpl, slot, SLOT_MODE, !!(t->flags & FL_FEAT4));
+	check_and_store_int(s, tpl, slot, SLOT_ALG, !!(t->flags & FL_128BIT));
 
 	tmp = (t->flags & FLD_PINMODE_MASK) >> FLD_PINMODE_SHIFT;
-	check_and_store_int(s, tpl, "AddPIN", !!(tmp & 0x02));
-	check_and_store_int(s, tpl, "LocalPIN", !!(tmp & 0x01));
-	check_and_store_int(s, tpl, "Digits", 1 +
+	check_and_store_int(s, tpl, slot, SLOT_ADDPIN, !!(tmp & 0x02));
+	check_and_store_int(s, tpl, slot, SLOT_LOCALPIN, !!(tmp & 0x01));
+	check_and_store_int(s, tpl, slot, SLOT_DIGITS, 1 +
 			    ((t->flags & FLD_DIGIT_MASK) >> FLD_DIGIT_SHIFT));
-	check_and_store_int(s, tpl, "Interval",
+	check_and_store_int(s, tpl, slot, SLOT_INTERVAL,
 			    t->flags & FLD_NUMSECONDS_MASK ? 60 : 30);
 
-	if (!node_present(tpl, "Death")) {
+	if (!tpl->present[SLOT_DEATH]) {
 		char str[32];
 		format_date(t->exp_date, str, 32);
-		replace_string(s, s->header_node, "DefDeath", str);
+		set_slot(s, slot[SLOT_DEATH], str);
 	}
 
 	if (devid && strlen(devid))
-		replace_string(s, s->tkn_node, "DeviceSerialNumber", devid);
+		set_slot(s, slot[SLOT_DEVID], devid);
 
 	ret = generate_all_keys(s, pass);
 	if (ret != ERR_NONE || s->error != ERR_NONE)
 		goto out;
 
 	/* special case: this is an unencrypted seed in base64 format */
-	if (node_present(tpl, "Seed")) {
-		if (b64_or_warn(tpl, "Seed", dec_seed, AES_KEY_SIZE)) {
+	if (tpl->present[SLOT_SEED]) {
+		if (!tpl->seed_ok) {
+			missing_node(tpl->tpl, "Seed");
 			ret = ERR_GENERAL;
 			goto out;
 		}
+		memcpy(dec_seed, tpl->seed, AES_KEY_SIZE);
 	} else {
 		memcpy(dec_seed, t->dec_seed, AES_KEY_SIZE);
 	}
 
 	decrypt_seed(enc_seed, dec_seed, s->sn, s->token_enc_key);
-	replace_b64(s, s->tkn_node, "Seed", enc_seed, sizeof(enc_seed));
+	set_slot_b64(s, slot[SLOT_SEED], enc_seed, sizeof(enc_seed));
 
-	recompute_macs(s);
+	recompute_macs(s, slot);
 
-	if (s->error != ERR_NONE)
+	ret = s->error;
+	if (ret != ERR_NONE)
 		goto out;
 
-	xmlDocFormatDump(stdout, s->doc, 1);
-	ret = ERR_NONE;
+	xmlDocFormatDump(f, s->doc, 1);
 
 out:
-	sdtid_free(tpl);
 	sdtid_free(s);
+	memset(dec_seed, 0, sizeof(dec_seed));
+	return ret;
+}
+
+int sdtid_issue(const char *filename, const char *pass,
+		const char *devid)
+{
+	struct sdtid_template *tpl;
+	int ret;
+
+	ret = sdtid_template_new(filename, &tpl);
+	if (ret != ERR_NONE)
+		return ret;
+	ret = sdtid_issue_tpl(tpl, pass, devid, stdout);
+	sdtid_template_free(tpl);
+	return ret;
+}
+
+int sdtid_export(const char *filename, struct securid_token *t,
+		 const char *pass, const char *devid)
+{
+	struct sdtid_template *tpl;
+	int ret;
+
+	ret = sdtid_template_new(filename, &tpl);
+	if (ret != ERR_NONE)
+		return ret;
+	ret = sdtid_export_tpl(tpl, t, pass, devid, stdout);
+	sdtid_template_free(tpl);
 	return ret;
 }
 
@@ -1119,8 +1528,17 @@ void sdtid_free(struct sdtid *s)
 {
 	if (!s)
 		return;
+	clear_keys(s);
 	free(s->sn);
-	xmlFreeDoc(s->doc);
+	free(s->origin);
+	free(s->dest);
+	free(s->name);
+	free(s->header_data);
+	free(s->tkn_data);
+	if (s->shared)
+		sdtid_doc_put(s->shared);
+	else
+		xmlFreeDoc(s->doc);
 	memset(s, 0, sizeof(*s));
 	free(s);
 }
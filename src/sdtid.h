@@ -21,8 +21,12 @@
 #ifndef __STOKEN_SDTID_H__
 #define __STOKEN_SDTID_H__
 
+#include <stdio.h>
+
 struct securid_token;
 struct sdtid;
+struct sdtid_doc;
+struct sdtid_template;
 
 int sdtid_decode(const char *in, struct securid_token *t);
 int sdtid_decrypt(struct securid_token *t, const char *pass);
@@ -32,4 +36,28 @@ int sdtid_export(const char *filename, struct securid_token *t,
 		 const char *pass, const char *devid);
 void sdtid_free(struct sdtid *s);
 
+/*
+ * A multi-token batch file is parsed once into a refcounted document, and
+ * each token is decoded from it by index.  Decoded tokens hold their own
+ * references, and any number of threads may decode from one document.
+ */
+int sdtid_doc_new(const char *in, struct sdtid_doc **out);
+int sdtid_doc_count(const struct sdtid_doc *d);
+struct sdtid_doc *sdtid_doc_get(struct sdtid_doc *d);
+void sdtid_doc_put(struct sdtid_doc *d);
+int sdtid_decode_doc(struct sdtid_doc *d, struct securid_token *t, int which);
+
+/*
+ * A compiled template can be shared by any number of sdtid_issue_tpl() /
+ * sdtid_export_tpl() calls, including concurrent ones.  FILENAME may be
+ * NULL to use the built-in defaults.
+ */
+int sdtid_template_new(const char *filename, struct sdtid_template **out);
+void sdtid_template_free(struct sdtid_template *tpl);
+int sdtid_issue_tpl(const struct sdtid_template *tpl, const char *pass,
+		    const char *devid, FILE *f);
+int sdtid_export_tpl(const struct sdtid_template *tpl,
+		     struct securid_token *t, const char *pass,
+		     const char *devid, FILE *f);
+
 #endif /* __STOKEN_SDTID_H__ */
@@ -21,18 +21,27 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <tomcrypt.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#include "base64.h"
+#include "crypto.h"
 #include "securid.h"
 #include "sdtid.h"
 
@@ -70,6 +79,8 @@ struct v3_payload {
  * Utility and crypto functions
  ********************************************************************/
 
+static const char hex_digits[] = "0123456789ABCDEF";
+
 static uint8_t hex2nibble(char in)
 {
 	uint8_t ret = in - '0';
@@ -81,104 +92,155 @@ static uint8_t hex2byte(const char *in)
 	return (hex2nibble(in[0]) << 4) | hex2nibble(in[1]);
 }
 
-void aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in, uint8_t *out)
+/*
+ * Reads from the kernel RNG.  PARANOID selects the blocking pool, which is
+ * only used for long lived key material as it can stall if entropy is
+ * limited.
+ */
+static int read_entropy(void *out, int len, int paranoid)
 {
-	symmetric_key skey;
-	uint8_t tmp[AES_BLOCK_SIZE];
+	char *p = out;
+	int fd;
+
+#ifdef HAVE_GETRANDOM
+	while (len) {
+		ssize_t ret = getrandom(p, len, paranoid ? GRND_RANDOM : 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS)
+				break;
+			return ERR_GENERAL;
+		}
+		p += ret;
+		len -= ret;
+	}
+	if (!len)
+		return ERR_NONE;
+#endif
 
-	/* these shouldn't allocate memory or fail */
-	if (rijndael_setup(key, AES_KEY_SIZE, 0, &skey) != CRYPT_OK ||
-	    rijndael_ecb_encrypt(in, tmp, &skey) != CRYPT_OK)
-		abort();
-	rijndael_done(&skey);
+	fd = open(paranoid ? "/dev/random" : "/dev/urandom", O_RDONLY);
+	if (fd < 0)
+		return ERR_GENERAL;
 
-	/* in case "in" and "out" point to the same buffer */
-	memcpy(out, tmp, AES_BLOCK_SIZE);
+	while (len) {
+		ssize_t ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			close(fd);
+			return ERR_GENERAL;
+		}
+		p += ret;
+		len -= ret;
+	}
+	close(fd);
+	return ERR_NONE;
 }
 
-void aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in, uint8_t *out)
+/*
+ * Non-paranoid randomness comes from a per-thread AES-128-CTR generator
+ * seeded from the kernel, so that bulk token generation doesn't make
+ * several syscalls per token.  Every refill begins by replacing the key
+ * with fresh generator output, so earlier output can't be reconstructed
+ * from the current state.  Consumed bytes are wiped from the buffer.
+ */
+static __thread struct rand_state {
+	unsigned int		fork_gen;
+	int			seeded;
+	long			since_reseed;
+	int			avail;
+	uint8_t			key[AES_KEY_SIZE];
+	uint8_t			ctr[AES_BLOCK_SIZE];
+	uint8_t			buf[RAND_BUF_BYTES];
+} rand_state;
+
+/* bumped in the child after fork(), so inherited state gets discarded */
+static unsigned int rand_fork_gen;
+static pthread_once_t rand_once = PTHREAD_ONCE_INIT;
+
+static void rand_atfork_child(void)
 {
-	symmetric_key skey;
-	uint8_t tmp[AES_BLOCK_SIZE];
-
-	if (rijndael_setup(key, AES_KEY_SIZE, 0, &skey) != CRYPT_OK ||
-	    rijndael_ecb_decrypt(in, tmp, &skey) != CRYPT_OK)
-		abort();
-	rijndael_done(&skey);
+	rand_fork_gen++;
+}
 
-	memcpy(out, tmp, AES_BLOCK_SIZE);
+static void rand_init_once(void)
+{
+	pthread_atfork(NULL, NULL, &rand_atfork_child);
 }
 
-static void aes256_cbc_decrypt(const uint8_t *key, const uint8_t *in, int in_len,
-			       const uint8_t *iv, uint8_t *out)
+static void ctr_next(uint8_t *ctr, uint8_t *out)
 {
-	symmetric_key skey;
-	int i, j;
-	uint8_t local_iv[AES_BLOCK_SIZE];
-
-	rijndael_setup(key, AES256_KEY_SIZE, 0, &skey);
-
-	memcpy(local_iv, iv, AES_BLOCK_SIZE);
-	for (i = 0; i < in_len; i += AES_BLOCK_SIZE) {
-		rijndael_ecb_decrypt(in, out, &skey);
-		for (j = 0; j < AES_BLOCK_SIZE; j++)
-			out[j] ^= local_iv[j];
-		memcpy(local_iv, in, AES_BLOCK_SIZE);
-		in += AES_BLOCK_SIZE;
-		out += AES_BLOCK_SIZE;
-	}
-	rijndael_done(&skey);
+	int j;
+
+	for (j = AES_BLOCK_SIZE - 1; j >= 0 && ++ctr[j] == 0; j--)
+		;
+	memcpy(out, ctr, AES_BLOCK_SIZE);
 }
 
-static void aes256_cbc_encrypt(const uint8_t *key, const uint8_t *in, int in_len,
-			       const uint8_t *iv, uint8_t *out)
+static int rand_refill(struct rand_state *rs)
 {
-	symmetric_key skey;
-	int i, j;
-	uint8_t xored_in[AES_BLOCK_SIZE];
+	uint8_t new_key[AES_KEY_SIZE];
+	int i;
 
-	rijndael_setup(key, AES256_KEY_SIZE, 0, &skey);
+	if (!rs->seeded || rs->since_reseed >= RAND_RESEED_BYTES) {
+		uint8_t seed[AES_KEY_SIZE + AES_BLOCK_SIZE];
 
-	for (i = 0; i < in_len; i += AES_BLOCK_SIZE) {
-		for (j = 0; j < AES_BLOCK_SIZE; j++) {
-			xored_in[j] = in[j] ^
-				      (i ? out[j - AES_BLOCK_SIZE] : iv[j]);
-		}
-		rijndael_ecb_encrypt(xored_in, out, &skey);
-		in += AES_BLOCK_SIZE;
-		out += AES_BLOCK_SIZE;
+		if (read_entropy(seed, sizeof(seed), 0) != ERR_NONE)
+			return ERR_GENERAL;
+		memcpy(rs->key, seed, AES_KEY_SIZE);
+		memcpy(rs->ctr, &seed[AES_KEY_SIZE], AES_BLOCK_SIZE);
+		memset(seed, 0, sizeof(seed));
+
+		rs->seeded = 1;
+		rs->since_reseed = 0;
 	}
-	rijndael_done(&skey);
+
+	/* the first block replaces the key; the rest is output */
+	ctr_next(rs->ctr, new_key);
+	for (i = 0; i < RAND_BUF_BYTES; i += AES_BLOCK_SIZE)
+		ctr_next(rs->ctr, &rs->buf[i]);
+	crypto->aes128_ecb_encrypt(rs->key, new_key, new_key, 1);
+	crypto->aes128_ecb_encrypt(rs->key, rs->buf, rs->buf,
+				   RAND_BUF_BYTES / AES_BLOCK_SIZE);
+
+	memcpy(rs->key, new_key, AES_KEY_SIZE);
+	memset(new_key, 0, sizeof(new_key));
+
+	rs->avail = RAND_BUF_BYTES;
+	rs->since_reseed += RAND_BUF_BYTES;
+	return ERR_NONE;
 }
 
 int securid_rand(void *out, int len, int paranoid)
 {
-	if (paranoid) {
-		/*
-		 * Use /dev/random for long lived key material but not for
-		 * test purposes.  This can block for a long time if entropy
-		 * is limited.
-		 */
-		int fd;
-		char *p = out;
+	struct rand_state *rs = &rand_state;
+	char *p = out;
 
-		fd = open("/dev/random", O_RDONLY);
-		if (fd < 0)
-			return ERR_GENERAL;
+	if (paranoid)
+		return read_entropy(out, len, 1);
 
-		while (len) {
-			ssize_t ret = read(fd, p, len);
-			if (ret < 0) {
-				close(fd);
-				return ERR_GENERAL;
-			}
-			p += ret;
-			len -= ret;
-		}
-		close(fd);
-	} else {
-		if (rng_get_bytes(out, len, NULL) != len)
+	pthread_once(&rand_once, &rand_init_once);
+	if (rs->fork_gen != rand_fork_gen) {
+		memset(rs, 0, sizeof(*rs));
+		rs->fork_gen = rand_fork_gen;
+	}
+
+	while (len) {
+		uint8_t *src;
+		int n;
+
+		if (!rs->avail && rand_refill(rs) != ERR_NONE)
 			return ERR_GENERAL;
+
+		n = len < rs->avail ? len : rs->avail;
+		src = &rs->buf[RAND_BUF_BYTES - rs->avail];
+		memcpy(p, src, n);
+		memset(src, 0, n);
+
+		p += n;
+		len -= n;
+		rs->avail -= n;
 	}
 	return ERR_NONE;
 }
@@ -236,73 +298,84 @@ static uint16_t securid_shortmac(const uint8_t *in, int in_len)
 	return (hash[0] << 7) | (hash[1] >> 1);
 }
 
-static void sha256_hash(const uint8_t *in, int in_len, uint8_t *out)
-{
-	hash_state md;
-	sha256_init(&md);
-	sha256_process(&md, in, in_len);
-	sha256_done(&md, out);
-}
-
-static void sha256_hmac(const uint8_t *key, int key_len,
-			const uint8_t *msg, int msg_len, uint8_t *out)
+/*
+ * N independent securid_mac() computations.  Each step of the chain is an
+ * AES encryption keyed by that step's input block, so a single MAC is
+ * serial, but step J of all N messages can go through
+ * aes128_ecb_encrypt_multikey() together.  Messages of different lengths
+ * drop out of the batch as they finish.
+ *
+ * Step J of a message uses, as the key: the Jth 16-byte block while more
+ * than 16 bytes remain, then the zero-padded last block, a zero block if
+ * the number of full blocks was odd, the length padding, and finally the
+ * chaining value itself.
+ */
+static void securid_mac_multi(const uint8_t *const *in, const int *in_len,
+			      int n, uint8_t (*out)[AES_BLOCK_SIZE])
 {
-	hash_state md;
-	uint8_t tmp_key[SHA256_HASH_SIZE], o_key_pad[SHA256_BLOCK_SIZE],
-		i_key_pad[SHA256_BLOCK_SIZE], inner_hash[SHA256_BLOCK_SIZE];
-	int i;
+	uint8_t lastblk[MAC_LANES][AES_BLOCK_SIZE], pad[MAC_LANES][AES_BLOCK_SIZE];
+	uint8_t keys[MAC_LANES][AES_BLOCK_SIZE], enc[MAC_LANES][AES_BLOCK_SIZE];
+	int full[MAC_LANES], steps[MAC_LANES], idx[MAC_LANES];
+	int base, i, j, k, m, max_steps;
+
+	for (base = 0; base < n; base += MAC_LANES, in += MAC_LANES,
+	     in_len += MAC_LANES, out += MAC_LANES) {
+		int lanes = n - base < MAC_LANES ? n - base : MAC_LANES;
+
+		max_steps = 0;
+		for (i = 0; i < lanes; i++) {
+			uint8_t *p = &pad[i][AES_BLOCK_SIZE - 1];
+
+			full[i] = in_len[i] ? (in_len[i] - 1) / AES_BLOCK_SIZE : 0;
+			steps[i] = full[i] + (full[i] & 1) + 3;
+			if (steps[i] > max_steps)
+				max_steps = steps[i];
+
+			memset(lastblk[i], 0, AES_BLOCK_SIZE);
+			memcpy(lastblk[i], &in[i][full[i] * AES_BLOCK_SIZE],
+			       in_len[i] - full[i] * AES_BLOCK_SIZE);
+			memset(pad[i], 0, AES_BLOCK_SIZE);
+			for (k = in_len[i] * 8; k > 0; k >>= 8)
+				*(p--) = (uint8_t)k;
+			memset(out[i], 0xff, AES_BLOCK_SIZE);
+		}
 
-	if (key_len > SHA256_BLOCK_SIZE) {
-		sha256_hash(key, key_len, tmp_key);
-		key = tmp_key;
-		key_len = SHA256_HASH_SIZE;
-	}
+		for (j = 0; j < max_steps; j++) {
+			for (i = 0, m = 0; i < lanes; i++) {
+				const uint8_t *key;
+				int odd = full[i] & 1;
+
+				if (j >= steps[i])
+					continue;
+				if (j < full[i])
+					key = &in[i][j * AES_BLOCK_SIZE];
+				else if (j == full[i])
+					key = lastblk[i];
+				else if (odd && j == full[i] + 1)
+					key = NULL;
+				else if (j == full[i] + odd + 1)
+					key = pad[i];
+				else
+					key = out[i];
+
+				if (key)
+					memcpy(keys[m], key, AES_BLOCK_SIZE);
+				else
+					memset(keys[m], 0, AES_BLOCK_SIZE);
+				memcpy(enc[m], out[i], AES_BLOCK_SIZE);
+				idx[m++] = i;
+			}
 
-	memset(o_key_pad, 0x5c, SHA256_BLOCK_SIZE);
-	memset(i_key_pad, 0x36, SHA256_BLOCK_SIZE);
-	for (i = 0; i < key_len; i++) {
-		o_key_pad[i] ^= key[i];
-		i_key_pad[i] ^= key[i];
+			aes128_ecb_encrypt_multikey(keys[0], enc[0], enc[0], m);
+			for (k = 0; k < m; k++)
+				for (i = 0; i < AES_BLOCK_SIZE; i++)
+					out[idx[k]][i] ^= enc[k][i];
+		}
 	}
-
-	sha256_init(&md);
-	sha256_process(&md, i_key_pad, SHA256_BLOCK_SIZE);
-	sha256_process(&md, msg, msg_len);
-	sha256_done(&md, inner_hash);
-
-	sha256_init(&md);
-	sha256_process(&md, o_key_pad, SHA256_BLOCK_SIZE);
-	sha256_process(&md, inner_hash, SHA256_HASH_SIZE);
-	sha256_done(&md, out);
+	memset(keys, 0, sizeof(keys));
+	memset(lastblk, 0, sizeof(lastblk));
 }
 
-static void sha256_pbkdf2(const uint8_t *pass, int pass_len,
-			  const uint8_t *salt, int salt_len,
-			  int n_rounds, uint8_t *key_out)
-{
-	uint8_t *ext_salt;
-	uint8_t hash[SHA256_HASH_SIZE];
-	int i, round;
-
-	ext_salt = alloca(salt_len + 4);
-	memcpy(ext_salt, salt, salt_len);
-
-	/* always 0x00000001, as the output size is fixed at SHA256_HASH_SIZE */
-	ext_salt[salt_len + 0] = 0;
-	ext_salt[salt_len + 1] = 0;
-	ext_salt[salt_len + 2] = 0;
-	ext_salt[salt_len + 3] = 1;
-
-	sha256_hmac(pass, pass_len, ext_salt, salt_len + 4, key_out);
-	memcpy(hash, key_out, SHA256_HASH_SIZE);
-
-	for (round = 2; round <= n_rounds; round++) {
-		sha256_hmac(pass, pass_len, hash, SHA256_HASH_SIZE, hash);
-
-		for (i = 0; i < SHA256_HASH_SIZE; i++)
-			key_out[i] ^= hash[i];
-	}
-}
 
 /********************************************************************
  * V1/V2 token handling
@@ -384,22 +457,19 @@ static void set_bits(uint8_t *out, unsigned int start, int n_bits, uint32_t val)
 	}
 }
 
-static int v2_decode_token(const char *in, struct securid_token *t)
+/* the last 5 digits provide a checksum for the rest of the string */
+static uint16_t v2_token_mac(const char *in, int len)
 {
-	uint8_t d[MAX_TOKEN_BITS / 8 + 2];
-	int len = strlen(in);
-	uint16_t token_mac, computed_mac;
+	uint8_t d[3];
 
-	if (len < MIN_TOKEN_CHARS || len > MAX_TOKEN_CHARS)
-		return ERR_BAD_LEN;
-
-	/* the last 5 digits provide a checksum for the rest of the string */
 	numinput_to_bits(&in[len - CHECKSUM_CHARS], d, 15);
-	token_mac = get_bits(d, 0, 15);
-	computed_mac = securid_shortmac(in, len - CHECKSUM_CHARS);
+	return get_bits(d, 0, 15);
+}
 
-	if (token_mac != computed_mac)
-		return ERR_CHECKSUM_FAILED;
+/* the rest of v2_decode_token(), once the checksum has been verified */
+static int v2_decode_fields(const char *in, struct securid_token *t)
+{
+	uint8_t d[MAX_TOKEN_BITS / 8 + 2];
 
 	t->version = in[0] - '0';
 	memcpy(&t->serial, &in[VER_CHARS], SERIAL_CHARS);
@@ -417,12 +487,163 @@ static int v2_decode_token(const char *in, struct securid_token *t)
 	return ERR_NONE;
 }
 
+static int v2_decode_token(const char *in, struct securid_token *t)
+{
+	int len = strlen(in);
+
+	if (len < MIN_TOKEN_CHARS || len > MAX_TOKEN_CHARS)
+		return ERR_BAD_LEN;
+	if (v2_token_mac(in, len) !=
+	    securid_shortmac((const uint8_t *)in, len - CHECKSUM_CHARS))
+		return ERR_CHECKSUM_FAILED;
+	return v2_decode_fields(in, t);
+}
+
+/*
+ * Copy the characters of DEVID that contribute to the v2 key hash into OUT,
+ * returning the count.
+ *
+ * For iPhone/Android ctf strings, the device ID takes up 40 bytes and
+ * consists of hex digits + zero padding.
+ *
+ * For other ctf strings (e.g. --blocks), the device ID takes up 32 bytes
+ * and consists of decimal digits + zero padding.
+ */
+static int v2_scrub_devid(const struct securid_token *t, const char *devid,
+			  uint8_t *out)
+{
+	int pos = 0, len = 0, devid_len = t->is_smartphone ? 40 : 32;
+
+	for (; devid && *devid; devid++) {
+		if (++len > devid_len)
+			break;
+		if ((t->version == 1 && isdigit(*devid)) ||
+		    (t->version >= 2 && !isxdigit(*devid)))
+			continue;
+		out[pos++] = toupper(*devid);
+	}
+	return pos;
+}
+
+/* the 15-bit device ID hash stored in v2 ctf strings */
+static uint16_t v2_devid_hash(const struct securid_token *t, const char *devid)
+{
+	uint8_t buf[DEVID_CHARS];
+
+	memset(buf, 0, sizeof(buf));
+	v2_scrub_devid(t, devid, buf);
+	return securid_shortmac(buf, t->is_smartphone ? 40 : 32);
+}
+
+struct key_cache_entry {
+	int			valid;
+	int			len;
+	int			pass_len;
+	int			devid_len;
+	uint8_t			key[MAX_PASS + DEVID_CHARS];
+
+	uint8_t			key_hash[AES_BLOCK_SIZE];
+	uint16_t		device_id_hash;
+};
+
+struct securid_key_cache {
+	pthread_mutex_t		lock;
+	int			next;
+	struct key_cache_entry	entries[KEY_CACHE_SLOTS];
+};
+
+int securid_lock_pages(void *p, size_t len)
+{
+#ifdef MADV_DONTDUMP
+	madvise(p, len, MADV_DONTDUMP);
+#endif
+	return mlock(p, len) == 0;
+}
+
+struct securid_key_cache *securid_key_cache_new(void)
+{
+	struct securid_key_cache *c;
+
+	c = mmap(NULL, sizeof(*c), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED)
+		return NULL;
+
+	/* best effort: the cache is still usable if this fails */
+	securid_lock_pages(c, sizeof(*c));
+
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+void securid_key_cache_free(struct securid_key_cache *c)
+{
+	if (!c)
+		return;
+	pthread_mutex_destroy(&c->lock);
+	memset(c, 0, sizeof(*c));
+	munlock(c, sizeof(*c));
+	munmap(c, sizeof(*c));
+}
+
+/*
+ * KEY holds the password and scrubbed devid (LEN bytes total).  Together
+ * with the pass/devid split and the devid field width, it fully determines
+ * both outputs of generate_key_hash().
+ */
+static int key_cache_lookup(struct securid_key_cache *c, const uint8_t *key,
+	int len, int pass_len, int devid_len, uint8_t *key_hash,
+	uint16_t *device_id_hash)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < KEY_CACHE_SLOTS; i++) {
+		struct key_cache_entry *e = &c->entries[i];
+
+		if (e->valid && e->len == len && e->pass_len == pass_len &&
+		    e->devid_len == devid_len && !memcmp(e->key, key, len)) {
+			memcpy(key_hash, e->key_hash, AES_BLOCK_SIZE);
+			if (device_id_hash)
+				*device_id_hash = e->device_id_hash;
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+static void key_cache_store(struct securid_key_cache *c, const uint8_t *key,
+	int len, int pass_len, int devid_len, const uint8_t *key_hash,
+	uint16_t device_id_hash)
+{
+	struct key_cache_entry *e;
+
+	pthread_mutex_lock(&c->lock);
+	e = &c->entries[c->next];
+	c->next = (c->next + 1) % KEY_CACHE_SLOTS;
+
+	e->valid = 1;
+	e->len = len;
+	e->pass_len = pass_len;
+	e->devid_len = devid_len;
+	memcpy(e->key, key, len);
+	memcpy(e->key_hash, key_hash, AES_BLOCK_SIZE);
+	e->device_id_hash = device_id_hash;
+	pthread_mutex_unlock(&c->lock);
+}
+
 static int generate_key_hash(uint8_t *key_hash, const char *pass,
 	const char *devid, uint16_t *device_id_hash, struct securid_token *t)
 {
 	uint8_t key[MAX_PASS + DEVID_CHARS + MAGIC_LEN + 1], *devid_buf;
-	int pos = 0, devid_len = t->is_smartphone ? 40 : 32;
+	int pos = 0, pass_len, devid_len = t->is_smartphone ? 40 : 32;
 	const uint8_t magic[] = { 0xd8, 0xf5, 0x32, 0x53, 0x82, 0x89, 0x00 };
+	uint8_t mac_out[2][AES_BLOCK_SIZE], devid_copy[DEVID_CHARS];
+	const uint8_t *mac_in[2];
+	int mac_len[2];
+	uint16_t computed_hash;
 
 	memset(key, 0, sizeof(key));
 
@@ -432,36 +653,48 @@ static int generate_key_hash(uint8_t *key_hash, const char *pass,
 			return ERR_BAD_PASSWORD;
 		memcpy(key, pass, pos);
 	}
+	pass_len = pos;
 
+	/*
+	 * If this seed isn't locked to a device, we'll just hash 40 (or 32)
+	 * zero bytes, below.
+	 */
 	devid_buf = &key[pos];
-	if (devid) {
-		int len = 0;
+	pos += v2_scrub_devid(t, devid, devid_buf);
 
-		/*
-		 * For iPhone/Android ctf strings, the device ID takes up
-		 * 40 bytes and consists of hex digits + zero padding.
-		 *
-		 * For other ctf strings (e.g. --blocks), the device ID takes
-		 * up 32 bytes and consists of decimal digits + zero padding.
-		 *
-		 * If this seed isn't locked to a device, we'll just hash
-		 * 40 (or 32) zero bytes, below.
-		 */
-		for (; *devid; devid++) {
-			if (++len > devid_len)
-				break;
-			if ((t->version == 1 && isdigit(*devid)) ||
-			    (t->version >= 2 && !isxdigit(*devid)))
-				continue;
-			key[pos++] = toupper(*devid);
-		}
+	if (t->key_cache &&
+	    key_cache_lookup(t->key_cache, key, pos, pass_len, devid_len,
+			     key_hash, device_id_hash)) {
+		memset(key, 0, sizeof(key));
+		return ERR_NONE;
 	}
-	if (device_id_hash)
-		*device_id_hash = securid_shortmac(devid_buf, devid_len);
 
+	/*
+	 * The devid hash and the key hash are independent, so run them
+	 * together.  The magic overwrites part of the zero-padded devid, so
+	 * the devid hash gets its own copy.
+	 */
+	memcpy(devid_copy, devid_buf, devid_len);
 	memcpy(&key[pos], magic, MAGIC_LEN);
-	securid_mac(key, pos + MAGIC_LEN, key_hash);
+	mac_in[0] = devid_copy;
+	mac_len[0] = devid_len;
+	mac_in[1] = key;
+	mac_len[1] = pos + MAGIC_LEN;
+	securid_mac_multi(mac_in, mac_len, 2, mac_out);
+
+	computed_hash = (mac_out[0][0] << 7) | (mac_out[0][1] >> 1);
+	if (device_id_hash)
+		*device_id_hash = computed_hash;
+	memcpy(key_hash, mac_out[1], AES_BLOCK_SIZE);
+	memset(mac_out, 0, sizeof(mac_out));
+	memset(devid_copy, 0, sizeof(devid_copy));
+
+	/* the first POS bytes of KEY are still the pass + devid */
+	if (t->key_cache)
+		key_cache_store(t->key_cache, key, pos, pass_len, devid_len,
+				key_hash, computed_hash);
 
+	memset(key, 0, sizeof(key));
 	return ERR_NONE;
 }
 
@@ -507,15 +740,117 @@ static void key_from_time(const uint8_t *bcd_time, int bcd_time_bytes,
 			    (serial[i + 1] - '0');
 }
 
-static void bcd_write(uint8_t *out, int val, unsigned int bytes)
+/* BCD encodings of 0-99, so that building a time key needs no division */
+static const uint8_t bcd_tab[100] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+};
+
+/* INTERVAL is a constant in every caller but one, so let it fold */
+static inline __attribute__((always_inline))
+void time_keys(const time_t *now, int n, int interval,
+	       struct securid_time_key *out)
 {
-	out += bytes - 1;
-	for (; bytes; bytes--) {
-		*out = val % 10;
-		val /= 10;
-		*(out--) |= (val % 10) << 4;
-		val /= 10;
+	int i, min_mask = interval == 30 ? ~0x01 : ~0x03;
+	long last_days = LONG_MIN;
+	uint8_t ymd[4] = { 0 };
+
+	for (i = 0; i < n; i++, out++) {
+		long days = now[i] / 86400, secs = now[i] % 86400;
+		int hour, min, sec;
+
+		/* gmtime() rounds toward negative infinity */
+		if (secs < 0) {
+			secs += 86400;
+			days--;
+		}
+
+		/*
+		 * Tokencodes are nearly always requested for nearby times, so
+		 * the civil date only needs to be recomputed on day rollover.
+		 * This is the usual days -> (y, m, d) conversion on 400-year
+		 * eras, with March as the first month of the computational
+		 * year so that leap days land at the end.
+		 */
+		if (days != last_days) {
+			long z = days + 719468;
+			long era = (z >= 0 ? z : z - 146096) / 146097;
+			long doe = z - era * 146097;
+			long yoe = (doe - doe / 1460 + doe / 36524 -
+				    doe / 146096) / 365;
+			long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+			long mp = (5 * doy + 2) / 153;
+			int mday = doy - (153 * mp + 2) / 5 + 1;
+			int mon = mp < 10 ? mp + 3 : mp - 9;
+			long year = yoe + era * 400 + (mon <= 2);
+
+			ymd[0] = bcd_tab[(year / 100) % 100];
+			ymd[1] = bcd_tab[year % 100];
+			ymd[2] = bcd_tab[mon];
+			ymd[3] = bcd_tab[mday];
+			last_days = days;
+		}
+
+		hour = secs / 3600;
+		min = (secs / 60) % 60;
+		sec = secs % 60;
+
+		memcpy(out->bcd_time, ymd, 4);
+		out->bcd_time[4] = bcd_tab[hour];
+		out->bcd_time[5] = bcd_tab[min & min_mask];
+		out->bcd_time[6] = out->bcd_time[7] = 0;
+
+		/* each AES output block contains 4 consecutive token codes */
+		if (interval == 30)
+			out->blk = ((min & 0x01) << 3) | ((sec >= 30) << 2);
+		else
+			out->blk = (min & 0x03) << 2;
+	}
+}
+
+void securid_time_keys(const time_t *now, int n, int interval,
+		       struct securid_time_key *out)
+{
+	time_keys(now, n, interval, out);
+}
+
+/*
+ * The tokencode is derived through a chain of 5 AES operations, keyed off
+ * successively longer prefixes of the BCD time: year, month, day, hour and
+ * the minute block.  Consecutive time keys share most of the chain, so
+ * keep the intermediate keys around and only redo the levels whose prefix
+ * changed.
+ */
+static const int chain_bcd_bytes[CHAIN_LEVELS] = { 2, 3, 4, 5, 8 };
+
+static const uint8_t *chain_update(const struct securid_token *t,
+				   struct securid_chain *chain,
+				   const uint8_t *bcd_time)
+{
+	int i;
+
+	for (i = 0; i < chain->levels; i++)
+		if (memcmp(chain->bcd_time, bcd_time, chain_bcd_bytes[i]))
+			break;
+
+	memcpy(chain->bcd_time, bcd_time, sizeof(chain->bcd_time));
+	for (; i < CHAIN_LEVELS; i++) {
+		key_from_time(bcd_time, chain_bcd_bytes[i], t->serial,
+			      chain->key[i]);
+		aes128_ecb_encrypt(i ? chain->key[i - 1] : t->dec_seed,
+				   chain->key[i], chain->key[i]);
 	}
+	chain->levels = CHAIN_LEVELS;
+
+	return chain->key[CHAIN_LEVELS - 1];
 }
 
 static int v2_encode_token(struct securid_token *t, const char *pass,
@@ -551,10 +886,16 @@ static int v2_encode_token(struct securid_token *t, const char *pass,
  * V3 token handling
  ********************************************************************/
 
-static void v3_derive_key(const char *pass, const char *devid, const uint8_t *salt,
-			  int key_id, uint8_t *out)
+#define V3_PBKDF2_ROUNDS	1000
+/* longest PBKDF2 password v3_kdf_pass() builds, for a MAX_PASS password */
+#define V3_KDF_PASS_MAX		((V3_DEVID_CHARS + 16 + V3_NONCE_BYTES + \
+				  MAX_PASS) >> 1)
+
+/* build the PBKDF2 password for key KEY_ID in OUT, and return its length */
+static int v3_kdf_pass(const char *pass, const char *devid,
+		       const uint8_t *salt, int key_id, uint8_t *out)
 {
-	uint8_t *buf0, *buf1;
+	uint8_t *buf0;
 	int pass_len = pass ? strlen(pass) : 0;
 	int buf_len = V3_DEVID_CHARS + 16 + V3_NONCE_BYTES + pass_len;
 	unsigned int i;
@@ -564,7 +905,6 @@ static void v3_derive_key(const char *pass, const char *devid, const uint8_t *sa
 				 0x81, 0x60, 0xde, 0x44, 0x4e, 0x05, 0xc0, 0xdd };
 
 	buf0 = alloca(buf_len);
-	buf1 = alloca(buf_len >> 1);
 
 	memset(buf0, 0, buf_len);
 
@@ -577,9 +917,23 @@ static void v3_derive_key(const char *pass, const char *devid, const uint8_t *sa
 
 	/* yup, the PBKDF2 password is really "every 2nd byte of the input" */
 	for (i = 1; i < buf_len; i += 2)
-		buf1[i >> 1] = buf0[i];
+		out[i >> 1] = buf0[i];
 
-	sha256_pbkdf2(buf1, buf_len >> 1, salt, V3_NONCE_BYTES, 1000, out);
+	memset(buf0, 0, buf_len);
+	return buf_len >> 1;
+}
+
+static void v3_derive_key(const char *pass, const char *devid, const uint8_t *salt,
+			  int key_id, uint8_t *out)
+{
+	int pass_len = pass ? strlen(pass) : 0;
+	uint8_t *buf1 = alloca((V3_DEVID_CHARS + 16 + V3_NONCE_BYTES +
+				pass_len) >> 1);
+	int len = v3_kdf_pass(pass, devid, salt, key_id, buf1);
+
+	crypto->pbkdf2_sha256(buf1, len, salt, V3_NONCE_BYTES,
+			      V3_PBKDF2_ROUNDS, out);
+	memset(buf1, 0, len);
 }
 
 static int v3_decode_token(const char *in, struct securid_token *t)
@@ -608,8 +962,8 @@ static int v3_decode_token(const char *in, struct securid_token *t)
 	if (!t->v3)
 		return ERR_NO_MEMORY;
 
-	if (base64_decode(decoded, strlen(decoded),
-			  (void *)t->v3, &actual) != CRYPT_OK ||
+	if (b64_decode(decoded, strlen(decoded), (void *)t->v3,
+		       &actual) != ERR_NONE ||
 	    actual != sizeof(struct v3_token) ||
 	    t->v3->version != 0x03) {
 		free(t->v3);
@@ -670,14 +1024,19 @@ static void v3_compute_hash(const char *pass, const char *devid,
 	sha256_hash(hash_buf, V3_NONCE_BYTES + V3_DEVID_CHARS + pass_len, hash);
 }
 
+static void v3_mac(struct v3_token *v3, const uint8_t *key, uint8_t *out)
+{
+	crypto->hmac_sha256(key, SHA256_HASH_SIZE,
+			    (void *)v3, sizeof(*v3) - SHA256_HASH_SIZE, out);
+}
+
 static void v3_compute_hmac(struct v3_token *v3, const char *pass,
 			    const char *devid, uint8_t *out)
 {
 	uint8_t hash[SHA256_HASH_SIZE];
 
 	v3_derive_key(pass, devid, v3->nonce, 0, hash);
-	sha256_hmac(hash, SHA256_HASH_SIZE,
-		    (void *)v3, sizeof(*v3) - SHA256_HASH_SIZE, out);
+	v3_mac(v3, hash, out);
 }
 
 static void v3_scrub_devid(const char *in, char *out)
@@ -734,63 +1093,99 @@ static int v3_decrypt_seed(struct securid_token *t,
 	return ERR_NONE;
 }
 
-static int v3_encode_token(struct securid_token *t, const char *pass,
-			   const char *raw_devid, char *out)
+/* a v3 token being encoded, between picking its nonce and its keys */
+struct v3_enc {
+	struct v3_payload	payload;
+	struct v3_token		v3;
+	const char		*pass;
+	char			devid[V3_DEVID_CHARS + 1];
+};
+
+static int v3_encode_begin(const struct securid_token *t, const char *pass,
+			   const char *raw_devid, struct v3_enc *e)
 {
-	struct v3_payload payload;
-	struct v3_token v3;
-	uint8_t key[SHA256_HASH_SIZE];
-	unsigned long enclen = V3_BASE64_SIZE;
-	char raw_b64[V3_BASE64_SIZE];
-	char devid[V3_DEVID_CHARS + 1];
-	int i;
+	struct v3_payload *payload = &e->payload;
 
-	memset(&payload, 0, sizeof(payload));
-	strncpy(payload.serial, t->serial, sizeof(payload.serial));
-	memcpy(payload.dec_seed, t->dec_seed, AES_KEY_SIZE);
-	payload.unk0[0] = payload.unk0[1] = 1;
-	payload.mode = !!(t->flags & FL_FEAT4);
-	payload.digits = ((t->flags & FLD_DIGIT_MASK) >> FLD_DIGIT_SHIFT) + 1;
-	payload.addpin = (t->flags & (0x2 << FLD_PINMODE_SHIFT)) ?
-			 V3_ADDPIN_ON : V3_ADDPIN_OFF;
-	payload.interval = (t->flags & FLD_NUMSECONDS_MASK) ? 60 : 30;
+	memset(payload, 0, sizeof(*payload));
+	strncpy(payload->serial, t->serial, sizeof(payload->serial));
+	memcpy(payload->dec_seed, t->dec_seed, AES_KEY_SIZE);
+	payload->unk0[0] = payload->unk0[1] = 1;
+	payload->mode = !!(t->flags & FL_FEAT4);
+	payload->digits = ((t->flags & FLD_DIGIT_MASK) >> FLD_DIGIT_SHIFT) + 1;
+	payload->addpin = (t->flags & (0x2 << FLD_PINMODE_SHIFT)) ?
+			  V3_ADDPIN_ON : V3_ADDPIN_OFF;
+	payload->interval = (t->flags & FLD_NUMSECONDS_MASK) ? 60 : 30;
 
-	v3_encode_date(payload.exp_date, t->exp_date);
+	v3_encode_date(payload->exp_date, t->exp_date);
 
-	memset(payload.padding, 0x10, 0x10);
+	memset(payload->padding, 0x10, 0x10);
 
-	memset(&v3, 0, sizeof(v3));
-	if (securid_rand(v3.nonce, sizeof(v3.nonce), 0))
+	memset(&e->v3, 0, sizeof(e->v3));
+	if (securid_rand(e->v3.nonce, sizeof(e->v3.nonce), 0))
 		return ERR_GENERAL;
 
-	v3.version = 3;
-	v3.password_locked = !!pass;
-	v3.devid_locked = !!raw_devid;
+	e->v3.version = 3;
+	e->v3.password_locked = !!pass;
+	e->v3.devid_locked = !!raw_devid;
 
-	v3_scrub_devid(raw_devid, devid);
-	v3_derive_key(pass, devid, v3.nonce, 1, key);
-	aes256_cbc_encrypt(key, (void *)&payload, sizeof(struct v3_payload),
-			   v3.nonce, v3.enc_payload);
+	e->pass = pass;
+	v3_scrub_devid(raw_devid, e->devid);
+	return ERR_NONE;
+}
+
+/* ENC_KEY and MAC_KEY are v3_derive_key() key IDs 1 and 0 */
+static void v3_encode_finish(struct v3_enc *e, const uint8_t *enc_key,
+			     const uint8_t *mac_key, char *out)
+{
+	struct v3_token *v3 = &e->v3;
+	unsigned long enclen = V3_BASE64_SIZE;
+	char raw_b64[V3_BASE64_SIZE];
+	int i;
 
-	v3_compute_hash(NULL, devid, v3.nonce, v3.nonce_devid_hash);
-	v3_compute_hash(pass, devid, v3.nonce, v3.nonce_devid_pass_hash);
-	v3_compute_hmac(&v3, pass, devid, v3.mac);
+	aes256_cbc_encrypt(enc_key, (void *)&e->payload,
+			   sizeof(struct v3_payload), v3->nonce,
+			   v3->enc_payload);
+	memset(&e->payload, 0, sizeof(e->payload));
 
-	base64_encode((void *)&v3, sizeof(v3), raw_b64, &enclen);
+	v3_compute_hash(NULL, e->devid, v3->nonce, v3->nonce_devid_hash);
+	v3_compute_hash(e->pass, e->devid, v3->nonce,
+			v3->nonce_devid_pass_hash);
+	v3_mac(v3, mac_key, v3->mac);
 
+	b64_encode((void *)v3, sizeof(*v3), raw_b64, &enclen);
+
+	/* URL-escape the non-alphanumeric base64 characters: + / = */
 	for (i = 0; i < enclen; i++) {
-		char c = raw_b64[i];
+		uint8_t c = raw_b64[i];
 		if (!isalnum(c)) {
-			sprintf(out, "%%%02X", c);
-			out += 3;
+			*(out++) = '%';
+			*(out++) = hex_digits[c >> 4];
+			*(out++) = hex_digits[c & 0x0f];
 		} else
 			*(out++) = c;
 	}
 	*out = 0;
-
-	return ERR_NONE;
 }
 
+static int v3_encode_token(struct securid_token *t, const char *pass,
+			   const char *raw_devid, char *out)
+{
+	struct v3_enc e;
+	uint8_t enc_key[SHA256_HASH_SIZE], mac_key[SHA256_HASH_SIZE];
+	int rc;
+
+	rc = v3_encode_begin(t, pass, raw_devid, &e);
+	if (rc == ERR_NONE) {
+		v3_derive_key(pass, e.devid, e.v3.nonce, 1, enc_key);
+		v3_derive_key(pass, e.devid, e.v3.nonce, 0, mac_key);
+		v3_encode_finish(&e, enc_key, mac_key, out);
+	}
+
+	memset(&e, 0, sizeof(e));
+	memset(enc_key, 0, sizeof(enc_key));
+	memset(mac_key, 0, sizeof(mac_key));
+	return rc;
+}
 
 /********************************************************************
  * Public functions
@@ -811,9 +1206,55 @@ int securid_decode_token(const char *in, struct securid_token *t)
 		return ERR_TOKEN_VERSION;
 }
 
+void securid_decode_tokens(const char *const *in, int n,
+			   struct securid_token *t, int *rc)
+{
+	const uint8_t *mac_in[MAC_LANES];
+	uint8_t mac_out[MAC_LANES][AES_BLOCK_SIZE];
+	int mac_len[MAC_LANES], idx[MAC_LANES];
+	int base, i, m;
+
+	for (base = 0; base < n; base += MAC_LANES) {
+		int lanes = n - base < MAC_LANES ? n - base : MAC_LANES;
+
+		/* checksum every v2 string of this group in one batch */
+		for (i = base, m = 0; i < base + lanes; i++) {
+			int len = strlen(in[i]);
+
+			if (in[i][0] != '1' && in[i][0] != '2') {
+				rc[i] = securid_decode_token(in[i], &t[i]);
+				continue;
+			}
+			if (len < MIN_TOKEN_CHARS || len > MAX_TOKEN_CHARS) {
+				rc[i] = ERR_BAD_LEN;
+				continue;
+			}
+			mac_in[m] = (const uint8_t *)in[i];
+			mac_len[m] = len - CHECKSUM_CHARS;
+			idx[m++] = i;
+		}
+		securid_mac_multi(mac_in, mac_len, m, mac_out);
+
+		for (i = 0; i < m; i++) {
+			const char *s = in[idx[i]];
+			uint16_t mac = (mac_out[i][0] << 7) |
+				       (mac_out[i][1] >> 1);
+
+			if (mac != v2_token_mac(s, mac_len[i] + CHECKSUM_CHARS))
+				rc[idx[i]] = ERR_CHECKSUM_FAILED;
+			else
+				rc[idx[i]] = v2_decode_fields(s, &t[idx[i]]);
+		}
+	}
+}
+
 int securid_decrypt_seed(struct securid_token *t, const char *pass,
 			 const char *devid)
 {
+	/* the sdtid document or v3 blob that it would need is gone */
+	if (t->finalized)
+		return ERR_GENERAL;
+
 	if (t->flags & FL_PASSPROT) {
 		if (!pass || !strlen(pass))
 			return ERR_MISSING_PASSWORD;
@@ -839,87 +1280,411 @@ int securid_decrypt_seed(struct securid_token *t, const char *pass,
 
 int securid_check_devid(struct securid_token *t, const char *devid)
 {
-	int ret = securid_decrypt_seed(t, ".", devid);
+	int ret;
+
+	if (t->finalized)
+		return ERR_GENERAL;
+	ret = securid_decrypt_seed(t, ".", devid);
 	if (ret == ERR_BAD_DEVID || ret == ERR_MISSING_PASSWORD)
 		return ERR_BAD_DEVID;
 	else
 		return ERR_NONE;
 }
 
-void securid_compute_tokencode(struct securid_token *t, time_t now,
-			       char *code_out)
+void securid_finalize_token(struct securid_token *t)
 {
-	uint8_t bcd_time[8];
-	uint8_t key0[AES_KEY_SIZE], key1[AES_KEY_SIZE];
-	int i, j;
-	uint32_t tokencode;
-	struct tm gmt;
-	int pin_len = strlen(t->pin);
-	int is_30 = securid_token_interval(t) == 30;
-
-	gmtime_r(&now, &gmt);
-	bcd_write(&bcd_time[0], gmt.tm_year + 1900, 2);
-	bcd_write(&bcd_time[2], gmt.tm_mon + 1, 1);
-	bcd_write(&bcd_time[3], gmt.tm_mday, 1);
-	bcd_write(&bcd_time[4], gmt.tm_hour, 1);
-	bcd_write(&bcd_time[5], gmt.tm_min & ~(is_30 ? 0x01 : 0x03), 1);
-	bcd_time[6] = bcd_time[7] = 0;
-
-	key_from_time(bcd_time, 2, t->serial, key0);
-	aes128_ecb_encrypt(t->dec_seed, key0, key0);
-	key_from_time(bcd_time, 3, t->serial, key1);
-	aes128_ecb_encrypt(key0, key1, key1);
-	key_from_time(bcd_time, 4, t->serial, key0);
-	aes128_ecb_encrypt(key1, key0, key0);
-	key_from_time(bcd_time, 5, t->serial, key1);
-	aes128_ecb_encrypt(key0, key1, key1);
-	key_from_time(bcd_time, 8, t->serial, key0);
-	aes128_ecb_encrypt(key1, key0, key0);
-
-	/* key0 now contains 4 consecutive token codes */
-	if (is_30)
-		i = ((gmt.tm_min & 0x01) << 3) | ((gmt.tm_sec >= 30) << 2);
-	else
-		i = (gmt.tm_min & 0x03) << 2;
+	if (t->v3) {
+		memset(t->v3, 0, sizeof(*t->v3));
+		free(t->v3);
+		t->v3 = NULL;
+	}
+	sdtid_free(t->sdtid);
+	t->sdtid = NULL;
+	t->finalized = 1;
+}
+
+static int devid_matches(const struct securid_token *t, const char *devid)
+{
+	struct securid_token tmp;
+	int ret;
+
+	if (t->v3) {
+		uint8_t hash[SHA256_HASH_SIZE];
+		char buf[V3_DEVID_CHARS + 1];
 
-	tokencode = (key0[i + 0] << 24) | (key0[i + 1] << 16) |
-		    (key0[i + 2] << 8)  | (key0[i + 3] << 0);
+		v3_scrub_devid(devid, buf);
+		v3_compute_hash(NULL, buf, t->v3->nonce, hash);
+		return !memcmp(hash, t->v3->nonce_devid_hash, SHA256_HASH_SIZE);
+	}
+
+	if (v2_devid_hash(t, devid) != t->device_id_hash)
+		return 0;
+	if (t->flags & FL_PASSPROT)
+		return 1;
+
+	/*
+	 * The devid hash is only 15 bits, so a long candidate list will
+	 * produce false positives.  If no password is needed, confirm the
+	 * match against the seed MAC.
+	 */
+	tmp = *t;
+	ret = v2_decrypt_seed(&tmp, NULL, devid);
+	memset(&tmp, 0, sizeof(tmp));
+	return ret == ERR_NONE;
+}
+
+struct devid_scan {
+	const struct securid_token	*t;
+	const char * const		*candidates;
+	/* lowest matching index found so far */
+	int				match;
+};
 
-	/* populate code_out backwards, adding PIN digits if available */
-	j = ((t->flags & FLD_DIGIT_MASK) >> FLD_DIGIT_SHIFT) + 1;
-	code_out[j--] = 0;
-	for (i = 0; j >= 0; j--, i++) {
+static void devid_scan_range(void *arg, int start, int end)
+{
+	struct devid_scan *ds = arg;
+	int i;
+
+	for (i = start; i < end; i++) {
+		/* a lower index already matched; nothing here can win */
+		if (i > __atomic_load_n(&ds->match, __ATOMIC_RELAXED))
+			return;
+		if (devid_matches(ds->t, ds->candidates[i])) {
+			int cur = __atomic_load_n(&ds->match, __ATOMIC_RELAXED);
+
+			while (i < cur &&
+			       !__atomic_compare_exchange_n(&ds->match, &cur, i,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			return;
+		}
+	}
+}
+
+int securid_find_devid(const struct securid_token *t,
+		       const char * const *candidates, int n)
+{
+	struct devid_scan scan;
+
+	if (!(t->flags & FL_SNPROT) || t->sdtid || t->finalized || n <= 0)
+		return -1;
+
+	scan.t = t;
+	scan.candidates = candidates;
+	scan.match = INT_MAX;
+	__stoken_parallel_for(n, DEVID_SCAN_GRAIN, &devid_scan_range, &scan);
+	return scan.match == INT_MAX ? -1 : scan.match;
+}
+
+/***********************************************************************
+ * Tokencode kernels
+ ***********************************************************************/
+
+/*
+ * Each tokencode kernel is specialized for one combination of digit
+ * count, interval, and PIN/no PIN, so the time key math and the digit
+ * loop compile down to straight-line code.  securid_prepare_token() picks
+ * the kernel once and stores it in the token.  Digit counts other than
+ * 6 and 8 are rare, so they share a kernel that reads the count from the
+ * flags.
+ *
+ * The PIN is added digit by digit, modulo 10, aligned to the right end of
+ * the code.  pin_pad[] holds the PIN digits already in position, with
+ * zeroes on the left.
+ */
+static inline __attribute__((always_inline))
+void format_code(const uint8_t *key, int blk, int digits, int use_pin,
+		 const uint8_t *pin_pad, char *code_out)
+{
+	uint32_t tokencode = (key[blk + 0] << 24) | (key[blk + 1] << 16) |
+			     (key[blk + 2] << 8)  | (key[blk + 3] << 0);
+	int j;
+
+	code_out[digits] = 0;
+	for (j = digits - 1; j >= 0; j--) {
 		uint8_t c = tokencode % 10;
-		tokencode /= 10;
 
-		if (i < pin_len)
-			c += t->pin[pin_len - i - 1] - '0';
-		code_out[j] = c % 10 + '0';
+		tokencode /= 10;
+		if (use_pin) {
+			c += pin_pad[j];
+			c -= c >= 10 ? 10 : 0;
+		}
+		code_out[j] = c + '0';
 	}
 }
 
-int securid_encode_token(const struct securid_token *t, const char *pass,
-			 const char *devid, int version, char *out)
+static inline int token_digits(const struct securid_token *t)
 {
-	struct securid_token newt = *t;
+	return ((t->flags & FLD_DIGIT_MASK) >> FLD_DIGIT_SHIFT) + 1;
+}
+
+/*
+ * NAME_many: one token, N times (consecutive times share most of the AES
+ * chain).  NAME_multi: N tokens in TOKENS[IDX[0..N-1]], all at time NOW
+ * (the time key is computed once).
+ */
+#define DEFINE_KERNEL(NAME, DIGITS, INTERVAL, USE_PIN)			\
+static void NAME##_many(const struct securid_token *t,			\
+	const time_t *now, int n,					\
+	char (*codes_out)[STOKEN_MAX_TOKENCODE + 1])			\
+{									\
+	struct securid_time_key tk[TIME_KEY_BATCH];			\
+	struct securid_chain chain;					\
+	int i, j, chunk;						\
+									\
+	chain.levels = 0;						\
+	for (i = 0; i < n; i += chunk) {				\
+		chunk = n - i > TIME_KEY_BATCH ? TIME_KEY_BATCH : n - i; \
+		time_keys(&now[i], chunk, INTERVAL, tk);		\
+		for (j = 0; j < chunk; j++)				\
+			format_code(chain_update(t, &chain,		\
+						 tk[j].bcd_time),	\
+				    tk[j].blk, DIGITS, USE_PIN,		\
+				    t->pin_pad, codes_out[i + j]);	\
+	}								\
+}									\
+									\
+static void NAME##_multi(struct securid_token *const *tokens,		\
+	const int *idx, int n, time_t now,				\
+	char (*codes_out)[STOKEN_MAX_TOKENCODE + 1])			\
+{									\
+	struct securid_time_key tk;					\
+	int i;								\
+									\
+	time_keys(&now, 1, INTERVAL, &tk);				\
+	for (i = 0; i < n; i++) {					\
+		const struct securid_token *t = tokens[idx[i]];		\
+		struct securid_chain chain;				\
+									\
+		chain.levels = 0;					\
+		format_code(chain_update(t, &chain, tk.bcd_time),	\
+			    tk.blk, DIGITS, USE_PIN, t->pin_pad,	\
+			    codes_out[idx[i]]);				\
+	}								\
+}
+
+DEFINE_KERNEL(kernel_6_30,       6,		   30, 0)
+DEFINE_KERNEL(kernel_6_30_pin,   6,		   30, 1)
+DEFINE_KERNEL(kernel_6_60,       6,		   60, 0)
+DEFINE_KERNEL(kernel_6_60_pin,   6,		   60, 1)
+DEFINE_KERNEL(kernel_8_30,       8,		   30, 0)
+DEFINE_KERNEL(kernel_8_30_pin,   8,		   30, 1)
+DEFINE_KERNEL(kernel_8_60,       8,		   60, 0)
+DEFINE_KERNEL(kernel_8_60_pin,   8,		   60, 1)
+DEFINE_KERNEL(kernel_any_30,     token_digits(t), 30, 0)
+DEFINE_KERNEL(kernel_any_30_pin, token_digits(t), 30, 1)
+DEFINE_KERNEL(kernel_any_60,     token_digits(t), 60, 0)
+DEFINE_KERNEL(kernel_any_60_pin, token_digits(t), 60, 1)
+
+#define KERNEL(NAME)	{ NAME##_many, NAME##_multi }
+
+/* indexed by [digits: 6, 8, other][interval: 30, 60][PIN] */
+static const struct securid_kernel kernels[3][2][2] = {
+	{ { KERNEL(kernel_6_30),   KERNEL(kernel_6_30_pin) },
+	  { KERNEL(kernel_6_60),   KERNEL(kernel_6_60_pin) } },
+	{ { KERNEL(kernel_8_30),   KERNEL(kernel_8_30_pin) },
+	  { KERNEL(kernel_8_60),   KERNEL(kernel_8_60_pin) } },
+	{ { KERNEL(kernel_any_30), KERNEL(kernel_any_30_pin) },
+	  { KERNEL(kernel_any_60), KERNEL(kernel_any_60_pin) } },
+};
+
+#define N_KERNELS	(sizeof(kernels) / sizeof(struct securid_kernel))
+
+void securid_prepare_token(struct securid_token *t)
+{
+	int digits = token_digits(t), pin_len = strlen(t->pin), i;
+	int use_pin = pin_len != 0;
+
+	memset(t->pin_pad, 0, sizeof(t->pin_pad));
+	for (i = 0; i < pin_len && i < digits; i++)
+		t->pin_pad[digits - i - 1] = t->pin[pin_len - i - 1] - '0';
+
+	t->kernel = &kernels[digits == 6 ? 0 : digits == 8 ? 1 : 2]
+			    [securid_token_interval(t) == 60][use_pin];
+	t->kernel_flags = t->flags;
+	memcpy(t->kernel_pin, t->pin, sizeof(t->kernel_pin));
+}
+
+/* the PIN can be changed at any time, e.g. by stoken_compute_tokencode() */
+static const struct securid_kernel *token_kernel(struct securid_token *t)
+{
+	if (!t->kernel || t->kernel_flags != t->flags ||
+	    memcmp(t->kernel_pin, t->pin, sizeof(t->pin)))
+		securid_prepare_token(t);
+	return t->kernel;
+}
+
+void securid_compute_tokencode(struct securid_token *t, time_t now,
+			       char *code_out)
+{
+	char codes[1][STOKEN_MAX_TOKENCODE + 1];
+
+	token_kernel(t)->many(t, &now, 1, codes);
+	memcpy(code_out, codes[0], sizeof(codes[0]));
+}
+
+void securid_compute_tokencodes(struct securid_token *t, const time_t *now,
+				int n, char (*codes_out)[STOKEN_MAX_TOKENCODE + 1])
+{
+	token_kernel(t)->many(t, now, n, codes_out);
+}
+
+struct multi_group {
+	const struct securid_kernel	*kernel;
+	struct securid_token *const	*tokens;
+	const int			*idx;
+	time_t				now;
+	char				(*codes_out)[STOKEN_MAX_TOKENCODE + 1];
+};
+
+static void multi_group_range(void *arg, int start, int end)
+{
+	struct multi_group *g = arg;
 
+	g->kernel->multi(g->tokens, &g->idx[start], end - start, g->now,
+			 g->codes_out);
+}
+
+void securid_compute_tokencodes_multi(struct securid_token *const *tokens,
+	int n, time_t now, char (*codes_out)[STOKEN_MAX_TOKENCODE + 1])
+{
+	int count[N_KERNELS + 1] = { 0 }, *idx, i, k;
+	const struct securid_kernel *base = &kernels[0][0][0];
+
+	idx = malloc(n * sizeof(*idx));
+	if (!idx) {
+		/* still correct, just not grouped */
+		for (i = 0; i < n; i++)
+			securid_compute_tokencode(tokens[i], now,
+						  codes_out[i]);
+		return;
+	}
+
+	/* counting sort by kernel, so that each group runs branch-free */
+	for (i = 0; i < n; i++)
+		count[token_kernel(tokens[i]) - base + 1]++;
+	for (k = 1; k <= N_KERNELS; k++)
+		count[k] += count[k - 1];
+	for (i = 0; i < n; i++)
+		idx[count[tokens[i]->kernel - base]++] = i;
+
+	for (k = 0, i = 0; k < N_KERNELS; k++) {
+		struct multi_group g = { &base[k], tokens, &idx[i], now,
+					 codes_out };
+
+		__stoken_parallel_for(count[k] - i, MULTI_GRAIN,
+				      &multi_group_range, &g);
+		i = count[k];
+	}
+	free(idx);
+}
+
+static void encode_flags(struct securid_token *newt, const char **pass,
+			 const char **devid)
+{
 	/* empty password means "no password" */
-	if (!pass || !strlen(pass)) {
-		pass = NULL;
-		newt.flags &= ~FL_PASSPROT;
+	if (!*pass || !strlen(*pass)) {
+		*pass = NULL;
+		newt->flags &= ~FL_PASSPROT;
 	} else
-		newt.flags |= FL_PASSPROT;
+		newt->flags |= FL_PASSPROT;
 
-	if (!devid || !strlen(devid)) {
-		devid = NULL;
-		newt.flags &= ~FL_SNPROT;
+	if (!*devid || !strlen(*devid)) {
+		*devid = NULL;
+		newt->flags &= ~FL_SNPROT;
 	} else
-		newt.flags |= FL_SNPROT;
+		newt->flags |= FL_SNPROT;
+}
+
+int securid_encode_token(const struct securid_token *t, const char *pass,
+			 const char *devid, int version, char *out)
+{
+	struct securid_token newt = *t;
+	int rc;
 
+	encode_flags(&newt, &pass, &devid);
 	if (version == 3)
-		return v3_encode_token(&newt, pass, devid, out);
+		rc = v3_encode_token(&newt, pass, devid, out);
 	else
-		return v2_encode_token(&newt, pass, devid, out);
+		rc = v2_encode_token(&newt, pass, devid, out);
+	memset(&newt, 0, sizeof(newt));
+	return rc;
+}
+
+void securid_encode_tokens(const struct securid_token *const *t,
+	const char *const *pass, const char *const *devid, int version,
+	char *const *out, int *rc, int n)
+{
+	struct securid_token newt;
+	struct v3_enc *e;
+	uint8_t (*kdf_pass)[V3_KDF_PASS_MAX], *salt, *keys;
+	const uint8_t **kdf_ptr;
+	int *kdf_len, *idx, i, j, m = 0;
+
+	e = calloc(n, sizeof(*e));
+	idx = calloc(n, sizeof(*idx));
+	kdf_pass = calloc(2 * n, sizeof(*kdf_pass));
+	kdf_ptr = calloc(2 * n, sizeof(*kdf_ptr));
+	kdf_len = calloc(2 * n, sizeof(*kdf_len));
+	salt = calloc(2 * n, V3_NONCE_BYTES);
+	keys = calloc(2 * n, SHA256_HASH_SIZE);
+
+	for (i = 0; i < n; i++) {
+		const char *p = pass ? pass[i] : NULL;
+		const char *d = devid ? devid[i] : NULL;
+
+		newt = *t[i];
+		encode_flags(&newt, &p, &d);
+
+		/* v2, out of memory, or too long to batch: one at a time */
+		if (version != 3 || !keys || !salt || !kdf_len || !kdf_ptr ||
+		    !kdf_pass || !idx || !e || (p && strlen(p) > MAX_PASS)) {
+			rc[i] = version == 3 ?
+				v3_encode_token(&newt, p, d, out[i]) :
+				v2_encode_token(&newt, p, d, out[i]);
+			continue;
+		}
+
+		rc[i] = v3_encode_begin(&newt, p, d, &e[m]);
+		if (rc[i] != ERR_NONE)
+			continue;
+		idx[m] = i;
+
+		/* keys 2m and 2m+1 are v3_derive_key() key IDs 0 and 1 */
+		for (j = 2 * m; j < 2 * m + 2; j++) {
+			kdf_len[j] = v3_kdf_pass(p, e[m].devid, e[m].v3.nonce,
+						 j & 1, kdf_pass[j]);
+			kdf_ptr[j] = kdf_pass[j];
+			memcpy(&salt[j * V3_NONCE_BYTES], e[m].v3.nonce,
+			       V3_NONCE_BYTES);
+		}
+		m++;
+	}
+	memset(&newt, 0, sizeof(newt));
+
+	if (m) {
+		pbkdf2_sha256_multi(kdf_ptr, kdf_len, salt, V3_NONCE_BYTES,
+				    V3_PBKDF2_ROUNDS, keys, 2 * m);
+		for (i = 0; i < m; i++)
+			v3_encode_finish(&e[i],
+					 &keys[(2 * i + 1) * SHA256_HASH_SIZE],
+					 &keys[2 * i * SHA256_HASH_SIZE],
+					 out[idx[i]]);
+	}
+
+	if (e)
+		memset(e, 0, n * sizeof(*e));
+	if (kdf_pass)
+		memset(kdf_pass, 0, 2 * n * sizeof(*kdf_pass));
+	if (keys)
+		memset(keys, 0, 2 * n * SHA256_HASH_SIZE);
+	free(e);
+	free(idx);
+	free(kdf_pass);
+	free(kdf_ptr);
+	free(kdf_len);
+	free(salt);
+	free(keys);
 }
 
 int securid_random_token(struct securid_token *t)
@@ -967,6 +1732,11 @@ time_t securid_unix_exp_date(const struct securid_token *t)
 	return SECURID_EPOCH + (t->exp_date + 1) * 60 * 60 * 24;
 }
 
+int securid_token_digits(const struct securid_token *t)
+{
+	return token_digits(t);
+}
+
 int securid_token_interval(const struct securid_token *t)
 {
 	if (((t->flags & FLD_NUMSECONDS_MASK) >> FLD_NUMSECONDS_SHIFT) == 0)
@@ -35,6 +35,13 @@
 #define SHA256_BLOCK_SIZE	64
 #define SHA256_HASH_SIZE	32
 
+/* securid_rand() generator: output buffered per refill, and reseed interval */
+#define RAND_BUF_BYTES		1024
+#define RAND_RESEED_BYTES	(1L << 20)
+
+/* securid_find_devid() splits long candidate lists across threads */
+#define DEVID_SCAN_GRAIN	1024
+
 #define MIN_PIN			4
 #define MAX_PIN			8
 
@@ -105,8 +112,46 @@
 /* V3 tokens use 1970/01/01 as the epoch, but each day has 337500 ticks */
 #define SECURID_V3_DAY		337500
 
+/* number of time keys converted at once by securid_compute_tokencodes() */
+#define TIME_KEY_BATCH		64
+
+/* securid_compute_tokencodes_multi() tokens per parallel task */
+#define MULTI_GRAIN		256
+
+#define CHAIN_LEVELS		5
+
+/* securid_mac_multi() messages in flight, and securid_decode_tokens() group */
+#define MAC_LANES		16
+
+/* generate_key_hash() results remembered by a securid_key_cache */
+#define KEY_CACHE_SLOTS		16
+
 struct sdtid;
 struct v3_token;
+struct securid_key_cache;
+
+struct securid_time_key {
+	uint8_t			bcd_time[8];
+	/* byte offset of the tokencode within the final AES block */
+	int			blk;
+};
+
+struct securid_chain {
+	int			levels;
+	uint8_t			bcd_time[8];
+	uint8_t			key[CHAIN_LEVELS][AES_KEY_SIZE];
+};
+
+struct securid_token;
+
+/* tokencode kernel specialized for one digits/interval/PIN combination */
+struct securid_kernel {
+	void (*many)(const struct securid_token *t, const time_t *now, int n,
+		     char (*codes_out)[STOKEN_MAX_TOKENCODE + 1]);
+	void (*multi)(struct securid_token *const *tokens, const int *idx,
+		      int n, time_t now,
+		      char (*codes_out)[STOKEN_MAX_TOKENCODE + 1]);
+};
 
 struct securid_token {
 	int			version;
@@ -131,22 +176,95 @@ struct securid_token {
 	struct sdtid		*sdtid;
 	int			interactive;
 	struct v3_token		*v3;
+	/* sdtid and v3 have been released; see securid_finalize_token() */
+	int			finalized;
+
+	/* optional, shared by tokens in a batch; see securid_key_cache_new() */
+	struct securid_key_cache *key_cache;
+
+	/* set by securid_prepare_token(), for the FLAGS and PIN it saw */
+	const struct securid_kernel *kernel;
+	uint16_t		kernel_flags;
+	char			kernel_pin[MAX_PIN + 1];
+	uint8_t			pin_pad[STOKEN_MAX_TOKENCODE];
 };
 
 int securid_decode_token(const char *in, struct securid_token *t);
+/*
+ * Decode N token strings into T[0..N-1], which must be zeroed, storing
+ * each result in RC.  The v2 checksums are verified with interleaved MACs.
+ */
+void securid_decode_tokens(const char *const *in, int n,
+	struct securid_token *t, int *rc);
 int securid_decrypt_seed(struct securid_token *t, const char *pass,
 	const char *devid);
 int securid_check_devid(struct securid_token *t, const char *devid);
+
+/*
+ * Once the seed has been decrypted, release what was only needed to get
+ * there: the parsed sdtid document and the v3 blob.  The token can still
+ * compute tokencodes and be re-encoded, but securid_decrypt_seed() and
+ * the devid checks fail from then on.
+ */
+void securid_finalize_token(struct securid_token *t);
+
+/*
+ * Best effort: keep the LEN bytes of whole pages at P out of swap and core
+ * dumps.  Returns nonzero if they were locked.
+ */
+int securid_lock_pages(void *p, size_t len);
+
+/*
+ * Bulk operations often re-wrap many tokens with the same password and
+ * device ID.  Tokens pointing to a key cache reuse the v2 key hash instead
+ * of recomputing the MAC each time.  The cache holds passwords, so it is
+ * kept in locked memory and wiped when freed.  It may be shared between
+ * threads.
+ */
+struct securid_key_cache *securid_key_cache_new(void);
+void securid_key_cache_free(struct securid_key_cache *c);
+
+/*
+ * Return the index of the first of the N CANDIDATES that matches the
+ * token's device ID hash, or -1 if there is no match (or the token isn't
+ * bound to a device).  No password is needed.
+ */
+int securid_find_devid(const struct securid_token *t,
+		       const char * const *candidates, int n);
+
+/*
+ * Select the tokencode kernel for the token's current flags and PIN.  The
+ * compute functions below do this on demand whenever either one changed,
+ * so calling it up front only moves the work out of the hot path.
+ */
+void securid_prepare_token(struct securid_token *t);
 void securid_compute_tokencode(struct securid_token *t, time_t now,
 	char *code_out);
+void securid_compute_tokencodes(struct securid_token *t, const time_t *now,
+	int n, char (*codes_out)[STOKEN_MAX_TOKENCODE + 1]);
+/* one tokencode for each of the N TOKENS, all at time NOW */
+void securid_compute_tokencodes_multi(struct securid_token *const *tokens,
+	int n, time_t now, char (*codes_out)[STOKEN_MAX_TOKENCODE + 1]);
+void securid_time_keys(const time_t *now, int n, int interval,
+	struct securid_time_key *out);
 void securid_token_info(const struct securid_token *t,
 	void (*callback)(const char *key, const char *value));
 int securid_encode_token(const struct securid_token *t, const char *pass,
 	const char *devid, int version, char *out);
+/*
+ * securid_encode_token() for N tokens, with PASS[i] and DEVID[i] (either
+ * array may be NULL) for T[i], writing OUT[i] and storing the return value
+ * in RC[i].  For v3, the PBKDF2 key derivations of the whole batch run
+ * together through pbkdf2_sha256_multi().
+ */
+void securid_encode_tokens(const struct securid_token *const *t,
+	const char *const *pass, const char *const *devid, int version,
+	char *const *out, int *rc, int n);
 int securid_random_token(struct securid_token *t);
 int securid_check_exp(struct securid_token *t, time_t now);
 time_t securid_unix_exp_date(const struct securid_token *t);
 int securid_token_interval(const struct securid_token *t);
+int securid_token_digits(const struct securid_token *t);
 
 char *securid_encrypt_pin(const char *pin, const char *password);
 int securid_decrypt_pin(const char *enc_pin, const char *password, char *pin);
@@ -156,8 +274,6 @@ int securid_pin_required(const struct securid_token *t);
 int securid_pass_required(const struct securid_token *t);
 int securid_devid_required(const struct securid_token *t);
 
-void aes128_ecb_decrypt(const uint8_t *key, const uint8_t *in, uint8_t *out);
-void aes128_ecb_encrypt(const uint8_t *key, const uint8_t *in, uint8_t *out);
 int securid_rand(void *out, int len, int paranoid);
 
 #endif /* !__STOKEN_SECURID_H__ */
@@ -0,0 +1,361 @@
+/*
+ * shm.c - shared-memory tokencode table
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "securid.h"
+#include "stoken.h"
+#include "stoken-internal.h"
+
+/*
+ * The publisher (e.g. "stoken publish") owns a POSIX shared memory object
+ * holding the current and next tokencodes of each token it holds.  Seeds
+ * never leave the publisher; readers map the object read-only.
+ *
+ * Each slot is guarded by a sequence lock: the publisher makes SEQ odd,
+ * rewrites the slot, then makes SEQ even again.  A reader copies the slot
+ * and retries if SEQ was odd or changed underneath it, so a read is a
+ * handful of loads and never blocks the publisher.
+ */
+
+#define SHM_MAGIC		0x4e4b5453	/* "STKN" */
+#define SHM_VERSION		1
+
+/* a publisher that died mid-update leaves SEQ odd forever */
+#define SHM_MAX_SPINS		(1 << 20)
+
+struct shm_slot {
+	uint32_t		seq;
+	int32_t			interval;
+	/* interval number (UNIX time / interval) of codes[0] */
+	int64_t			n;
+	char			serial[SERIAL_CHARS + 1];
+	char			codes[2][STOKEN_MAX_TOKENCODE + 1];
+} __attribute__((aligned(64)));
+
+struct shm_header {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		slot_size;
+	uint32_t		n_slots;
+	/* slots [0, n_used) have been published at least once */
+	uint32_t		n_used;
+} __attribute__((aligned(64)));
+
+struct stoken_shm {
+	char			*name;
+	int			writable;
+	size_t			len;
+	struct shm_header	*hdr;
+	struct shm_slot		*slots;
+};
+
+static char *shm_name(const char *name)
+{
+	char *ret;
+
+	if (name)
+		return strdup(name);
+	if (asprintf(&ret, "/stoken-%u", (unsigned int)getuid()) < 0)
+		return NULL;
+	return ret;
+}
+
+/*
+ * The default name is in a world-writable directory, so anyone could have
+ * created the object first.  Only trust one that we own and that nobody
+ * else can open.
+ */
+static int shm_owned(int fd, struct stat *st)
+{
+	if (fstat(fd, st) < 0)
+		return 0;
+	if (st->st_uid != geteuid() || (st->st_mode & (S_IRWXG | S_IRWXO))) {
+		errno = EPERM;
+		return 0;
+	}
+	return 1;
+}
+
+static void shm_free(struct stoken_shm *shm)
+{
+	if (shm->hdr)
+		munmap(shm->hdr, shm->len);
+	free(shm->name);
+	free(shm);
+}
+
+/***********************************************************************
+ * Publisher
+ ***********************************************************************/
+
+struct stoken_shm *stoken_shm_create(const char *name, int max_tokens)
+{
+	struct stoken_shm *shm;
+	struct stat st;
+	int fd, saved;
+
+	if (max_tokens < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+	shm->name = shm_name(name);
+	if (!shm->name)
+		goto err;
+	shm->writable = 1;
+	shm->len = sizeof(struct shm_header) +
+		   max_tokens * sizeof(struct shm_slot);
+
+	/*
+	 * Start over if a previous publisher left a stale table behind.  If
+	 * the name belongs to another user, the unlink fails and the create
+	 * fails with EEXIST.
+	 */
+	shm_unlink(shm->name);
+	fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		goto err;
+	if (!shm_owned(fd, &st) || ftruncate(fd, shm->len) < 0) {
+		close(fd);
+		shm_unlink(shm->name);
+		goto err;
+	}
+	shm->hdr = mmap(NULL, shm->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		shm_unlink(shm->name);
+		goto err;
+	}
+	shm->slots = (struct shm_slot *)(shm->hdr + 1);
+
+	shm->hdr->version = SHM_VERSION;
+	shm->hdr->slot_size = sizeof(struct shm_slot);
+	shm->hdr->n_slots = max_tokens;
+	__atomic_store_n(&shm->hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return shm;
+
+err:
+	/* keep errno for the caller */
+	saved = errno;
+	shm_free(shm);
+	errno = saved;
+	return NULL;
+}
+
+static void slot_write_begin(struct shm_slot *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_write_end(struct shm_slot *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+int __stoken_shm_publish(struct stoken_shm *shm,
+			 struct securid_token *t, time_t now)
+{
+	struct shm_header *hdr = shm->hdr;
+	struct shm_slot *s = NULL;
+	int interval = securid_token_interval(t);
+	char codes[2][STOKEN_MAX_TOKENCODE + 1];
+	time_t when[2];
+	uint32_t i;
+
+	if (!shm->writable)
+		return -EINVAL;
+
+	for (i = 0; i < hdr->n_used; i++)
+		if (!strcmp(shm->slots[i].serial, t->serial)) {
+			s = &shm->slots[i];
+			break;
+		}
+	if (!s) {
+		if (hdr->n_used == hdr->n_slots)
+			return -ENOSPC;
+		s = &shm->slots[hdr->n_used];
+	}
+
+	when[0] = now - now % interval;
+	when[1] = when[0] + interval;
+	securid_compute_tokencodes(t, when, 2, codes);
+
+	slot_write_begin(s);
+	s->interval = interval;
+	s->n = now / interval;
+	strncpy(s->serial, t->serial, sizeof(s->serial));
+	memcpy(s->codes, codes, sizeof(codes));
+	slot_write_end(s);
+
+	if (s == &shm->slots[hdr->n_used])
+		__atomic_store_n(&hdr->n_used, hdr->n_used + 1,
+				 __ATOMIC_RELEASE);
+
+	memset(codes, 0, sizeof(codes));
+	return 0;
+}
+
+void stoken_shm_destroy(struct stoken_shm *shm)
+{
+	if (!shm)
+		return;
+	if (shm->writable) {
+		uint32_t i;
+
+		/* readers that still have it mapped will get -EAGAIN */
+		for (i = 0; i < shm->hdr->n_used; i++) {
+			struct shm_slot *s = &shm->slots[i];
+
+			slot_write_begin(s);
+			s->interval = 0;
+			memset(s->codes, 0, sizeof(s->codes));
+			slot_write_end(s);
+		}
+		shm_unlink(shm->name);
+	}
+	shm_free(shm);
+}
+
+/***********************************************************************
+ * Reader
+ ***********************************************************************/
+
+struct stoken_shm *stoken_shm_open(const char *name)
+{
+	struct stoken_shm *shm;
+	struct stat st;
+	int fd, saved;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+	shm->name = shm_name(name);
+	if (!shm->name)
+		goto err;
+
+	fd = shm_open(shm->name, O_RDONLY, 0);
+	if (fd < 0)
+		goto err;
+	if (!shm_owned(fd, &st)) {
+		close(fd);
+		goto err;
+	}
+	if (st.st_size < (off_t)sizeof(struct shm_header)) {
+		close(fd);
+		errno = EINVAL;
+		goto err;
+	}
+	shm->len = st.st_size;
+	shm->hdr = mmap(NULL, shm->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		goto err;
+	}
+	shm->slots = (struct shm_slot *)(shm->hdr + 1);
+
+	if (__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+	    shm->hdr->version != SHM_VERSION ||
+	    shm->hdr->slot_size != sizeof(struct shm_slot) ||
+	    shm->len < sizeof(struct shm_header) +
+		       shm->hdr->n_slots * sizeof(struct shm_slot)) {
+		errno = EINVAL;
+		goto err;
+	}
+	return shm;
+
+err:
+	/* keep errno for the caller */
+	saved = errno;
+	shm_free(shm);
+	errno = saved;
+	return NULL;
+}
+
+static int read_slot(const struct shm_slot *s, struct shm_slot *copy)
+{
+	uint32_t seq;
+	int spins;
+
+	for (spins = 0; spins < SHM_MAX_SPINS; spins++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, s, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+int stoken_shm_read(struct stoken_shm *shm, const char *serial, time_t when,
+	char *out)
+{
+	uint32_t i, n_used;
+
+	n_used = __atomic_load_n(&shm->hdr->n_used, __ATOMIC_ACQUIRE);
+	if (n_used > shm->hdr->n_slots)
+		return -EIO;
+
+	for (i = 0; i < n_used; i++) {
+		struct shm_slot s;
+		int64_t n;
+
+		if (read_slot(&shm->slots[i], &s))
+			return -EAGAIN;
+		if (serial && strncmp(s.serial, serial, sizeof(s.serial)))
+			continue;
+
+		/* the publisher exited, or stopped updating this token */
+		if (s.interval <= 0)
+			return -EAGAIN;
+		n = when / s.interval;
+		if (n < s.n || n > s.n + 1)
+			return -EAGAIN;
+		memcpy(out, s.codes[n - s.n], STOKEN_MAX_TOKENCODE + 1);
+		out[STOKEN_MAX_TOKENCODE] = 0;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+void stoken_shm_close(struct stoken_shm *shm)
+{
+	if (shm)
+		shm_free(shm);
+}
@@ -21,6 +21,8 @@
 #ifndef __STOKEN_INTERNAL_H__
 #define __STOKEN_INTERNAL_H__
 
+#include <stdint.h>
+
 #include "stoken.h"
 
 #define BUFLEN			2048
@@ -56,12 +58,64 @@ static inline void __stoken_warn_empty(const char *fmt, ...) { }
 
 int __stoken_parse_and_decode_token(const char *str, struct securid_token *t,
 				    int interactive);
+/* N non-interactive strings; v2 checksums are verified in batches */
+void __stoken_parse_and_decode_tokens(const char *const *str, int n,
+				      struct securid_token *t, int *rc);
 int __stoken_read_rcfile(const char *override, struct stoken_cfg *cfg,
 	warn_fn_t warn_fn);
 int __stoken_write_rcfile(const char *override, const struct stoken_cfg *cfg,
 	warn_fn_t warn_fn);
 void __stoken_zap_rcfile_data(struct stoken_cfg *cfg);
 
+struct stoken_keyring;
+int __stoken_keyring_add(struct stoken_keyring *kr,
+			 const struct securid_token *t, const char *pin);
+
+/*
+ * Lazy keyrings (STOKEN_KEYRING_LAZY) take decoded tokens and decrypt them
+ * on first use.  __stoken_keyring_lazy_new() returns NULL if KR isn't lazy
+ * or on allocation failure; either way, tokens should be added eagerly.
+ * Entries take their own references to LAZY and DOC.  DOC is the parsed
+ * sdtid document that token #WHICH came from, or NULL for a ctf string.
+ */
+struct keyring_lazy;
+struct sdtid_doc;
+struct keyring_lazy *__stoken_keyring_lazy_new(struct stoken_keyring *kr,
+	const char *pass, const char *devid, const char *pin);
+void __stoken_keyring_lazy_put(struct keyring_lazy *l);
+int __stoken_keyring_add_lazy(struct stoken_keyring *kr,
+			      const struct securid_token *t,
+			      struct keyring_lazy *lazy,
+			      struct sdtid_doc *doc, int which);
+
+/* the caller frees *OUT */
+int __stoken_code_table_build(struct securid_token *t, int64_t first_day,
+			      int n_days, uint8_t **out, size_t *len);
+
+struct stoken_shm;
+int __stoken_shm_publish(struct stoken_shm *shm,
+			 struct securid_token *t, time_t now);
+
+struct stoken_subscription;
+struct stoken_subscription *__stoken_subscribe(const struct securid_token *t,
+	const char *pin);
+
+/*
+ * Shared work-stealing executor.  __stoken_parallel_for() calls FN on
+ * subranges of [0, N), no smaller than GRAIN items unless N itself is, and
+ * returns when all of them are done.  __stoken_exec_async() returns -1 if
+ * there are no worker threads to run FN.
+ */
+typedef void (exec_fn_t)(void *arg, int start, int end);
+void __stoken_parallel_for(int n, int grain, exec_fn_t *fn, void *arg);
+int __stoken_exec_async(void (*fn)(void *arg), void *arg);
+
+struct stoken_job;
+typedef int (job_fn_t)(void *arg);
+/* run FN(ARG) on the job pool; FREE_ARG(ARG) is called by stoken_job_free() */
+struct stoken_job *__stoken_job_submit(job_fn_t *fn,
+	void (*free_arg)(void *arg), void *arg);
+
 #ifdef __ANDROID__
 /* Sigh.  This exists but it isn't in the Bionic headers. */
 int mkstemps(char *path, int slen);
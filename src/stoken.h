@@ -30,7 +30,7 @@ extern "C" {
 #endif
 
 #define STOKEN_API_VER_MAJOR	1
-#define STOKEN_API_VER_MINOR	3
+#define STOKEN_API_VER_MINOR	4
 
 /* Before API version 1.3 (stoken 0.8) this macro didn't exist.
  * Somewhat ironic, that the API version check itself needs to be
@@ -49,6 +49,10 @@ extern "C" {
 #define STOKEN_MAX_TOKENCODE	8
 
 struct stoken_ctx;
+struct stoken_keyring;
+struct stoken_shm;
+struct stoken_job;
+struct stoken_subscription;
 
 struct stoken_info {
 	char			serial[16];
@@ -162,6 +166,26 @@ const struct stoken_guid *stoken_get_guid_list(void);
  */
 int stoken_check_devid(struct stoken_ctx *ctx, const char *devid);
 
+/*
+ * Find which of the N device IDs in CANDIDATES the token is bound to, by
+ * comparing against the device ID hash stored in the token.  The password
+ * is not needed.  Long lists are checked in parallel.  Typical candidates
+ * are the stoken_get_guid_list() class GUIDs and any device IDs known to
+ * the caller.
+ *
+ * For v2 tokens protected by a password, the stored hash is only 15 bits
+ * long.  The returned match is likely but not certain to be correct, so
+ * confirm it with stoken_decrypt_seed().
+ *
+ * Return values:
+ *
+ *   >= 0:    index of the first matching candidate
+ *   -ENOENT: no candidate matched
+ *   -EINVAL: the token is not bound to a device ID
+ */
+int stoken_find_devid(struct stoken_ctx *ctx, const char * const *candidates,
+	int n);
+
 /*
  * Try to decrypt the seed stored in CTX, and compare the MAC to see if
  * decryption was successful.
@@ -178,6 +202,59 @@ int stoken_check_devid(struct stoken_ctx *ctx, const char *devid);
 int stoken_decrypt_seed(struct stoken_ctx *ctx, const char *pass,
 	const char *devid);
 
+/*
+ * Same as stoken_decrypt_seed(), but runs on a libstoken worker thread so
+ * that event-driven callers don't stall while the password is hashed.
+ * PASS and DEVID are copied.  CTX must not be used by the caller until
+ * the job has finished.
+ *
+ * stoken_job_fd() returns a file descriptor that becomes readable once
+ * the job has finished, for use with poll()/epoll.  It stays readable
+ * until the job is freed; do not read from or close it.
+ *
+ * stoken_job_result() returns -EAGAIN while the job is still running,
+ * and the stoken_decrypt_seed() return value afterward.
+ *
+ * stoken_job_notify() arranges for FN(ARG) to be called on the worker
+ * thread as soon as the job finishes, e.g. to resume a coroutine.  It
+ * returns 0 if FN will be called, or 1 if the job has already finished,
+ * in which case FN is never called.  Only one callback can be registered
+ * per job, and the job must not be freed before FN has run.
+ *
+ * stoken_job_free() cancels the job if it has not started yet, and
+ * otherwise waits for it to finish.
+ *
+ * Jobs run on the threads configured by stoken_set_threads().  If there
+ * are none, the job runs before stoken_decrypt_seed_async() returns.
+ *
+ * stoken_decrypt_seed_async() returns NULL on error.
+ */
+struct stoken_job *stoken_decrypt_seed_async(struct stoken_ctx *ctx,
+	const char *pass, const char *devid);
+int stoken_job_fd(struct stoken_job *job);
+int stoken_job_result(struct stoken_job *job);
+typedef void (stoken_job_cb_t)(void *arg);
+int stoken_job_notify(struct stoken_job *job, stoken_job_cb_t *fn,
+	void *arg);
+void stoken_job_free(struct stoken_job *job);
+
+/*
+ * Release everything in CTX that was only needed to decrypt the seed: the
+ * parsed sdtid document, the v3 token blob and the rcfile contents.  The
+ * rest of the token is moved to locked memory (if RLIMIT_MEMLOCK allows).
+ * Afterward, CTX can still compute tokencodes, re-encrypt the seed, and
+ * be added to keyrings, but stoken_decrypt_seed(), stoken_check_devid()
+ * and stoken_find_devid() fail.  stoken_keyring_import_dir() does this
+ * for every token it imports.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -EINVAL: the seed has not been decrypted
+ *   -EIO:    out of memory
+ */
+int stoken_finalize(struct stoken_ctx *ctx);
+
 /*
  * Generate a new token string for the previously-decrypted seed stored
  * in CTX.  PASS and DEVID may be NULL.  The returned string must be freed
@@ -191,6 +268,31 @@ int stoken_decrypt_seed(struct stoken_ctx *ctx, const char *pass,
 char *stoken_encrypt_seed(struct stoken_ctx *ctx, const char *pass,
 	const char *devid);
 
+/*
+ * Configure the worker threads that libstoken uses for batch operations
+ * (e.g. stoken_find_devid() and keyring precomputation) and async jobs.
+ * The thread calling a batch operation also helps with it, so
+ * N_THREADS = 0 runs everything on the caller's thread.  The default is
+ * STOKEN_THREADS_AUTO, one worker per online CPU.
+ *
+ * If N_CPUS is not 0, worker i is pinned to CPUS[i % N_CPUS].  The workers
+ * are started on first use, or right away with STOKEN_THREADS_EAGER.
+ *
+ * Existing workers finish any queued work and are replaced.  This must not
+ * be called while other libstoken functions are running.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -EINVAL: invalid argument
+ *   -EIO:    the threads could not be started
+ */
+#define STOKEN_THREADS_AUTO	-1
+#define STOKEN_THREADS_EAGER	0x01
+
+int stoken_set_threads(int n_threads, const int *cpus, int n_cpus,
+	unsigned int flags);
+
 /*
  * Generate a tokencode from the decrypted seed, for UNIX time WHEN.
  * OUT is allocated by the caller, and must be able to store at least
@@ -213,6 +315,36 @@ char *stoken_encrypt_seed(struct stoken_ctx *ctx, const char *pass,
 int stoken_compute_tokencode(struct stoken_ctx *ctx, time_t when,
 	const char *pin, char *out);
 
+/*
+ * Wake up only when the tokencode changes.  stoken_subscribe() copies the
+ * decrypted token in CTX; CTX may be reused or destroyed afterward.  Like
+ * stoken_finalize(), the copy is kept in locked memory, and
+ * stoken_unsubscribe() wipes it.  PIN follows the same rules as
+ * stoken_compute_tokencode().  It returns NULL on error, including a
+ * missing or invalid PIN, or a platform without timerfd support.
+ *
+ * stoken_subscription_fd() returns a file descriptor for poll()/epoll.
+ * It becomes readable at each interval boundary, and also when the system
+ * clock is set.  Do not read from or close it.
+ *
+ * stoken_subscription_read() should be called once right away, and again
+ * each time the descriptor becomes readable.  It copies the current
+ * tokencode into OUT (at least STOKEN_MAX_TOKENCODE + 1 bytes), stores
+ * the time of the next boundary in *NEXT (if NEXT is not NULL), and
+ * computes the next code ahead of time.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -EIO:    the timer could not be read or rearmed
+ */
+struct stoken_subscription *stoken_subscribe(struct stoken_ctx *ctx,
+	const char *pin);
+int stoken_subscription_fd(struct stoken_subscription *sub);
+int stoken_subscription_read(struct stoken_subscription *sub, char *out,
+	time_t *next);
+void stoken_unsubscribe(struct stoken_subscription *sub);
+
 /*
  * Inject a space in the middle of the code, e.g. "1234 5678".
  * Typical libstoken users would use the formatted tokencode for display
@@ -224,6 +356,292 @@ int stoken_compute_tokencode(struct stoken_ctx *ctx, time_t when,
  */
 char *stoken_format_tokencode(const char *tokencode);
 
+/*
+ * A keyring holds many decrypted tokens, looked up by serial number, for
+ * servers that check tokencodes from a large population of users.  All
+ * keyring functions may be called from multiple threads at once, except
+ * that stoken_keyring_precompute() and stoken_keyring_destroy() must not
+ * race with each other.
+ *
+ * stoken_keyring_new() returns NULL on error.
+ */
+struct stoken_keyring *stoken_keyring_new(void);
+void stoken_keyring_destroy(struct stoken_keyring *kr);
+
+/*
+ * Same as stoken_keyring_new(), but tokens are partitioned by serial number
+ * across N_SHARDS independently locked shards, so that threads working on
+ * different users don't contend.  N_SHARDS may be 0 to use one shard per
+ * CPU this process may run on (at most 1024).  Each shard has a home CPU.
+ *
+ * FLAGS may include:
+ *
+ *   STOKEN_KEYRING_NUMA: allocate each shard's memory on its home CPU's
+ *                        NUMA node
+ *   STOKEN_KEYRING_LAZY: stoken_keyring_import_dir() only decodes tokens
+ *                        and indexes them by serial number; each seed is
+ *                        decrypted the first time the token is used.  v3
+ *                        ctf strings are still decrypted up front, since
+ *                        their serial numbers are encrypted.
+ *
+ * Returns NULL on error.
+ */
+#define STOKEN_KEYRING_NUMA	0x01
+#define STOKEN_KEYRING_LAZY	0x02
+
+struct stoken_keyring *stoken_keyring_new_sharded(int n_shards,
+	unsigned int flags);
+
+/*
+ * Copy the token in CTX into KR.  The seed must already have been
+ * decrypted with stoken_decrypt_seed(); CTX may be reused or destroyed
+ * afterward.  PIN follows the same rules as stoken_compute_tokencode().
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -EINVAL: seed not decrypted, or PIN missing/invalid
+ *   -EEXIST: a token with the same serial number is already present
+ *   -EIO:    out of memory
+ */
+int stoken_keyring_add(struct stoken_keyring *kr, struct stoken_ctx *ctx,
+	const char *pin);
+
+/*
+ * Return values:
+ *
+ *   0:       success
+ *   -ENOENT: no such serial number
+ */
+int stoken_keyring_remove(struct stoken_keyring *kr, const char *serial);
+
+/*
+ * Same as stoken_compute_tokencode(), for the token with serial number
+ * SERIAL.  Precomputed codes are used when available.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -ENOENT: no such serial number
+ *   -EPERM:  the token's seed could not be decrypted (lazy keyrings only)
+ */
+int stoken_keyring_compute_tokencode(struct stoken_keyring *kr,
+	const char *serial, time_t when, char *out);
+
+/*
+ * Start a background thread that keeps the codes for the current interval
+ * and the next INTERVALS-1 intervals of every token precomputed, so that
+ * the burst of logins at each interval boundary is served from memory.
+ * The thread uses at most CPU_PERCENT (1-100) of one CPU while refilling,
+ * and sleeps between interval boundaries once everything is filled.  With
+ * CPU_PERCENT = 100 there is no budget, and refills are spread across the
+ * stoken_set_threads() workers.
+ *
+ * Calling this again restarts the thread with the new settings.  INTERVALS
+ * may be 0 to stop the thread.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -EINVAL: INTERVALS is more than 1440, or CPU_PERCENT is out of range
+ *   -EIO:    the thread could not be created
+ */
+int stoken_keyring_precompute(struct stoken_keyring *kr, int intervals,
+	int cpu_percent);
+
+/*
+ * Check a tokencode entered at time WHEN against the token with serial
+ * number SERIAL.  Codes from up to WINDOW (0-10) intervals either side of
+ * the token's expected clock are accepted, and the token's clock drift is
+ * tracked across calls.  Each interval's code is accepted only once, and
+ * once a code is accepted, earlier codes are rejected.
+ *
+ * Return values:
+ *
+ *   0:       the code is valid
+ *   -EACCES: the code is wrong, or has already been used
+ *   -ENOENT: no such serial number
+ *   -EPERM:  the token's seed could not be decrypted (lazy keyrings only)
+ *   -EINVAL: WINDOW or WHEN is out of range
+ */
+int stoken_keyring_verify(struct stoken_keyring *kr, const char *serial,
+	time_t when, const char *code, int window);
+
+struct stoken_verify_req {
+	const char		*serial;
+	const char		*code;
+	time_t			when;
+	/* set by stoken_keyring_verify_batch() */
+	int			result;
+};
+
+/*
+ * Same as calling stoken_keyring_verify() on each of the N requests in
+ * REQS, storing each return value in REQS[i].result.  Requests are grouped
+ * by shard and the shards are checked on the stoken_set_threads() workers.
+ * Requests for the same token are not processed in any particular order.
+ *
+ * Return values:
+ *
+ *   0:       success; see the result of each request
+ *   -EINVAL: WINDOW is out of range, or a request's WHEN is negative
+ *   -EIO:    out of memory
+ */
+int stoken_keyring_verify_batch(struct stoken_keyring *kr,
+	struct stoken_verify_req *reqs, int n, int window);
+
+struct stoken_keyring_stats {
+	int			n_tokens;
+	/* decrypted seed, PIN and verification state, per token */
+	size_t			token_bytes;
+	/*
+	 * Memory set aside for token state (including free slots), and how
+	 * much of it is locked.  Locking is best effort, limited by
+	 * RLIMIT_MEMLOCK.
+	 */
+	size_t			slot_bytes;
+	size_t			locked_bytes;
+	/* stoken_keyring_precompute() code rings, for all tokens */
+	size_t			ring_bytes;
+	/* hash tables and other bookkeeping */
+	size_t			table_bytes;
+	/* STOKEN_KEYRING_LAZY tokens that haven't been used yet */
+	int			n_pending;
+};
+
+/*
+ * Report how much memory KR is using.  This returns a callee-allocated,
+ * caller-freed struct, which may grow larger in the future.
+ *
+ * Return values:
+ *
+ *   ptr:     success
+ *   NULL:    out of memory
+ */
+struct stoken_keyring_stats *stoken_keyring_get_stats(
+	struct stoken_keyring *kr);
+
+/*
+ * Import every file in directory DIRNAME (except dotfiles) into KR.  A
+ * file may hold ctf strings or URLs, one per line, or an sdtid document;
+ * every token found is added.  All tokens are unlocked with PASS and DEVID,
+ * either of which may be NULL, and PIN follows the same rules as
+ * stoken_keyring_add().  Files are read, decoded and decrypted on the
+ * stoken_set_threads() workers.
+ *
+ * If CALLBACK is not NULL, it is called on the calling thread, in file name
+ * order, once for each token and once for each file that couldn't be used.
+ * SERIAL is NULL if no token was decoded.  RC is 0 on success, or:
+ *
+ *   -EINVAL: the file holds no tokens, or a token is garbled, or the PIN
+ *            is missing/invalid
+ *   -EACCES: wrong password or device ID
+ *   -EEXIST: a token with the same serial number is already present
+ *   -errno:  the file could not be read
+ *
+ * In a STOKEN_KEYRING_LAZY keyring, PASS and DEVID are only checked when
+ * each token is first used, so -EACCES is not reported here; the keyring
+ * keeps copies of PASS, DEVID and PIN until then.
+ *
+ * Returns the number of tokens added, or a negative errno if DIRNAME
+ * cannot be read (-EIO: out of memory).
+ */
+typedef void (stoken_import_cb_t)(void *arg, const char *filename,
+	const char *serial, int rc);
+
+int stoken_keyring_import_dir(struct stoken_keyring *kr,
+	const char *dirname, const char *pass, const char *devid,
+	const char *pin, stoken_import_cb_t *callback, void *arg);
+
+/*
+ * Shared-memory code table.  A long-running process holding decrypted
+ * tokens (e.g. "stoken publish") publishes the current and next tokencodes
+ * of each token into a POSIX shared memory object, readable only by the
+ * same user.  Other local processes read codes from it without decrypting
+ * anything and without making any system calls.  Seeds are never exposed.
+ *
+ * NAME is a shm_open() name such as "/mytoken", or NULL for the default
+ * per-user name.  These functions return NULL on error, with errno set.
+ * stoken_shm_open() fails with EPERM unless the object belongs to the
+ * calling user and has no group or other permissions.
+ * stoken_shm_create() fails with EEXIST if another user already holds
+ * NAME.
+ */
+struct stoken_shm *stoken_shm_create(const char *name, int max_tokens);
+struct stoken_shm *stoken_shm_open(const char *name);
+
+/* publisher: removes the table; readers still mapping it get -EAGAIN */
+void stoken_shm_destroy(struct stoken_shm *shm);
+/* reader */
+void stoken_shm_close(struct stoken_shm *shm);
+
+/*
+ * Publish the codes for the interval containing WHEN and the one after it,
+ * for the decrypted token in CTX.  Call this at least once per interval.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -EINVAL: SHM was opened read-only
+ *   -ENOSPC: MAX_TOKENS different tokens have already been published
+ */
+int stoken_shm_publish(struct stoken_shm *shm, struct stoken_ctx *ctx,
+	time_t when);
+
+/*
+ * Copy the published tokencode for time WHEN into OUT, which must hold
+ * at least (STOKEN_MAX_TOKENCODE + 1) bytes.  SERIAL may be NULL to use
+ * the first published token.
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -ENOENT: no such serial number
+ *   -EAGAIN: WHEN is not covered by the table; the publisher has exited
+ *            or fallen behind
+ *   -EIO:    the table is corrupt
+ */
+int stoken_shm_read(struct stoken_shm *shm, const char *serial, time_t when,
+	char *out);
+
+/*
+ * Precomputed code tables, for verifiers that can't compute tokencodes
+ * themselves.  "stoken export-codes" writes a table holding every
+ * tokencode of one token over a range of whole days (UTC).  All fields
+ * are little-endian:
+ *
+ *   0   8  magic "STKCODES"
+ *   8   2  format version (1)
+ *   10  2  header length (44)
+ *   12  16 serial number, NUL padded
+ *   28  4  first day (days since 1970-01-01)
+ *   32  4  number of days (at most 3660)
+ *   36  2  token interval in seconds (30 or 60)
+ *   38  1  digits per code
+ *   39  1  bits per code: the fewest that hold any code of that many
+ *          digits (27 for 8 digits)
+ *   40  4  codes per day (86400 / interval)
+ *   44  4  for each day, the file offset of that day's codes
+ *
+ * Each day's codes, for intervals 0, 1, 2, ... since midnight, are packed
+ * back to back as unsigned integers, least significant bit first.
+ */
+#define STOKEN_CODE_TABLE_MAX_DAYS	3660
+
+/*
+ * Look up the tokencode for time WHEN in the LEN-byte table at TABLE
+ * (e.g. a file that was read or mapped into memory), and copy it into OUT
+ * (at least STOKEN_MAX_TOKENCODE + 1 bytes).
+ *
+ * Return values:
+ *
+ *   0:       success
+ *   -ERANGE: WHEN is not covered by the table
+ *   -EINVAL: TABLE is not a code table, or it is truncated or corrupt
+ */
+int stoken_code_table_read(const void *table, size_t len, time_t when,
+	char *out);
+
 #ifdef __cplusplus
 }
 #endif
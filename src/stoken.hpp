@@ -0,0 +1,569 @@
+/*
+ * stoken.hpp - C++20 interface to libstoken
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __STOKEN_HPP__
+#define __STOKEN_HPP__
+
+/*
+ * Header-only wrappers around stoken.h; link with libstoken as usual
+ * (pkg-config --cflags --libs stoken-cpp).
+ *
+ * The rules are the same as for the C API, with these differences:
+ *
+ *  - token and keyring own their handles and are move-only.
+ *  - Errors that the C API reports as -errno are thrown as
+ *    std::system_error, except where noted.
+ *  - Strings are passed as std::string_view.  An empty view is passed to
+ *    libstoken as NULL ("not given").  Short strings are copied to the
+ *    stack to add the NUL terminator, and the copies are wiped afterward.
+ *  - Tokencodes are returned in a fixed-size stoken::tokencode, and the
+ *    span-based batch calls never allocate.
+ */
+
+#include "stoken.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace stoken {
+
+/* throw a negative libstoken return value; otherwise pass it through */
+inline int check(int rc)
+{
+	if (rc < 0)
+		throw std::system_error(-rc, std::generic_category());
+	return rc;
+}
+
+class tokencode {
+public:
+	const char *c_str() const noexcept { return buf_.data(); }
+	char *data() noexcept { return buf_.data(); }
+	std::string_view view() const noexcept { return buf_.data(); }
+	operator std::string_view() const noexcept { return view(); }
+
+	bool operator==(const tokencode &other) const noexcept
+	{
+		return view() == other.view();
+	}
+
+private:
+	std::array<char, STOKEN_MAX_TOKENCODE + 1> buf_{};
+};
+
+namespace detail {
+
+inline void wipe(char *p, std::size_t len) noexcept
+{
+	volatile char *v = p;
+
+	while (len--)
+		*v++ = 0;
+}
+
+/* NUL-terminated copy of a string_view, or NULL if it is empty */
+class cstr {
+public:
+	explicit cstr(std::string_view s)
+	{
+		if (s.empty())
+			return;
+		if (s.size() < sizeof(buf_)) {
+			ptr_ = buf_;
+		} else {
+			heap_.reset(new char[s.size() + 1]);
+			ptr_ = heap_.get();
+		}
+		len_ = s.size();
+		std::memcpy(ptr_, s.data(), len_);
+		ptr_[len_] = 0;
+	}
+
+	~cstr()
+	{
+		if (ptr_)
+			wipe(ptr_, len_);
+	}
+
+	cstr(const cstr &) = delete;
+	cstr &operator=(const cstr &) = delete;
+
+	const char *get() const noexcept { return ptr_; }
+
+private:
+	char buf_[64];
+	std::unique_ptr<char[]> heap_;
+	char *ptr_ = nullptr;
+	std::size_t len_ = 0;
+};
+
+/* copy S into OUT for the batch calls; false if it doesn't fit */
+template <std::size_t N>
+bool copy_field(char (&out)[N], std::string_view s) noexcept
+{
+	if (s.size() >= N)
+		return false;
+	std::memcpy(out, s.data(), s.size());
+	out[s.size()] = 0;
+	return true;
+}
+
+/* serial numbers are at most 15 characters (see struct stoken_info) */
+constexpr std::size_t serial_size = sizeof(stoken_info::serial);
+
+} /* namespace detail */
+
+inline void set_threads(int n_threads, std::span<const int> cpus = {},
+			unsigned int flags = 0)
+{
+	check(stoken_set_threads(n_threads, cpus.data(),
+				 static_cast<int>(cpus.size()), flags));
+}
+
+/*
+ * Awaitable for stoken_decrypt_seed_async().  If the job is still running
+ * when it is awaited, the coroutine is resumed on the libstoken worker
+ * thread that finished it, so long continuations should hop to the
+ * caller's own executor.  The token must not be used until the job is
+ * done; destroying the awaitable early cancels or waits for the job.
+ */
+class [[nodiscard]] decrypt_op {
+public:
+	explicit decrypt_op(stoken_job *job) : job_(job)
+	{
+		if (!job_)
+			throw std::bad_alloc();
+	}
+
+	decrypt_op(decrypt_op &&other) noexcept
+		: job_(std::exchange(other.job_, nullptr)) { }
+
+	decrypt_op &operator=(decrypt_op &&other) noexcept
+	{
+		if (this != &other) {
+			stoken_job_free(job_);
+			job_ = std::exchange(other.job_, nullptr);
+		}
+		return *this;
+	}
+
+	~decrypt_op() { stoken_job_free(job_); }
+
+	/* readable once the job has finished, for poll()/epoll */
+	int fd() const noexcept { return stoken_job_fd(job_); }
+
+	bool done() const noexcept
+	{
+		return stoken_job_result(job_) != -EAGAIN;
+	}
+
+	bool await_ready() const noexcept { return done(); }
+
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		return stoken_job_notify(job_, &resume, h.address()) == 0;
+	}
+
+	/* throws std::system_error(EINVAL) for a wrong password or devid */
+	void await_resume() const { check(stoken_job_result(job_)); }
+
+private:
+	static void resume(void *addr)
+	{
+		std::coroutine_handle<>::from_address(addr).resume();
+	}
+
+	stoken_job *job_;
+};
+
+class token {
+public:
+	token() : ctx_(stoken_new())
+	{
+		if (!ctx_)
+			throw std::bad_alloc();
+	}
+
+	/* ctf string, URL, or sdtid document */
+	explicit token(std::string_view str) : token()
+	{
+		detail::cstr s(str);
+
+		check(stoken_import_string(ctx_, s.get() ? s.get() : ""));
+	}
+
+	/* PATH may be NULL to use $HOME/.stokenrc */
+	static token from_rcfile(const char *path = nullptr)
+	{
+		token t;
+
+		check(stoken_import_rcfile(t.ctx_, path));
+		return t;
+	}
+
+	token(token &&other) noexcept
+		: ctx_(std::exchange(other.ctx_, nullptr)) { }
+
+	token &operator=(token &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			ctx_ = std::exchange(other.ctx_, nullptr);
+		}
+		return *this;
+	}
+
+	~token() { reset(); }
+
+	stoken_ctx *get() const noexcept { return ctx_; }
+
+	stoken_ctx *release() noexcept
+	{
+		return std::exchange(ctx_, nullptr);
+	}
+
+	bool pin_required() const noexcept
+	{
+		return stoken_pin_required(ctx_);
+	}
+
+	bool pass_required() const noexcept
+	{
+		return stoken_pass_required(ctx_);
+	}
+
+	bool devid_required() const noexcept
+	{
+		return stoken_devid_required(ctx_);
+	}
+
+	bool check_pin(std::string_view pin) const
+	{
+		detail::cstr p(pin);
+
+		return stoken_check_pin(ctx_, p.get() ? p.get() : "") == 0;
+	}
+
+	bool check_devid(std::string_view devid) const
+	{
+		detail::cstr d(devid);
+
+		return stoken_check_devid(ctx_, d.get() ? d.get() : "") == 0;
+	}
+
+	stoken_info info() const
+	{
+		std::unique_ptr<stoken_info, decltype(&std::free)>
+			p(stoken_get_info(ctx_), &std::free);
+
+		if (!p)
+			throw std::bad_alloc();
+		return *p;
+	}
+
+	void decrypt(std::string_view pass = {}, std::string_view devid = {})
+	{
+		detail::cstr p(pass), d(devid);
+
+		check(stoken_decrypt_seed(ctx_, p.get(), d.get()));
+	}
+
+	/* PASS and DEVID are copied before this returns */
+	decrypt_op decrypt_async(std::string_view pass = {},
+				 std::string_view devid = {})
+	{
+		detail::cstr p(pass), d(devid);
+
+		return decrypt_op(stoken_decrypt_seed_async(ctx_, p.get(),
+							    d.get()));
+	}
+
+	/* see stoken_finalize() */
+	void finalize() { check(stoken_finalize(ctx_)); }
+
+	std::string encrypt(std::string_view pass = {},
+			    std::string_view devid = {}) const
+	{
+		detail::cstr p(pass), d(devid);
+		std::unique_ptr<char, decltype(&std::free)>
+			str(stoken_encrypt_seed(ctx_, p.get(), d.get()),
+			    &std::free);
+
+		if (!str)
+			check(-EIO);
+		return str.get();
+	}
+
+	tokencode compute(std::time_t when = std::time(nullptr),
+			  std::string_view pin = {}) const
+	{
+		detail::cstr p(pin);
+		tokencode out;
+
+		check(stoken_compute_tokencode(ctx_, when, p.get(),
+					       out.data()));
+		return out;
+	}
+
+private:
+	void reset() noexcept
+	{
+		if (ctx_)
+			stoken_destroy(ctx_);
+		ctx_ = nullptr;
+	}
+
+	stoken_ctx *ctx_;
+};
+
+class keyring {
+public:
+	keyring() : kr_(stoken_keyring_new())
+	{
+		if (!kr_)
+			throw std::bad_alloc();
+	}
+
+	explicit keyring(int n_shards, unsigned int flags = 0)
+		: kr_(stoken_keyring_new_sharded(n_shards, flags))
+	{
+		if (!kr_)
+			throw std::bad_alloc();
+	}
+
+	keyring(keyring &&other) noexcept
+		: kr_(std::exchange(other.kr_, nullptr)) { }
+
+	keyring &operator=(keyring &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			kr_ = std::exchange(other.kr_, nullptr);
+		}
+		return *this;
+	}
+
+	~keyring() { reset(); }
+
+	stoken_keyring *get() const noexcept { return kr_; }
+
+	stoken_keyring *release() noexcept
+	{
+		return std::exchange(kr_, nullptr);
+	}
+
+	/* T is copied; it may be destroyed afterward */
+	void add(const token &t, std::string_view pin = {})
+	{
+		detail::cstr p(pin);
+
+		check(stoken_keyring_add(kr_, t.get(), p.get()));
+	}
+
+	/* false if there is no such token */
+	bool remove(std::string_view serial)
+	{
+		char s[detail::serial_size];
+
+		return detail::copy_field(s, serial) &&
+		       stoken_keyring_remove(kr_, s) == 0;
+	}
+
+	tokencode compute(std::string_view serial,
+			  std::time_t when = std::time(nullptr)) const
+	{
+		char s[detail::serial_size];
+		tokencode out;
+
+		check(detail::copy_field(s, serial) ?
+		      stoken_keyring_compute_tokencode(kr_, s, when,
+						       out.data()) :
+		      -ENOENT);
+		return out;
+	}
+
+	/*
+	 * Batch version: RESULTS[i] gets the stoken_keyring_compute_tokencode()
+	 * return value for SERIALS[i].
+	 */
+	void compute(std::span<const std::string_view> serials,
+		     std::time_t when, std::span<tokencode> out,
+		     std::span<int> results) const
+	{
+		char s[detail::serial_size];
+
+		if (out.size() < serials.size() ||
+		    results.size() < serials.size())
+			check(-EINVAL);
+		for (std::size_t i = 0; i < serials.size(); i++)
+			results[i] = detail::copy_field(s, serials[i]) ?
+				stoken_keyring_compute_tokencode(kr_, s, when,
+						out[i].data()) : -ENOENT;
+	}
+
+	/*
+	 * true if CODE is valid; false if it is wrong, already used, or the
+	 * token doesn't exist.  Bad WINDOW/WHEN values throw.
+	 */
+	bool verify(std::string_view serial, std::string_view code,
+		    std::time_t when = std::time(nullptr), int window = 1)
+	{
+		char s[detail::serial_size], c[STOKEN_MAX_TOKENCODE + 1];
+		int rc;
+
+		if (!detail::copy_field(s, serial) ||
+		    !detail::copy_field(c, code))
+			return false;
+		rc = stoken_keyring_verify(kr_, s, when, c, window);
+		if (rc == -EACCES || rc == -ENOENT)
+			return false;
+		check(rc);
+		return true;
+	}
+
+	void verify(std::span<stoken_verify_req> reqs, int window = 1)
+	{
+		check(stoken_keyring_verify_batch(kr_, reqs.data(),
+						  static_cast<int>(reqs.size()),
+						  window));
+	}
+
+	/*
+	 * Batch version for codes that all arrived at WHEN: RESULTS[i] gets
+	 * the stoken_keyring_verify() return value for SERIALS[i] and
+	 * CODES[i].  The requests are built on the stack, verify_chunk at a
+	 * time.
+	 */
+	static constexpr std::size_t verify_chunk = 64;
+
+	void verify(std::span<const std::string_view> serials,
+		    std::span<const std::string_view> codes, std::time_t when,
+		    std::span<int> results, int window = 1)
+	{
+		stoken_verify_req reqs[verify_chunk];
+		char s[verify_chunk][detail::serial_size];
+		char c[verify_chunk][STOKEN_MAX_TOKENCODE + 1];
+		std::size_t idx[verify_chunk];
+
+		if (codes.size() != serials.size() ||
+		    results.size() < serials.size())
+			check(-EINVAL);
+
+		for (std::size_t base = 0; base < serials.size();
+		     base += verify_chunk) {
+			std::size_t end = std::min(serials.size(),
+						   base + verify_chunk);
+			int n = 0;
+
+			for (std::size_t i = base; i < end; i++) {
+				if (!detail::copy_field(s[n], serials[i])) {
+					results[i] = -ENOENT;
+					continue;
+				}
+				if (!detail::copy_field(c[n], codes[i])) {
+					results[i] = -EACCES;
+					continue;
+				}
+				reqs[n] = { s[n], c[n], when, 0 };
+				idx[n++] = i;
+			}
+			check(stoken_keyring_verify_batch(kr_, reqs, n,
+							  window));
+			for (int i = 0; i < n; i++)
+				results[idx[i]] = reqs[i].result;
+		}
+	}
+
+	void precompute(int intervals, int cpu_percent = 100)
+	{
+		check(stoken_keyring_precompute(kr_, intervals, cpu_percent));
+	}
+
+	stoken_keyring_stats stats() const
+	{
+		std::unique_ptr<stoken_keyring_stats, decltype(&std::free)>
+			st(stoken_keyring_get_stats(kr_), &std::free);
+
+		if (!st)
+			throw std::bad_alloc();
+		return *st;
+	}
+
+	/*
+	 * Returns the number of tokens added.  FN(filename, serial, rc) is
+	 * called for each token and for each file that couldn't be used, as
+	 * described for stoken_keyring_import_dir(); SERIAL is empty if it
+	 * isn't known.  FN must not throw.
+	 */
+	template <typename F>
+	int import_dir(const char *dirname, std::string_view pass,
+		       std::string_view devid, std::string_view pin, F &&fn)
+	{
+		using fn_type = std::remove_reference_t<F>;
+		detail::cstr p(pass), d(devid), n(pin);
+		auto cb = [](void *arg, const char *filename,
+			     const char *serial, int rc) {
+			(*static_cast<fn_type *>(arg))(
+				std::string_view(filename),
+				serial ? std::string_view(serial) :
+					 std::string_view(), rc);
+		};
+
+		return check(stoken_keyring_import_dir(kr_, dirname, p.get(),
+			d.get(), n.get(), cb,
+			const_cast<void *>(static_cast<const void *>(&fn))));
+	}
+
+	int import_dir(const char *dirname, std::string_view pass = {},
+		       std::string_view devid = {}, std::string_view pin = {})
+	{
+		detail::cstr p(pass), d(devid), n(pin);
+
+		return check(stoken_keyring_import_dir(kr_, dirname, p.get(),
+			d.get(), n.get(), nullptr, nullptr));
+	}
+
+private:
+	void reset() noexcept
+	{
+		if (kr_)
+			stoken_keyring_destroy(kr_);
+		kr_ = nullptr;
+	}
+
+	stoken_keyring *kr_;
+};
+
+} /* namespace stoken */
+
+#endif /* !__STOKEN_HPP__ */
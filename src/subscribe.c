@@ -0,0 +1,201 @@
+/*
+ * subscribe.c - pollable notification at tokencode interval boundaries
+ *
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#include "securid.h"
+#include "stoken.h"
+#include "stoken-internal.h"
+
+#ifdef HAVE_SYS_TIMERFD_H
+
+/*
+ * A subscription owns a CLOCK_REALTIME timerfd armed for the next interval
+ * boundary, so an idle caller sleeps in poll() until the code actually
+ * changes.  The code for the upcoming interval is computed as soon as the
+ * timer is rearmed, so it is ready when the boundary arrives.  If the
+ * clock is set, TFD_TIMER_CANCEL_ON_SET wakes the caller up early and the
+ * next read starts over from the new time.
+ *
+ * The subscription keeps its own copy of the decrypted seed and PIN, so
+ * like stoken_finalize() it lives in mmap()ed pages that are locked (best
+ * effort) and wiped before they are unmapped.
+ */
+struct stoken_subscription {
+	struct securid_token	t;
+	int			interval;
+	int			fd;
+
+	/* interval number (UNIX time / interval) of codes[0], or -1 */
+	int64_t			n;
+	char			codes[2][STOKEN_MAX_TOKENCODE + 1];
+};
+
+static int arm_timer(struct stoken_subscription *sub, time_t when)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when;
+	return timerfd_settime(sub->fd,
+			       TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			       &its, NULL);
+}
+
+static void free_subscription(struct stoken_subscription *sub)
+{
+	if (sub->fd >= 0)
+		close(sub->fd);
+	memset(sub, 0, sizeof(*sub));
+	munlock(sub, sizeof(*sub));
+	munmap(sub, sizeof(*sub));
+}
+
+struct stoken_subscription *__stoken_subscribe(const struct securid_token *t,
+	const char *pin)
+{
+	struct stoken_subscription *sub;
+
+	if (!t->has_dec_seed)
+		return NULL;
+
+	sub = mmap(NULL, sizeof(*sub), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (sub == MAP_FAILED)
+		return NULL;
+	securid_lock_pages(sub, sizeof(*sub));
+
+	/* only the decrypted seed and metadata are needed from here on */
+	sub->t = *t;
+	sub->t.sdtid = NULL;
+	sub->t.v3 = NULL;
+	sub->t.enc_pin_str = NULL;
+	sub->t.key_cache = NULL;
+	sub->t.interactive = 0;
+	sub->interval = securid_token_interval(t);
+	sub->n = -1;
+	sub->fd = -1;
+
+	if (securid_pin_required(t)) {
+		if (pin && strlen(pin)) {
+			if (securid_pin_format_ok(pin) != ERR_NONE)
+				goto err;
+			strncpy(sub->t.pin, pin, MAX_PIN + 1);
+		} else if (!strlen(sub->t.pin)) {
+			goto err;
+		}
+	}
+	securid_prepare_token(&sub->t);
+
+	sub->fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (sub->fd < 0)
+		goto err;
+
+	/* fire right away, so the first read hands out the current code */
+	if (arm_timer(sub, 1) < 0)
+		goto err;
+	return sub;
+
+err:
+	free_subscription(sub);
+	return NULL;
+}
+
+int stoken_subscription_fd(struct stoken_subscription *sub)
+{
+	return sub->fd;
+}
+
+int stoken_subscription_read(struct stoken_subscription *sub, char *out,
+	time_t *next)
+{
+	uint64_t expirations;
+	struct timespec now;
+	time_t boundary;
+	int64_t n;
+
+	/* EAGAIN: called early; ECANCELED: the clock was set */
+	if (read(sub->fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN && errno != ECANCELED)
+		return -EIO;
+
+	/* time() may use a coarse clock that lags behind the timer */
+	clock_gettime(CLOCK_REALTIME, &now);
+	n = now.tv_sec / sub->interval;
+	if (sub->n >= 0 && n == sub->n + 1)
+		memcpy(sub->codes[0], sub->codes[1], sizeof(sub->codes[0]));
+	else if (n != sub->n)
+		securid_compute_tokencode(&sub->t, n * sub->interval,
+					  sub->codes[0]);
+	sub->n = n;
+	memcpy(out, sub->codes[0], sizeof(sub->codes[0]));
+
+	boundary = (n + 1) * sub->interval;
+	if (arm_timer(sub, boundary) < 0)
+		return -EIO;
+	if (next)
+		*next = boundary;
+
+	/* get the next code ready while the caller sleeps */
+	securid_compute_tokencode(&sub->t, boundary, sub->codes[1]);
+	return 0;
+}
+
+void stoken_unsubscribe(struct stoken_subscription *sub)
+{
+	if (sub)
+		free_subscription(sub);
+}
+
+#else /* !HAVE_SYS_TIMERFD_H */
+
+struct stoken_subscription *__stoken_subscribe(const struct securid_token *t,
+	const char *pin)
+{
+	return NULL;
+}
+
+int stoken_subscription_fd(struct stoken_subscription *sub)
+{
+	return -1;
+}
+
+int stoken_subscription_read(struct stoken_subscription *sub, char *out,
+	time_t *next)
+{
+	return -EIO;
+}
+
+void stoken_unsubscribe(struct stoken_subscription *sub)
+{
+}
+
+#endif /* HAVE_SYS_TIMERFD_H */